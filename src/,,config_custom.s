@@ -131,3 +131,6 @@
 ; --- Other
 
 ;; #CONFIG# COMPRESSION_LVL_2          NO
+;; #CONFIG# COMPRESSION_TAIL_MERGE     NO
+;; #CONFIG# PACKED_OFFSETS             NO
+;; #CONFIG# TK_HASH                    NO
@@ -105,4 +105,7 @@
 
 ; --- Other
 
-;; #CONFIG# COMPRESSION_LVL_2          NO
+;; #CONFIG# COMPRESSION_LVL_2          YES
+;; #CONFIG# COMPRESSION_TAIL_MERGE     NO
+;; #CONFIG# PACKED_OFFSETS             NO
+;; #CONFIG# TK_HASH                    YES
@@ -37,3 +37,4 @@
 !addr tk__byte_offset  = $105 ; offset of the current byte (to place new data) in tk__packed
 
 !addr tk__packed       = $106 ; packed candidate, 25 bytes is enough for worst case - a 16 byte keyword
+!addr tk__hash_end     = $11F ; end of the keyword hash index bucket being searched
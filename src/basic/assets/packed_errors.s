@@ -5,16 +5,23 @@
 ;; #LAYOUT# *   *       #IGNORE
 
 
-!ifdef CONFIG_COMPRESSION_LVL_2 {
+packed_freq_errors:
 
-packed_dict_errors:
+	+PUT_PACKED_FREQ_errors
 
-	+PUT_PACKED_DICT_errors
+!if PACKED_OFFSETS_WIDTH_errors = 1 {
 
-} else {
+packed_offsets_errors:
 
-packed_freq_errors:
+	+PUT_PACKED_OFFSETS_errors
 
-	+PUT_PACKED_FREQ_errors
+} else if PACKED_OFFSETS_WIDTH_errors = 2 {
+
+packed_offsets_lo_errors:
+
+	+PUT_PACKED_OFFSETS_LO_errors packed_freq_errors
+
+packed_offsets_hi_errors:
 
+	+PUT_PACKED_OFFSETS_HI_errors packed_freq_errors
 }
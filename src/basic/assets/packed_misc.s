@@ -5,15 +5,23 @@
 ;; #LAYOUT# *   *       #IGNORE
 
 
-!ifdef CONFIG_COMPRESSION_LVL_2 {
+packed_freq_misc:
 
-packed_dict_misc:
+	+PUT_PACKED_FREQ_misc
 
-	+PUT_PACKED_DICT_misc
+!if PACKED_OFFSETS_WIDTH_misc = 1 {
 
-} else {
+packed_offsets_misc:
 
-packed_freq_misc:
+	+PUT_PACKED_OFFSETS_misc
 
-	+PUT_PACKED_FREQ_misc
+} else if PACKED_OFFSETS_WIDTH_misc = 2 {
+
+packed_offsets_lo_misc:
+
+	+PUT_PACKED_OFFSETS_LO_misc packed_freq_misc
+
+packed_offsets_hi_misc:
+
+	+PUT_PACKED_OFFSETS_HI_misc packed_freq_misc
 }
@@ -0,0 +1,29 @@
+;; #LAYOUT# STD *       #TAKE
+;; #LAYOUT# CRT BASIC_1 #TAKE
+;; #LAYOUT# M65 BASIC_1 #TAKE
+;; #LAYOUT# X16 BASIC_0 #TAKE
+;; #LAYOUT# *   *       #IGNORE
+
+
+!ifdef CONFIG_TK_HASH {
+
+tk_hash_buckets:
+
+	+PUT_TK_HASH_BUCKETS
+
+tk_hash_addr_lo:
+
+	+PUT_TK_HASH_ADDR_LO
+
+tk_hash_addr_hi:
+
+	+PUT_TK_HASH_ADDR_HI
+
+tk_hash_list:
+
+	+PUT_TK_HASH_LIST
+
+tk_hash_token:
+
+	+PUT_TK_HASH_TOKEN
+}
@@ -0,0 +1,94 @@
+;; #LAYOUT# STD *       #TAKE
+;; #LAYOUT# CRT BASIC_1 #TAKE
+;; #LAYOUT# M65 BASIC_1 #TAKE
+;; #LAYOUT# X16 BASIC_0 #TAKE
+;; #LAYOUT# *   *       #IGNORE
+
+;
+; Search for a token using the keyword hash index, generated by 'generate_strings.cc';
+; only the keywords from a single bucket have to be compared
+;
+; Input:
+; - uses same variables as 'tk_pack'
+; Output:
+; - Carry set = not found
+; - .X = index of token found
+; - .Y = keyword list of the token found, 0 for BASIC V2, otherwise extended token prefix
+;
+
+
+!ifdef CONFIG_TK_HASH {
+
+tk_hash_search:
+
+	; Calculate the hash of the packed candidate, same as in 'generate_strings.cc'
+
+	lda tk__packed+0
+	eor #TK__HASH_SEED
+	clc
+	adc tk__packed+1
+	eor tk__packed+2
+	and #TK__HASH_MASK
+	tay
+
+	; Retrieve the bucket boundaries
+
+	lda tk_hash_buckets+1, y
+	sta tk__hash_end
+	ldx tk_hash_buckets+0, y
+
+	; FALLTROUGH
+
+tk_hash_search_loop:
+
+	; Check if end of the bucket
+
+	cpx tk__hash_end
+	bne tk_hash_search_compare_init
+
+	; Not found
+
+	sec
+	rts
+
+tk_hash_search_compare_init:
+
+	lda tk_hash_addr_lo, x
+	sta FRESPC+0
+	lda tk_hash_addr_hi, x
+	sta FRESPC+1
+
+	ldy #$00
+
+	; FALLTROUGH
+
+tk_hash_search_compare:
+
+	; Compare the packed candidate with the keyword
+
+	lda (FRESPC), y
+	cmp tk__packed, y
+	bne tk_hash_search_next
+
+	cmp #$00
+	beq tk_hash_search_found
+
+	; For now everything matches, try the next byte
+
+	iny
+	bne tk_hash_search_compare         ; branch always
+
+tk_hash_search_next:
+
+	inx
+	bne tk_hash_search_loop            ; branch always
+
+tk_hash_search_found:
+
+	ldy tk_hash_list, x
+	lda tk_hash_token, x
+	tax
+
+	clc
+	rts
+}
@@ -72,6 +72,19 @@ tokenise_line_loop:
 	lda tk__len_unpacked
 	beq tokenise_line_char                       ; branch if attempt to tokenise failed
 
+!ifdef CONFIG_TK_HASH {
+
+	; Check all the keyword lists at once, using the hash index
+
+	jsr tk_hash_search
+	bcs @2                                       ; branch if keyword not identified
+
+	tya                                          ; .Y = keyword list, 0 for BASIC V2
+	beq tokenise_line_keyword_V2
+	bne tokenise_line_keyword_ext                ; branch always
+@2:
+} else {
+
 	; Check for BASIC V2 tokens
 
 	lda #<packed_freq_keywords_V2
@@ -109,6 +122,7 @@ tokenise_line_loop:
 
 	jsr tk_search
 	bcc tokenise_line_keyword_06                 ; branch if keyword identified
+}
 }
 
 	; Shorten packed keyword candidate and try again
@@ -209,6 +223,12 @@ tokenise_line_keyword_01:
 
 	lda #$01
 
+	; FALLTROUGH
+
+tokenise_line_keyword_ext:
+
+	; .A contains the token list index
+
 	ldy tk__offset
 	sta BUF, y
 
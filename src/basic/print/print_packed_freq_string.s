@@ -38,19 +38,62 @@ print_packed_misc_str:
 
 } else {
 
-!ifndef CONFIG_COMPRESSION_LVL_2 {
+	; Strings might be accessed using the offset tables, see 'generate_strings' report
 
 print_packed_error:                    ; .X - error string index
 
+!if PACKED_OFFSETS_WIDTH_errors = 0 {
+
 	lda #<packed_freq_errors
 	ldy #>packed_freq_errors
 	bne print_freq_packed_string       ; branch always
 
+} else if PACKED_OFFSETS_WIDTH_errors = 1 {
+
+	lda packed_offsets_errors, x
+	clc
+	adc #<packed_freq_errors
+	ldy #>packed_freq_errors
+	bcc @1
+	iny
+@1:
+	ldx #$00                           ; string already located, nothing to skip
+	beq print_freq_packed_string       ; branch always
+
+} else {
+
+	lda packed_offsets_lo_errors, x
+	ldy packed_offsets_hi_errors, x
+	ldx #$00                           ; string already located, nothing to skip
+	beq print_freq_packed_string       ; branch always
+}
+
 print_packed_misc_str:                 ; .X - misc string index
 
+!if PACKED_OFFSETS_WIDTH_misc = 0 {
+
 	lda #<packed_freq_misc
 	ldy #>packed_freq_misc
 	bne print_freq_packed_string       ; branch always
+
+} else if PACKED_OFFSETS_WIDTH_misc = 1 {
+
+	lda packed_offsets_misc, x
+	clc
+	adc #<packed_freq_misc
+	ldy #>packed_freq_misc
+	bcc @1
+	iny
+@1:
+	ldx #$00                           ; string already located, nothing to skip
+	beq print_freq_packed_string       ; branch always
+
+} else {
+
+	lda packed_offsets_lo_misc, x
+	ldy packed_offsets_hi_misc, x
+	ldx #$00                           ; string already located, nothing to skip
+	beq print_freq_packed_string       ; branch always
 }
 
 print_packed_keyword_01:               ; .X - token number
@@ -146,7 +189,12 @@ print_freq_packed_string_3n_single:
 	iny
 	lda (FRESPC), y
 	tax
+!ifdef CONFIG_COMPRESSION_LVL_2 {
+	jsr print_freq_packed_string_3n    ; preserves .Y
+	+bra print_freq_packed_string_next
+} else {
 	lda packed_as_3n-1, x
+}
 
 	; FALLTROUGH
 
@@ -154,6 +202,10 @@ print_freq_packed_string_3n_single_cont:
 
 	jsr JCHROUT                        ; preserves .Y
 
+	; FALLTROUGH
+
+print_freq_packed_string_next:
+
 	; Advance to next nibble
 
 	iny
@@ -179,8 +231,12 @@ print_freq_packed_string_3n_split:
 	txs                                ; one cycle faster than PLA
 
 	tax
+!ifdef CONFIG_COMPRESSION_LVL_2 {
+	jsr print_freq_packed_string_3n    ; preserves .Y
+} else {
 	lda packed_as_3n-1, x
 	jsr JCHROUT                        ; preserves .Y
+}
                            
 	jmp print_freq_packed_string_nibble_hi
 
@@ -188,5 +244,44 @@ print_freq_packed_string_end:
 
 	rts
 
+!ifdef CONFIG_COMPRESSION_LVL_2 {
+
+print_freq_packed_string_3n:           ; .X - 3-nibble code
+
+	; Codes starting from PACKED_DICT_BASE are references to the dictionary entries
+
+	cpx #PACKED_DICT_BASE
+	bcs @1
+
+	lda packed_as_3n-1, x
+	jmp JCHROUT                        ; preserves .Y
+@1:
+	; Print the dictionary entry, but preserve all the data needed to progress further
+
+	+phy_trash_a
+	lda FRESPC+0
+	pha
+	lda FRESPC+1
+	pha
+
+	txa
+	sec
+	sbc #PACKED_DICT_BASE
+	tax
+
+	lda #<packed_dictionary
+	ldy #>packed_dictionary
+
+	jsr print_freq_packed_string
+
+	pla
+	sta FRESPC+1
+	pla
+	sta FRESPC+0
+	+ply_trash_a
+
+	rts
+}
+
 
 } ; ROM layout
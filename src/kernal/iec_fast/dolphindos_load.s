@@ -34,6 +34,8 @@ dolphindos_load:
 }
 	; FALLTROUGH
 
+;; #PLACEMENT# #NO-PAGE-CROSS-BEGIN
+
 dolphindos_load_loop:
 
 !ifndef CONFIG_IEC_DOLPHINDOS_FAST {
@@ -110,6 +112,8 @@ dolphindos_load_no_eoi:
 	inc EAL+1
 	+bra dolphindos_load_loop
 
+;; #PLACEMENT# #NO-PAGE-CROSS-END
+
 !ifndef CONFIG_IEC_DOLPHINDOS_FAST {
 
 dolphindos_load_end:
@@ -2,6 +2,8 @@
 ;; #LAYOUT# *   KERNAL_0 #TAKE
 ;; #LAYOUT# *   *        #IGNORE
 
+;; #PLACEMENT# #NO-PAGE-CROSS
+
 ;
 ; RS-232 NMI handler part
 ;
@@ -127,6 +127,8 @@ load_tape_turbo_payload:
 
 	; FALLTROUGH
 
+;; #PLACEMENT# #NO-PAGE-CROSS-BEGIN
+
 load_tape_turbo_loop:
 
 	jsr tape_turbo_get_byte
@@ -144,6 +146,8 @@ load_tape_turbo_loop:
 	jsr lvs_check_EAL
 	bne load_tape_turbo_loop
 
+;; #PLACEMENT# #NO-PAGE-CROSS-END
+
 	; Get the checksum
 	jsr tape_turbo_get_byte
 	tax
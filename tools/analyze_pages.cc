@@ -0,0 +1,511 @@
+//
+// Utility to find places, where the built ROM image pays 6502 page crossing
+// penalties - taken branches to another page, and indexed table reads
+//
+
+#include "common.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+
+//
+// Command line settings
+//
+
+std::string CMD_labelsFile;
+std::string CMD_outFile;
+std::string CMD_binFile;
+int         CMD_address = -1;
+
+//
+// 6502 instruction set description
+//
+
+typedef enum
+{
+    MODE_INV, // not a documented opcode
+    MODE_IMP, // implied or accumulator
+    MODE_IMM, // #$nn
+    MODE_ZPG, // $nn
+    MODE_ZPX, // $nn,X
+    MODE_ZPY, // $nn,Y
+    MODE_ABS, // $nnnn
+    MODE_ABX, // $nnnn,X
+    MODE_ABY, // $nnnn,Y
+    MODE_IND, // ($nnnn)
+    MODE_IZX, // ($nn,X)
+    MODE_IZY, // ($nn),Y
+    MODE_REL, // branch
+
+} AddrMode;
+
+typedef struct
+{
+    const char *mnemonic;
+    AddrMode    mode;
+
+} Opcode;
+
+#define XXX { "???", MODE_INV }
+
+const Opcode OPCODES[256] =
+{
+    // $00 - $0F
+    { "brk", MODE_IMP }, { "ora", MODE_IZX }, XXX, XXX, XXX, { "ora", MODE_ZPG }, { "asl", MODE_ZPG }, XXX,
+    { "php", MODE_IMP }, { "ora", MODE_IMM }, { "asl", MODE_IMP }, XXX, XXX, { "ora", MODE_ABS }, { "asl", MODE_ABS }, XXX,
+    // $10 - $1F
+    { "bpl", MODE_REL }, { "ora", MODE_IZY }, XXX, XXX, XXX, { "ora", MODE_ZPX }, { "asl", MODE_ZPX }, XXX,
+    { "clc", MODE_IMP }, { "ora", MODE_ABY }, XXX, XXX, XXX, { "ora", MODE_ABX }, { "asl", MODE_ABX }, XXX,
+    // $20 - $2F
+    { "jsr", MODE_ABS }, { "and", MODE_IZX }, XXX, XXX, { "bit", MODE_ZPG }, { "and", MODE_ZPG }, { "rol", MODE_ZPG }, XXX,
+    { "plp", MODE_IMP }, { "and", MODE_IMM }, { "rol", MODE_IMP }, XXX, { "bit", MODE_ABS }, { "and", MODE_ABS }, { "rol", MODE_ABS }, XXX,
+    // $30 - $3F
+    { "bmi", MODE_REL }, { "and", MODE_IZY }, XXX, XXX, XXX, { "and", MODE_ZPX }, { "rol", MODE_ZPX }, XXX,
+    { "sec", MODE_IMP }, { "and", MODE_ABY }, XXX, XXX, XXX, { "and", MODE_ABX }, { "rol", MODE_ABX }, XXX,
+    // $40 - $4F
+    { "rti", MODE_IMP }, { "eor", MODE_IZX }, XXX, XXX, XXX, { "eor", MODE_ZPG }, { "lsr", MODE_ZPG }, XXX,
+    { "pha", MODE_IMP }, { "eor", MODE_IMM }, { "lsr", MODE_IMP }, XXX, { "jmp", MODE_ABS }, { "eor", MODE_ABS }, { "lsr", MODE_ABS }, XXX,
+    // $50 - $5F
+    { "bvc", MODE_REL }, { "eor", MODE_IZY }, XXX, XXX, XXX, { "eor", MODE_ZPX }, { "lsr", MODE_ZPX }, XXX,
+    { "cli", MODE_IMP }, { "eor", MODE_ABY }, XXX, XXX, XXX, { "eor", MODE_ABX }, { "lsr", MODE_ABX }, XXX,
+    // $60 - $6F
+    { "rts", MODE_IMP }, { "adc", MODE_IZX }, XXX, XXX, XXX, { "adc", MODE_ZPG }, { "ror", MODE_ZPG }, XXX,
+    { "pla", MODE_IMP }, { "adc", MODE_IMM }, { "ror", MODE_IMP }, XXX, { "jmp", MODE_IND }, { "adc", MODE_ABS }, { "ror", MODE_ABS }, XXX,
+    // $70 - $7F
+    { "bvs", MODE_REL }, { "adc", MODE_IZY }, XXX, XXX, XXX, { "adc", MODE_ZPX }, { "ror", MODE_ZPX }, XXX,
+    { "sei", MODE_IMP }, { "adc", MODE_ABY }, XXX, XXX, XXX, { "adc", MODE_ABX }, { "ror", MODE_ABX }, XXX,
+    // $80 - $8F
+    XXX, { "sta", MODE_IZX }, XXX, XXX, { "sty", MODE_ZPG }, { "sta", MODE_ZPG }, { "stx", MODE_ZPG }, XXX,
+    { "dey", MODE_IMP }, XXX, { "txa", MODE_IMP }, XXX, { "sty", MODE_ABS }, { "sta", MODE_ABS }, { "stx", MODE_ABS }, XXX,
+    // $90 - $9F
+    { "bcc", MODE_REL }, { "sta", MODE_IZY }, XXX, XXX, { "sty", MODE_ZPX }, { "sta", MODE_ZPX }, { "stx", MODE_ZPY }, XXX,
+    { "tya", MODE_IMP }, { "sta", MODE_ABY }, { "txs", MODE_IMP }, XXX, XXX, { "sta", MODE_ABX }, XXX, XXX,
+    // $A0 - $AF
+    { "ldy", MODE_IMM }, { "lda", MODE_IZX }, { "ldx", MODE_IMM }, XXX, { "ldy", MODE_ZPG }, { "lda", MODE_ZPG }, { "ldx", MODE_ZPG }, XXX,
+    { "tay", MODE_IMP }, { "lda", MODE_IMM }, { "tax", MODE_IMP }, XXX, { "ldy", MODE_ABS }, { "lda", MODE_ABS }, { "ldx", MODE_ABS }, XXX,
+    // $B0 - $BF
+    { "bcs", MODE_REL }, { "lda", MODE_IZY }, XXX, XXX, { "ldy", MODE_ZPX }, { "lda", MODE_ZPX }, { "ldx", MODE_ZPY }, XXX,
+    { "clv", MODE_IMP }, { "lda", MODE_ABY }, { "tsx", MODE_IMP }, XXX, { "ldy", MODE_ABX }, { "lda", MODE_ABX }, { "ldx", MODE_ABY }, XXX,
+    // $C0 - $CF
+    { "cpy", MODE_IMM }, { "cmp", MODE_IZX }, XXX, XXX, { "cpy", MODE_ZPG }, { "cmp", MODE_ZPG }, { "dec", MODE_ZPG }, XXX,
+    { "iny", MODE_IMP }, { "cmp", MODE_IMM }, { "dex", MODE_IMP }, XXX, { "cpy", MODE_ABS }, { "cmp", MODE_ABS }, { "dec", MODE_ABS }, XXX,
+    // $D0 - $DF
+    { "bne", MODE_REL }, { "cmp", MODE_IZY }, XXX, XXX, XXX, { "cmp", MODE_ZPX }, { "dec", MODE_ZPX }, XXX,
+    { "cld", MODE_IMP }, { "cmp", MODE_ABY }, XXX, XXX, XXX, { "cmp", MODE_ABX }, { "dec", MODE_ABX }, XXX,
+    // $E0 - $EF
+    { "cpx", MODE_IMM }, { "sbc", MODE_IZX }, XXX, XXX, { "cpx", MODE_ZPG }, { "sbc", MODE_ZPG }, { "inc", MODE_ZPG }, XXX,
+    { "inx", MODE_IMP }, { "sbc", MODE_IMM }, { "nop", MODE_IMP }, XXX, { "cpx", MODE_ABS }, { "sbc", MODE_ABS }, { "inc", MODE_ABS }, XXX,
+    // $F0 - $FF
+    { "beq", MODE_REL }, { "sbc", MODE_IZY }, XXX, XXX, XXX, { "sbc", MODE_ZPX }, { "inc", MODE_ZPX }, XXX,
+    { "sed", MODE_IMP }, { "sbc", MODE_ABY }, XXX, XXX, XXX, { "sbc", MODE_ABX }, { "inc", MODE_ABX }, XXX,
+};
+
+#undef XXX
+
+// Instructions which take an extra cycle if the indexed address crosses a page;
+// stores and read-modify-write instructions always take the extra cycle
+
+const std::set<std::string> PAGE_SENSITIVE = { "lda", "ldx", "ldy", "eor", "and", "ora", "adc", "sbc", "cmp" };
+
+//
+// Report data types
+//
+
+typedef enum
+{
+    ISSUE_BRANCH,  // taken branch to another page
+    ISSUE_TABLE,   // indexed read from a table spanning a page boundary
+    ISSUE_POINTER, // indirect indexed read, depends on the pointer value
+
+} IssueType;
+
+typedef struct
+{
+    int         address;
+    IssueType   type;
+    std::string description;
+
+} Issue;
+
+typedef struct
+{
+    std::string        name;
+    int                address;
+    std::vector<Issue> issues;
+    size_t             numCertain  = 0; // branches + tables
+    size_t             numPointers = 0;
+
+} RoutineReport;
+
+//
+// Global variables
+//
+
+std::vector<uint8_t>           GLOBAL_image;
+std::map<int, std::string>     GLOBAL_labels;       // address -> first label defined there
+std::set<int>                  GLOBAL_dataLabels;   // labels used as indexed table base
+std::vector<RoutineReport>     GLOBAL_reports;
+
+//
+// Common helper functions
+//
+
+void printUsage()
+{
+    std::cout << "\n" <<
+        "usage: analyze_pages -a <start address> -l <VICE labels file> [-o <report file>]" << "\n" <<
+        "                     <ROM image file>" << "\n\n";
+}
+
+std::string toHex(int value, int digits)
+{
+    std::ostringstream stream;
+    stream << "$" << std::uppercase << std::hex << std::setfill('0') << std::setw(digits) << value;
+    return stream.str();
+}
+
+bool isInImage(int address)
+{
+    return address >= CMD_address && address < CMD_address + int(GLOBAL_image.size());
+}
+
+uint8_t getByte(int address)
+{
+    return GLOBAL_image[address - CMD_address];
+}
+
+std::string describeAddress(int address)
+{
+    // Try to express the address using a label, like 'table+3'
+
+    auto iter = GLOBAL_labels.upper_bound(address);
+    if (iter != GLOBAL_labels.begin())
+    {
+        iter--;
+        if (iter->first == address) return iter->second;
+        if (address - iter->first < 0x10) return iter->second + "+" + std::to_string(address - iter->first);
+    }
+
+    return toHex(address, (address < 0x100) ? 2 : 4);
+}
+
+int getRegionEnd(int address)
+{
+    // Region ends where the next label starts, or at the end of the image
+
+    auto iter = GLOBAL_labels.upper_bound(address);
+    if (iter == GLOBAL_labels.end() || !isInImage(iter->first))
+    {
+        return CMD_address + GLOBAL_image.size();
+    }
+
+    return iter->first;
+}
+
+//
+// Top-level functions
+//
+
+void parseCommandLine(int argc, char **argv)
+{
+    int opt;
+
+    // Retrieve command line options
+
+    while ((opt = getopt(argc, argv, "a:l:o:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'a': CMD_address    = std::stoi(optarg, nullptr, 16); break;
+            case 'l': CMD_labelsFile = optarg; break;
+            case 'o': CMD_outFile    = optarg; break;
+            default: printUsage(); ERROR();
+        }
+    }
+
+    if (optind + 1 != argc) { printUsage(); ERROR("exactly one ROM image file has to be given"); }
+    CMD_binFile = argv[optind];
+
+    // Validate command line settings
+
+    if (CMD_address < 0 || CMD_address > 0xFFFF) { printUsage(); ERROR("start address not given or out of range"); }
+    if (CMD_labelsFile.empty())                  { printUsage(); ERROR("VICE labels file not given"); }
+}
+
+void readImage()
+{
+    std::ifstream inFile(CMD_binFile, std::ios::in | std::ios::binary);
+    if (!inFile.good()) ERROR(std::string("can't open file '") + CMD_binFile + "'");
+
+    GLOBAL_image.assign(std::istreambuf_iterator<char>(inFile), std::istreambuf_iterator<char>());
+
+    if (GLOBAL_image.empty()) ERROR(std::string("file '") + CMD_binFile + "' is empty");
+    if (CMD_address + GLOBAL_image.size() > 0x10000) ERROR("image does not fit in the 6502 address space");
+}
+
+void readLabels()
+{
+    std::ifstream inFile(CMD_labelsFile);
+    if (!inFile.good()) ERROR(std::string("can't open file '") + CMD_labelsFile + "'");
+
+    // Expected line format is 'al C:e4d3 .label_name'
+
+    std::string line;
+    while (std::getline(inFile, line))
+    {
+        std::istringstream stream(line);
+        std::string command, address, label;
+
+        stream >> command >> address >> label;
+        if (command != "al" || address.size() < 3 || label.size() < 2) continue;
+
+        // Internal labels of the build segment tool are of no use for the report
+
+        label = label.substr(1);
+        if (label.compare(0, 2, "__") == 0) continue;
+
+        int value;
+        try
+        {
+            value = std::stoi(address.substr(2), nullptr, 16);
+        }
+        catch (...)
+        {
+            continue;
+        }
+
+        GLOBAL_labels.emplace(value, label);
+    }
+}
+
+int getInstructionLength(const Opcode &opcode)
+{
+    switch (opcode.mode)
+    {
+        case MODE_INV: return 0;
+        case MODE_IMP: return 1;
+        case MODE_ABS:
+        case MODE_ABX:
+        case MODE_ABY:
+        case MODE_IND: return 3;
+        default:       return 2;
+    }
+}
+
+template<class Callback> bool disassembleRegion(int startAddress, Callback callback)
+{
+    // Disassemble until the next label; returns false if data was encountered
+
+    const int regionEnd = getRegionEnd(startAddress);
+    int address = startAddress;
+
+    while (address < regionEnd)
+    {
+        const auto &opcode = OPCODES[getByte(address)];
+        const int length = getInstructionLength(opcode);
+
+        if (length == 0 || address + length > regionEnd) return false;
+
+        callback(address, opcode);
+        address += length;
+    }
+
+    return true;
+}
+
+int getTableAddress(int base)
+{
+    // Base address might point slightly before the table, like in 'lda table-1,x'
+
+    for (int address = base; address <= base + 2; address++)
+    {
+        if (GLOBAL_labels.count(address) != 0) return address;
+    }
+
+    return base;
+}
+
+void findDataLabels()
+{
+    // Labels used as a base of indexed instructions are considered tables, they
+    // won't be disassembled - otherwise the data would produce false reports
+
+    for (const auto &label : GLOBAL_labels)
+    {
+        if (!isInImage(label.first)) continue;
+
+        disassembleRegion(label.first, [](int address, const Opcode &opcode)
+        {
+            if (opcode.mode != MODE_ABX && opcode.mode != MODE_ABY) return;
+
+            const int table = getTableAddress(getByte(address + 1) + 256 * getByte(address + 2));
+            if (isInImage(table) && GLOBAL_labels.count(table) != 0) GLOBAL_dataLabels.insert(table);
+        });
+    }
+}
+
+void analyzeInstruction(RoutineReport &report, int address, const Opcode &opcode)
+{
+    const int operand = (opcode.mode == MODE_REL || opcode.mode == MODE_IZY) ?
+                        getByte(address + 1) : getByte(address + 1) + 256 * getByte(address + 2);
+
+    if (opcode.mode == MODE_REL)
+    {
+        const int next   = address + 2;
+        const int target = next + int8_t(operand);
+
+        if ((next >> 8) == (target >> 8)) return;
+
+        report.issues.push_back({ address, ISSUE_BRANCH,
+                                  std::string(opcode.mnemonic) + " " + describeAddress(target) +
+                                  " - taken branch to page " + toHex(target >> 8, 2) });
+        report.numCertain++;
+    }
+    else if (opcode.mode == MODE_ABX || opcode.mode == MODE_ABY)
+    {
+        if (PAGE_SENSITIVE.count(opcode.mnemonic) == 0 || !isInImage(operand)) return;
+
+        // Table extends till the next label
+
+        const int tableEnd = getRegionEnd(getTableAddress(operand));
+        if ((operand >> 8) == ((tableEnd - 1) >> 8)) return;
+
+        report.issues.push_back({ address, ISSUE_TABLE,
+                                  std::string(opcode.mnemonic) + " " + describeAddress(operand) +
+                                  ((opcode.mode == MODE_ABX) ? ",x" : ",y") +
+                                  " - table " + toHex(operand, 4) + "-" + toHex(tableEnd - 1, 4) + " spans a page boundary" });
+        report.numCertain++;
+    }
+    else if (opcode.mode == MODE_IZY)
+    {
+        if (PAGE_SENSITIVE.count(opcode.mnemonic) == 0) return;
+
+        report.issues.push_back({ address, ISSUE_POINTER,
+                                  std::string(opcode.mnemonic) + " (" + describeAddress(operand) + "),y" +
+                                  " - depends on the pointer value" });
+        report.numPointers++;
+    }
+}
+
+void analyzeRoutines()
+{
+    for (const auto &label : GLOBAL_labels)
+    {
+        if (!isInImage(label.first) || GLOBAL_dataLabels.count(label.first) != 0) continue;
+
+        RoutineReport report;
+        report.name    = label.second;
+        report.address = label.first;
+
+        const bool isData = !disassembleRegion(label.first, [&report](int address, const Opcode &opcode)
+        {
+            analyzeInstruction(report, address, opcode);
+        });
+
+        if (isData)
+        {
+            // Keep the findings up to the data, but mark them as uncertain
+
+            for (auto &issue : report.issues) issue.description += " (followed by data?)";
+        }
+
+        if (!report.issues.empty()) GLOBAL_reports.push_back(report);
+    }
+
+    // Rank the routines - certain penalties first
+
+    std::stable_sort(GLOBAL_reports.begin(), GLOBAL_reports.end(),
+                     [](const RoutineReport &report1, const RoutineReport &report2)
+                     {
+                         if (report1.numCertain != report2.numCertain) return report1.numCertain > report2.numCertain;
+                         return report1.numPointers > report2.numPointers;
+                     });
+}
+
+void writeReport(std::ostream &stream)
+{
+    size_t numBranches = 0;
+    size_t numTables   = 0;
+    size_t numPointers = 0;
+
+    for (const auto &report : GLOBAL_reports)
+    {
+        for (const auto &issue : report.issues)
+        {
+            switch (issue.type)
+            {
+                case ISSUE_BRANCH:  numBranches++; break;
+                case ISSUE_TABLE:   numTables++;   break;
+                case ISSUE_POINTER: numPointers++; break;
+            }
+        }
+    }
+
+    stream << "Page crossing report for '" << CMD_binFile << "', " <<
+              toHex(CMD_address, 4) << "-" << toHex(CMD_address + GLOBAL_image.size() - 1, 4) << "\n\n";
+    stream << "taken branches to another page: " << numBranches << "\n";
+    stream << "indexed reads from tables spanning a page boundary: " << numTables << "\n";
+    stream << "indirect indexed reads, depending on pointer: " << numPointers << "\n\n";
+
+    if (GLOBAL_reports.empty()) return;
+
+    // Summary table
+
+    size_t nameWidth = 7;
+    for (const auto &report : GLOBAL_reports) nameWidth = std::max(nameWidth, report.name.size());
+
+    stream << std::left << std::setw(nameWidth + 2) << "routine" << "address  certain  pointer" << "\n";
+    for (const auto &report : GLOBAL_reports)
+    {
+        stream << std::left << std::setw(nameWidth + 2) << report.name <<
+                  std::setw(9) << toHex(report.address, 4) <<
+                  std::setw(9) << report.numCertain << report.numPointers << "\n";
+    }
+
+    // Details
+
+    for (const auto &report : GLOBAL_reports)
+    {
+        stream << "\n" << report.name << " (" << toHex(report.address, 4) << "):\n";
+        for (const auto &issue : report.issues)
+        {
+            stream << "    " << toHex(issue.address, 4) << "  " << issue.description << "\n";
+        }
+    }
+}
+
+//
+// Main function
+//
+
+int main(int argc, char **argv)
+{
+    parseCommandLine(argc, argv);
+
+    readImage();
+    readLabels();
+    findDataLabels();
+    analyzeRoutines();
+
+    if (CMD_outFile.empty())
+    {
+        writeReport(std::cout);
+    }
+    else
+    {
+        std::ofstream outFile(CMD_outFile, std::ios::out | std::ios::trunc);
+        if (!outFile.good()) ERROR(std::string("can't open file '") + CMD_outFile + "'");
+
+        writeReport(outFile);
+        std::cout << "page crossing report written to '" << CMD_outFile << "'\n";
+    }
+
+    return 0;
+}
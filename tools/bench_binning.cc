@@ -0,0 +1,318 @@
+//
+// Utility to measure the routine placement solver of the build segment tool,
+// using binning problems recorded during real builds and synthetic ones
+//
+
+#include "common.h"
+#include "binning.h"
+
+#include <libgen.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iomanip>
+#include <random>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+//
+// Command line settings
+//
+
+int                 CMD_benchPackerMs = 100;
+std::vector<size_t> CMD_synthetic     = { 1000, 4000 };
+std::list<std::string> CMD_dumpList;
+
+//
+// Global variables
+//
+
+std::string GLOBAL_logFileNamePath; // solver logs, not needed here
+
+//
+// Benchmark description
+//
+
+typedef struct BenchProblem {
+    std::string           name;
+    int                   loAddress;
+    int                   hiAddress;
+    std::list<Routine>    routines;
+} BenchProblem;
+
+typedef struct BenchResult {
+    double timeMs;
+    long   peakKB;
+    int    wasted;     // free space outside the gap with the most space left, same as for the global packer
+    int    lowerBound; // no placement can waste less
+    bool   solved;
+} BenchResult;
+
+const std::vector<std::string> STRATEGIES = { "greedy", "global", "stable" };
+
+//
+// Common helper functions
+//
+
+void printBenchUsage()
+{
+    std::cout << "usage: bench_binning [-g <global packer time budget in ms>]" << "\n" <<
+                 "                     [-n <synthetic problem sizes, comma separated, 0 = none>]" << "\n" <<
+                 "                     [<recorded problem, ',cache/*.binning' from the build directories> ...]" << "\n";
+}
+
+void parseBenchCommandLine(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "g:n:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'g': CMD_benchPackerMs = strtol(optarg, nullptr, 10); break;
+            case 'n':
+            {
+                CMD_synthetic.clear();
+
+                std::istringstream stream(optarg);
+                std::string token;
+                while (std::getline(stream, token, ','))
+                {
+                    const size_t value = strtoul(token.c_str(), nullptr, 10);
+                    if (value > 0) CMD_synthetic.push_back(value);
+                }
+                break;
+            }
+            default: printBenchUsage(); ERROR();
+        }
+    }
+
+    for (int idx = optind; idx < argc; idx++) CMD_dumpList.push_back(argv[idx]);
+
+    if (CMD_benchPackerMs <= 0) { printBenchUsage(); ERROR("global packer time budget has to be positive"); }
+}
+
+//
+// Benchmark problems
+//
+
+void createSyntheticProblem(BenchProblem &problem, size_t numRoutines)
+{
+    // 40 KB area, split into gaps by a few fixed routines, filled in 97% by the floating ones;
+    // some of the routines have placement constraints, some are hot - to exercise all the solver paths
+
+    std::mt19937 random(numRoutines);
+
+    problem.name      = "synthetic_" + std::to_string(numRoutines);
+    problem.loAddress = 0x0000;
+    problem.hiAddress = 0x9FFF;
+
+    int freeSpace = problem.hiAddress - problem.loAddress + 1;
+    for (int address = 0x2000; address <= problem.hiAddress; address += 0x2000)
+    {
+        problem.routines.push_back(Routine("fixed_" + std::to_string(address / 0x2000) + ".s"));
+        auto &routine = problem.routines.back();
+
+        routine.floating   = false;
+        routine.startAddr  = address - 0x20;
+        routine.codeLength = 0x20 + random() % 0x20;
+        freeSpace         -= routine.codeLength;
+    }
+
+    const int avgSize = std::max(1, (int) (freeSpace * 97 / 100 / numRoutines));
+    for (size_t idx = 0; idx < numRoutines; idx++)
+    {
+        problem.routines.push_back(Routine("routine_" + std::to_string(idx) + ".s"));
+        auto &routine = problem.routines.back();
+
+        routine.codeLength = 1 + random() % (2 * avgSize - 1);
+
+        if (idx % 50 == 0 && routine.codeLength <= 0x100) routine.noPageCross = true;
+        else if (idx % 20 == 0)                           routine.hotness     = 1 + random() % 1000;
+    }
+}
+
+std::pair<std::string, std::string> splitPath(const std::string &objName)
+{
+    char *tmp1 = strdup(objName.c_str());
+    char *tmp2 = strdup(objName.c_str());
+
+    std::pair<std::string, std::string> retVal(basename(tmp2), dirname(tmp1)); // file name, directory name
+
+    free(tmp1);
+    free(tmp2);
+
+    return retVal;
+}
+
+bool loadRecordedProblem(BenchProblem &problem, const std::string &fileNamePath)
+{
+    // Name the problem after the build directory and segment, like 'target_mega65/KERNAL_0'
+
+    const auto pathParts  = splitPath(fileNamePath);
+    const auto cacheParts = splitPath(pathParts.second);
+    const auto dirParts   = splitPath(cacheParts.second);
+
+    problem.name = dirParts.first + DIR_SEPARATOR + pathParts.first.substr(0, pathParts.first.rfind('.'));
+
+    return readProblemDump(fileNamePath, problem.routines, problem.loAddress, problem.hiAddress);
+}
+
+//
+// Benchmark execution
+//
+
+BenchResult runStrategy(BenchProblem &problem, const std::string &strategy)
+{
+    BinningProblem binningProblem(problem.loAddress, problem.hiAddress);
+    for (auto &routine : problem.routines) binningProblem.addToProblem(&routine);
+
+    const int packerMs = (strategy == "global") ? CMD_benchPackerMs : 0;
+
+    // Stable placement needs a layout from the previous build - use the greedy one
+
+    RoutineLayout layoutHint;
+    if (strategy == "stable")
+    {
+        BinningProblem hintProblem = binningProblem;
+        Solver(hintProblem, 0).run(GLOBAL_logFileNamePath);
+
+        for (const auto &routine : hintProblem.fixedRoutines)
+        {
+            if (routine.second->floating) layoutHint[routine.second->fileName] = std::make_pair(routine.first, routine.second->codeLength);
+        }
+    }
+
+    const BinningProblem initialProblem = binningProblem;
+    const auto timeStart = std::chrono::steady_clock::now();
+
+    Solver solver(binningProblem, packerMs, (strategy == "stable") ? &layoutHint : nullptr);
+    solver.run(GLOBAL_logFileNamePath);
+
+    const auto timeEnd = std::chrono::steady_clock::now();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // Strategies account the waste differently, so measure it the same way for all of them
+
+    const GlobalPacker packer(initialProblem, 0);
+
+    BenchResult result;
+    result.timeMs     = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+    result.peakKB     = usage.ru_maxrss;
+    result.solved     = binningProblem.isSolved();
+    result.wasted     = result.solved ? packer.calcWaste(binningProblem) : 0;
+    result.lowerBound = packer.lowerBound;
+
+    return result;
+}
+
+bool runStrategyProcess(BenchProblem &problem, const std::string &strategy, BenchResult &result)
+{
+    // Each run is done in a separate process, so that the peak memory usage is not affected by
+    // the previous runs, and a solver failure (which terminates the program) is just reported
+
+    int pipeFds[2];
+    if (pipe(pipeFds) != 0) ERROR("unable to create a pipe");
+
+    std::cout << std::flush;
+
+    pid_t pid = fork();
+    if (pid < 0) ERROR("unable to create a process");
+
+    if (pid == 0)
+    {
+        close(pipeFds[0]);
+        std::cout.rdbuf(nullptr); // solver logs are not needed
+
+        const BenchResult childResult = runStrategy(problem, strategy);
+        if (write(pipeFds[1], &childResult, sizeof(childResult)) != sizeof(childResult)) _exit(1);
+        _exit(0);
+    }
+
+    close(pipeFds[1]);
+    const bool success = (read(pipeFds[0], &result, sizeof(result)) == sizeof(result));
+    close(pipeFds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    return success && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void runBenchmark(BenchProblem &problem)
+{
+    size_t numFloating = 0;
+    for (const auto &routine : problem.routines)
+    {
+        if (routine.floating) numFloating++;
+    }
+
+    for (const auto &strategy : STRATEGIES)
+    {
+        BenchResult result;
+        const bool success = runStrategyProcess(problem, strategy, result);
+
+        std::cout << std::left << std::setw(32) << problem.name << std::right << std::setw(10) << numFloating << "  " <<
+                     std::left << std::setw(8) << strategy << std::right;
+
+        if (!success)
+        {
+            std::cout << "    solver failed" << "\n";
+            continue;
+        }
+
+        std::cout << std::setw(12) << std::fixed << std::setprecision(3) << result.timeMs <<
+                     std::setw(10) << result.peakKB <<
+                     std::setw(8)  << (result.solved ? std::to_string(result.wasted) : "-") <<
+                     std::setw(8)  << result.lowerBound << "\n";
+    }
+}
+
+//
+// Main function
+//
+
+int main(int argc, char **argv)
+{
+    parseBenchCommandLine(argc, argv);
+
+    // Solver always writes its logs, put them into a temporary directory
+
+    char tmpDir[] = "/tmp/bench_binning_XXXXXX";
+    if (mkdtemp(tmpDir) == nullptr) ERROR("unable to create a temporary directory");
+
+    GLOBAL_logFileNamePath = std::string(tmpDir) + DIR_SEPARATOR + "bench_binsolution.log";
+
+    std::cout << "\n" << std::left << std::setw(32) << "problem" << std::right << std::setw(10) << "routines" << "  " <<
+                 std::left << std::setw(8) << "strategy" << std::right << std::setw(12) << "time [ms]" <<
+                 std::setw(10) << "peak [KB]" << std::setw(8) << "wasted" << std::setw(8) << "bound" << "\n\n";
+
+    for (const auto &fileNamePath : CMD_dumpList)
+    {
+        BenchProblem problem;
+        if (!loadRecordedProblem(problem, fileNamePath))
+        {
+            std::cout << "unable to read recorded problem '" << fileNamePath << "', skipping" << "\n";
+            continue;
+        }
+
+        runBenchmark(problem);
+    }
+
+    for (const auto numRoutines : CMD_synthetic)
+    {
+        BenchProblem problem;
+        createSyntheticProblem(problem, numRoutines);
+        runBenchmark(problem);
+    }
+
+    std::cout << "\n";
+
+    unlink(GLOBAL_logFileNamePath.c_str());
+    rmdir(tmpDir);
+
+    return 0;
+}
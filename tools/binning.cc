@@ -0,0 +1,1119 @@
+//
+// Routine placement solver, shared by the build segment tool
+// and the tool measuring its performance
+//
+
+#include "binning.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+//
+// Class 'Routine'
+//
+
+Routine::Routine(const std::string &fileName) :
+    fileName(fileName),
+    floating(true),
+    high(false),
+    startAddr(-1),
+    codeLength(-1),
+    alignment(1),
+    noPageCross(false),
+    numPageSpans(0),
+    hotness(0)
+{
+}
+
+bool Routine::hasPlacementConstraints() const
+{
+    return alignment > 1 || noPageCross || !pageSpans.empty();
+}
+
+bool Routine::fitsAt(int address) const
+{
+    auto crossesPage = [address](int start, int end) -> bool
+    {
+        return end > start && ((address + start) / 0x100) != ((address + end - 1) / 0x100);
+    };
+
+    if (address % alignment != 0)                    return false;
+    if (high && address < 0xE000)                    return false;
+    if (noPageCross && crossesPage(0, codeLength))   return false;
+
+    for (const auto &pageSpan : pageSpans)
+    {
+        if (crossesPage(pageSpan.first, pageSpan.second)) return false;
+    }
+
+    return true;
+}
+
+bool Routine::prefersSinglePage() const
+{
+    // Hot routines should not pay the penalties for branches and table reads crossing a page
+
+    return hotness > 0 && codeLength <= 0x100 && !hasPlacementConstraints();
+}
+
+//
+// Class 'BinningProblem'
+//
+
+BinningProblem::BinningProblem(int loAddress, int hiAddress)
+{
+    if (hiAddress < loAddress || hiAddress < 0 || loAddress < 0 || hiAddress > 0xFFFF || loAddress > 0xFFFF)
+    {
+        ERROR("invalid lo/hi address");
+    }
+
+    // Create one large gap (initial) to represent the assembly
+
+    gaps[loAddress] = hiAddress - loAddress + 1;
+
+    // Initial value of statistics
+
+    statSize = gaps[loAddress];
+    statFree = gaps[loAddress];
+    statWasted = 0;
+}
+
+bool BinningProblem::isSolved() const
+{
+    return floatingRoutines.empty();
+}
+
+void BinningProblem::addToProblem(Routine *routine)
+{
+    maxFileNameLen = std::max(maxFileNameLen, routine->fileName.length());
+
+    if (routine->floating)
+    {
+        floatingRoutines.push_back(routine);
+    }
+    else
+    {
+        // For the fixed-address routines, we have to find the matching place
+
+        bool gapFound = false;
+        for (auto &gap: gaps)
+        {
+            if (gap.first > routine->startAddr || gap.first + gap.second - 1 < routine->startAddr)
+            {
+                continue; // not a suitable gap
+            }
+
+            // We have to put the routine into the current gap
+
+            if (gap.first + gap.second < routine->startAddr + routine->codeLength)
+            {
+                ERROR(std::string("fixed address file '") + routine->fileName + "' won't fit in the available gap");
+            }
+
+            gapFound = true;
+
+            if (!routine->fitsAt(routine->startAddr))
+            {
+                ERROR(std::string("fixed address file '") + routine->fileName + "' violates its placement constraints");
+            }
+
+            // Put the routine into the gap, possibly removing it or splitting into two
+
+            fixedRoutines[routine->startAddr] = routine;
+            statFree -= routine->codeLength;
+
+            // Calculate possible new gap after the routine
+
+            int newGapSize  = (gap.first + gap.second) - (routine->startAddr + routine->codeLength);
+            int newGapStart = (newGapSize <= 0) ? -1 : routine->startAddr + routine->codeLength;
+
+            // Remove or shrink the current gap
+
+            if (gap.first == routine->startAddr)
+            {
+                gaps.erase(gap.first);
+            }
+            else
+            {
+                gap.second = routine->startAddr - gap.first;
+            }
+
+            // Add a new gap
+
+            if (newGapStart > 0) gaps[newGapStart] = newGapSize;
+
+            break; // iterator is not valid enymore, we have to stop the llop
+        }
+
+        if (!gapFound)
+        {
+            ERROR(std::string("start address of fixed address file '") +
+                  routine->fileName + "' (" + std::to_string(routine->startAddr) +
+                  ") already occupied or out of range");
+        }
+    }
+}
+
+void BinningProblem::fillGap(std::ofstream &dbgOutput, int gapAddress, const std::list<Routine *> &routines)
+{
+    int offset = 0;
+    std::string spacing;
+
+    for (auto &routine : routines)
+    {
+        int targetAddr = gapAddress + offset;
+
+        spacing.resize(maxFileNameLen + 4 - routine->fileName.length(), ' ');
+        dbgOutput << "    $" << std::hex << targetAddr << std::dec << ": " <<
+                     routine->fileName << spacing << "size: " << routine->codeLength << "\n";
+
+        fixedRoutines[targetAddr] = routine;
+        offset   += routine->codeLength;
+        statFree -= routine->codeLength;
+
+        if (offset > gaps[gapAddress]) ERROR(std::string("internal error line ") + std::to_string(__LINE__));
+
+        floatingRoutines.erase(std::remove(floatingRoutines.begin(), floatingRoutines.end(), routine), floatingRoutines.end());
+    }
+
+    // Get rid of the gap, it's useless now
+
+    if (offset == gaps[gapAddress])
+    {
+        dbgOutput << "filled to the last byte" << "\n";
+    }
+    else if (!isSolved())
+    {
+        dbgOutput << "filled in - dropped bytes: " << gaps[gapAddress] - offset << "\n";
+        statWasted += gaps[gapAddress] - offset;
+    }
+    else
+    {
+        dbgOutput << "out of routines" << "\n";
+    }
+
+    gaps.erase(gapAddress);
+}
+
+bool BinningProblem::placeAt(std::ofstream &dbgOutput, int address, Routine *routine)
+{
+    // Find the gap containing the whole requested area
+
+    auto iterGap = gaps.upper_bound(address);
+    if (iterGap == gaps.begin()) return false;
+    iterGap--;
+
+    const int gapAddress = iterGap->first;
+    const int gapEnd     = iterGap->first + iterGap->second;
+    const int routineEnd = address + routine->codeLength;
+
+    if (routineEnd > gapEnd || !routine->fitsAt(address)) return false;
+
+    // Place the routine, split the gap
+
+    std::string spacing;
+    spacing.resize(maxFileNameLen + 4 - routine->fileName.length(), ' ');
+    dbgOutput << "    $" << std::hex << address << std::dec << ": " <<
+                 routine->fileName << spacing << "size: " << routine->codeLength << "\n";
+
+    fixedRoutines[address] = routine;
+    statFree -= routine->codeLength;
+
+    if (address == gapAddress)
+    {
+        gaps.erase(gapAddress);
+    }
+    else
+    {
+        gaps[gapAddress] = address - gapAddress;
+    }
+
+    if (routineEnd < gapEnd) gaps[routineEnd] = gapEnd - routineEnd;
+
+    floatingRoutines.erase(std::remove(floatingRoutines.begin(), floatingRoutines.end(), routine), floatingRoutines.end());
+
+    return true;
+}
+
+void BinningProblem::placeHighRoutines(std::ofstream &dbgOutput)
+{
+    // Place routines which has to be stored in the high ROM area
+    // It is expected there will be very few of them, so no complicated algorithms here
+
+    std::string spacing;
+
+    while (!floatingRoutines.empty())
+    {
+        // Find the largest high routine
+
+        auto iterRoutine = floatingRoutines.end();
+
+        for (auto iter = floatingRoutines.begin(); iter < floatingRoutines.end(); iter++)
+        {
+            if (!(*iter)->high || (*iter)->hasPlacementConstraints()) continue;
+
+            if (iterRoutine == floatingRoutines.end() ||
+                (*iterRoutine)->codeLength < (*iter)->codeLength)
+            {
+                iterRoutine = iter;
+                continue;
+            }
+
+            if ((*iterRoutine)->codeLength < (*iter)->codeLength)
+            {
+                iterRoutine = iter;   
+            }
+        }
+
+        if (iterRoutine == floatingRoutines.end()) break;
+
+        // Now we need to find a space to put it - just take the largest gap available,
+        // which is located in the high ROM area
+
+        int routineSize = (*iterRoutine)->codeLength;
+        int gapAddress  = -1;
+
+        for (auto &gap : gaps)
+        {
+            if (gap.second < routineSize || gap.first < 0xE000) continue;
+
+            if (gap.second == routineSize)
+            {
+                gapAddress = gap.first;
+                break;
+            }
+
+            if (gapAddress < 0 || gap.second > gaps[gapAddress])
+            {
+                gapAddress = gap.first;
+            }
+        }
+
+        if (gapAddress < 0) ERROR("no suitable space for a high routine");
+
+        // Place routine in the gap found
+
+        gaps[gapAddress] -= routineSize;
+
+        int targetAddr = gapAddress + gaps[gapAddress];
+        fixedRoutines[targetAddr] = *iterRoutine;
+        statFree   -= routineSize;
+
+        dbgOutput << "reducing gap $" << std::hex << gapAddress << std::dec <<
+                    " to size " << gaps[gapAddress] << "\n";
+
+        spacing.resize(maxFileNameLen + 4 - (*iterRoutine)->fileName.length(), ' ');
+        dbgOutput << "    $" << std::hex << targetAddr << std::dec << ": " <<
+                     (*iterRoutine)->fileName << spacing << "size: " <<
+                     (*iterRoutine)->codeLength << "\n";
+
+        floatingRoutines.erase(iterRoutine);
+        if (gaps[gapAddress] == 0) gaps.erase(gapAddress);
+    }
+}
+
+bool BinningProblem::placeConstrainedRoutines(std::ofstream &dbgOutput)
+{
+    // Routines with placement constraints go first, largest first - the remaining ones
+    // are easy to fit into whatever space is left
+
+    std::vector<Routine *> routines;
+    for (auto routine : floatingRoutines)
+    {
+        if (routine->hasPlacementConstraints()) routines.push_back(routine);
+    }
+
+    if (routines.empty()) return true;
+
+    auto compare = [](const Routine *a, const Routine *b) -> bool
+    {
+        return (a->codeLength != b->codeLength) ? a->codeLength > b->codeLength : a->fileName < b->fileName;
+    };
+    std::stable_sort(routines.begin(), routines.end(), compare);
+
+    dbgOutput << "placing routines with constraints" << "\n";
+
+    for (auto routine : routines)
+    {
+        const int bestAddress = findBestAddress(routine, false);
+        if (bestAddress < 0)
+        {
+            dbgOutput << "no space satisfying constraints of " << routine->fileName << "\n";
+            return false;
+        }
+
+        placeAt(dbgOutput, bestAddress, routine);
+    }
+
+    return true;
+}
+
+void BinningProblem::placeHotRoutines(std::ofstream &dbgOutput)
+{
+    // Routines marked hot by the profile are placed within a single page if possible,
+    // hottest first - if there is no such space, they are left for the regular placement
+
+    std::vector<Routine *> routines;
+    for (auto routine : floatingRoutines)
+    {
+        if (routine->prefersSinglePage()) routines.push_back(routine);
+    }
+
+    if (routines.empty()) return;
+
+    auto compare = [](const Routine *a, const Routine *b) -> bool
+    {
+        return (a->hotness != b->hotness) ? a->hotness > b->hotness : a->fileName < b->fileName;
+    };
+    std::stable_sort(routines.begin(), routines.end(), compare);
+
+    dbgOutput << "placing hot routines" << "\n";
+
+    for (auto routine : routines)
+    {
+        const int bestAddress = findBestAddress(routine, true);
+        if (bestAddress < 0)
+        {
+            dbgOutput << "no single page space for " << routine->fileName << "\n";
+            continue;
+        }
+
+        placeAt(dbgOutput, bestAddress, routine);
+    }
+}
+
+int BinningProblem::findBestAddress(const Routine *routine, bool singlePage) const
+{
+    // Check every possible address; prefer placement at the gap start or end (no new gap
+    // is created), otherwise the one leaving the smallest fragment
+
+    std::tuple<int, int, int, int> bestScore(2, 0, 0, 0);
+    int bestAddress = -1;
+
+    for (const auto &gap : gaps)
+    {
+        const int gapEnd = gap.first + gap.second;
+        for (int address = gap.first; address + routine->codeLength <= gapEnd; address++)
+        {
+            if (!routine->fitsAt(address)) continue;
+            if (singlePage && address / 0x100 != (address + routine->codeLength - 1) / 0x100) continue;
+
+            const int fragment = std::min(address - gap.first, gapEnd - address - routine->codeLength);
+            const std::tuple<int, int, int, int> score((fragment == 0) ? 0 : 1, fragment, gap.second, address);
+
+            if (score < bestScore)
+            {
+                bestScore   = score;
+                bestAddress = address;
+            }
+        }
+    }
+
+    return bestAddress;
+}
+
+void BinningProblem::performObviousSteps(std::ofstream &dbgOutput)
+{
+    // Get the size of the biggest routine; if there is just one gap which
+    // can handle it - put the routine exactly there
+
+    std::string spacing;
+
+    bool repeat  = true;
+    bool lastGap = false;
+    while (repeat && !floatingRoutines.empty() && !gaps.empty())
+    {
+        repeat = false;
+
+        int routineSize = floatingRoutines.back()->codeLength;
+
+        int gapAddress;
+        int matchingGaps = 0;
+        for (auto &gap : gaps)
+        {
+            if (gap.second >= routineSize)
+            {
+                matchingGaps++;
+                gapAddress = gap.first;
+            }
+        }
+
+        if (!lastGap && gaps.size() == 1)
+        {
+            lastGap = true;
+            dbgOutput << "selected gap: $" << std::hex << gapAddress << std::dec <<
+                         " (size: " << gaps[gapAddress] << ") - the last remaining" << "\n";
+        }
+
+        if (matchingGaps == 1)
+        {
+            // Routine can only be placed in this particular gap - do so
+
+            gaps[gapAddress] -= routineSize;
+            int targetAddr = gapAddress + gaps[gapAddress];
+            fixedRoutines[targetAddr] = floatingRoutines.back();
+            statFree   -= routineSize;
+
+            if (gaps.size() > 1)
+            {
+                dbgOutput << "forced reducing gap $" << std::hex << gapAddress << std::dec <<
+                             " to size " << gaps[gapAddress] << "\n";
+            }
+
+            spacing.resize(maxFileNameLen + 4 - floatingRoutines.back()->fileName.length(), ' ');
+            dbgOutput << "    $" << std::hex << targetAddr << std::dec << ": " <<
+                         floatingRoutines.back()->fileName << spacing << "size: " <<
+                         floatingRoutines.back()->codeLength << "\n";
+
+            floatingRoutines.pop_back();
+            if (gaps[gapAddress] == 0) gaps.erase(gapAddress);
+
+            repeat = true;
+        }
+    }
+}
+
+void BinningProblem::removeUselessGaps(std::ofstream &dbgOutput)
+{
+    // Get the size of the smallest floating routine,
+    // remove all the gaps which are smaller in size
+
+    int minUsefulSize = floatingRoutines[0]->codeLength;
+
+    bool repeat = true;
+    while (repeat)
+    {
+        repeat = false;
+        for (auto &gap : gaps)
+        {
+            if (gap.second < minUsefulSize)
+            {
+                dbgOutput << "dropping gap: $" << std::hex << gap.first << std::dec << " (size: " << gap.second << ")" << "\n";
+                statWasted += gap.second;
+                gaps.erase(gap.first);
+                repeat = true;
+                break;
+            }
+        }
+    }
+}
+
+void BinningProblem::sortFloatingRoutinesBySize()
+{
+    // Sort the unallocated routines by size, starting from the smallest one
+
+    auto compare = [](const Routine *a, const Routine *b) -> bool { return a->codeLength < b->codeLength; };
+    std::sort (floatingRoutines.begin(), floatingRoutines.end(), compare);
+}
+
+//
+// Class 'SubsetSums'
+//
+
+SubsetSums::SubsetSums(const std::vector<Routine *> &routines, int capacity) :
+    numWords(capacity / 64 + 1)
+{
+    // Build the reachability table - each row is the previous one, OR-ed with itself shifted
+    // by the size of the next routine; this is 64 knapsack cells per machine instruction
+
+    reachable.resize(routines.size() + 1);
+    reachable[0].resize(numWords, 0);
+    reachable[0][0] = 1;
+
+    for (size_t n = 1; n <= routines.size(); n++)
+    {
+        const auto &prevRow = reachable[n - 1];
+        auto       &row     = reachable[n];
+
+        row = prevRow;
+
+        const size_t shiftWords = routines[n - 1]->codeLength / 64;
+        const size_t shiftBits  = routines[n - 1]->codeLength % 64;
+
+        for (size_t idx = shiftWords; idx < numWords; idx++)
+        {
+            uint64_t shifted = prevRow[idx - shiftWords] << shiftBits;
+            if (shiftBits != 0 && idx > shiftWords) shifted |= prevRow[idx - shiftWords - 1] >> (64 - shiftBits);
+            row[idx] |= shifted;
+        }
+
+        // Clear the bits above the capacity
+
+        if ((capacity + 1) % 64 != 0) row.back() &= (uint64_t(1) << ((capacity + 1) % 64)) - 1;
+    }
+}
+
+int SubsetSums::bestSum(size_t n, int capacity) const
+{
+    // Find the largest reachable sum not exceeding the given capacity
+
+    const auto &row = reachable[n];
+
+    size_t   idx  = capacity / 64;
+    uint64_t word = row[idx];
+    if (capacity % 64 != 63) word &= (uint64_t(2) << (capacity % 64)) - 1;
+
+    while (word == 0) word = row[--idx]; // bit 0 (empty sum) is always set
+
+    return idx * 64 + 63 - __builtin_clzll(word);
+}
+
+//
+// Class 'GlobalPacker'
+//
+
+GlobalPacker::GlobalPacker(const BinningProblem &problem, int timeBudgetMs) :
+    lowerBound(0),
+    bestWaste(std::numeric_limits<int>::max()),
+    improved(false),
+    searchComplete(false),
+    numNodes(0),
+    routines(problem.floatingRoutines),
+    totalFree(0),
+    totalRoutines(0),
+    timeBudget(timeBudgetMs),
+    timeout(false)
+{
+    for (const auto &gap : problem.gaps)
+    {
+        gapAddrs.push_back(gap.first);
+        gapSizes.push_back(gap.second);
+        totalFree += gap.second;
+    }
+
+    for (const auto &routine : routines) totalRoutines += routine->codeLength;
+
+    auto compare = [](const Routine *a, const Routine *b) -> bool { return a->codeLength > b->codeLength; };
+    std::stable_sort(routines.begin(), routines.end(), compare);
+
+    calcLowerBound();
+}
+
+int GlobalPacker::calcWaste(const BinningProblem &solvedProblem) const
+{
+    // The space left in the gap with the most free bytes is what remains for future code,
+    // everything else left in the gaps is considered wasted
+
+    std::vector<int> spaceLeft = gapSizes;
+    for (const auto &routine : solvedProblem.fixedRoutines)
+    {
+        if (std::find(routines.begin(), routines.end(), routine.second) == routines.end()) continue;
+
+        auto iter = std::upper_bound(gapAddrs.begin(), gapAddrs.end(), routine.first);
+        if (iter != gapAddrs.begin()) spaceLeft[iter - gapAddrs.begin() - 1] -= routine.second->codeLength;
+    }
+
+    return totalFree - totalRoutines - *std::max_element(spaceLeft.begin(), spaceLeft.end());
+}
+
+void GlobalPacker::calcLowerBound()
+{
+    // For each gap, calculate the best possible fill, assuming all the routines are available
+    // for this particular gap. Waste can't be lower than the sum of what is impossible to fill
+    // in all the gaps but the one left with free space, or lower than what remains in total
+    // if the gap left with free space is not used at all
+
+    std::vector<int> unfillable;
+    for (const auto gapSize : gapSizes)
+    {
+        SubsetSums subsetSums(routines, gapSize);
+        unfillable.push_back(gapSize - subsetSums.bestSum(routines.size(), gapSize));
+    }
+
+    int unfillableTotal = 0;
+    for (const auto value : unfillable) unfillableTotal += value;
+
+    lowerBound = std::numeric_limits<int>::max();
+    for (size_t idx = 0; idx < gapSizes.size(); idx++)
+    {
+        const int bound = std::max(unfillableTotal - unfillable[idx], totalFree - totalRoutines - gapSizes[idx]);
+        lowerBound = std::min(lowerBound, std::max(bound, 0));
+    }
+
+    remaining  = gapSizes;
+    lowerBound = std::max(lowerBound, calcBound(0));
+}
+
+int GlobalPacker::calcBound(size_t idx) const
+{
+    // Lower bound for the waste, with routines from 'idx' onwards still to be placed
+
+    std::vector<int> gapsLeft = remaining;
+    std::sort(gapsLeft.begin(), gapsLeft.end());
+
+    // Waste can't be lower than what doesn't fit in the largest gap
+
+    int bound = std::max(0, totalFree - totalRoutines - gapsLeft.back());
+
+    // Gaps not larger than 'x' can only be filled with routines not larger than 'x' - whatever
+    // these routines can't fill is wasted, except for possibly one gap left with free space
+
+    int sumGaps     = 0;
+    int sumRoutines = 0;
+    size_t routineIdx = routines.size();
+    for (const auto gapSize : gapsLeft)
+    {
+        sumGaps += gapSize;
+        while (routineIdx > idx && routines[routineIdx - 1]->codeLength <= gapSize)
+        {
+            sumRoutines += routines[--routineIdx]->codeLength;
+        }
+
+        bound = std::max(bound, sumGaps - sumRoutines - gapSize);
+    }
+
+    return bound;
+}
+
+void GlobalPacker::run(int incumbentWaste)
+{
+    bestWaste = incumbentWaste;
+
+    if (totalRoutines > totalFree || bestWaste <= lowerBound)
+    {
+        searchComplete = true;
+        return;
+    }
+
+    remaining = gapSizes;
+    choice.assign(routines.size(), -1);
+    deadline  = std::chrono::steady_clock::now() + timeBudget;
+
+    search(0);
+
+    searchComplete = !timeout;
+}
+
+void GlobalPacker::search(size_t idx)
+{
+    // Depth-first branch and bound - assign the routines, starting from the largest one,
+    // to the gaps, trying the tightest fitting gaps first
+
+    if (timeout || bestWaste <= lowerBound) return;
+    if ((++numNodes & 0xFFF) == 0 && std::chrono::steady_clock::now() > deadline)
+    {
+        timeout = true;
+        return;
+    }
+
+    if (idx == routines.size())
+    {
+        int maxRemaining = *std::max_element(remaining.begin(), remaining.end());
+        int waste        = totalFree - totalRoutines - maxRemaining;
+
+        if (waste >= bestWaste) return;
+
+        bestWaste = waste;
+        improved  = true;
+        bestSolution.clear();
+        for (size_t routineIdx = 0; routineIdx < routines.size(); routineIdx++)
+        {
+            // Within the gap, order the routines the way the greedy solver does - smallest first
+
+            bestSolution[gapAddrs[choice[routineIdx]]].push_front(routines[routineIdx]);
+        }
+
+        return;
+    }
+
+    if (calcBound(idx) >= bestWaste) return;
+
+    // Try the gaps, tightest fitting first; gaps with the same remaining space are equivalent,
+    // and identical routines are always placed in non-decreasing gap order
+
+    const int codeSize = routines[idx]->codeLength;
+    const int minGap   = (idx > 0 && routines[idx - 1]->codeLength == codeSize) ? choice[idx - 1] : 0;
+
+    std::vector<int> candidates;
+    for (int gapIdx = minGap; gapIdx < int(remaining.size()); gapIdx++)
+    {
+        if (remaining[gapIdx] >= codeSize) candidates.push_back(gapIdx);
+    }
+
+    auto compare = [this](int a, int b) -> bool
+    {
+        return (remaining[a] != remaining[b]) ? remaining[a] < remaining[b] : a < b;
+    };
+    std::sort(candidates.begin(), candidates.end(), compare);
+
+    int lastTried = -1;
+    for (const auto gapIdx : candidates)
+    {
+        if (remaining[gapIdx] == lastTried) continue;
+        lastTried = remaining[gapIdx];
+
+        choice[idx]        = gapIdx;
+        remaining[gapIdx] -= codeSize;
+        search(idx + 1);
+        remaining[gapIdx] += codeSize;
+    }
+}
+
+//
+// Class 'Solver'
+//
+
+int Solver::calcLargestFreeBlock(const BinningProblem &unsolvedProblem, const BinningProblem &solvedProblem)
+{
+    // Largest continuous free space left for future code, after the floating routines are placed
+
+    int largestBlock = 0;
+    for (const auto &gap : unsolvedProblem.gaps)
+    {
+        const int gapEnd = gap.first + gap.second;
+
+        int freeStart = gap.first;
+        for (auto iter = solvedProblem.fixedRoutines.lower_bound(gap.first);
+             iter != solvedProblem.fixedRoutines.end() && iter->first < gapEnd; iter++)
+        {
+            largestBlock = std::max(largestBlock, iter->first - freeStart);
+            freeStart    = iter->first + iter->second->codeLength;
+        }
+
+        largestBlock = std::max(largestBlock, gapEnd - freeStart);
+    }
+
+    return largestBlock;
+}
+
+void Solver::run(const std::string &logFileNamePath)
+{
+    // Prepare the log file
+
+    unlink(logFileNamePath.c_str());
+    dbgOutput.open(logFileNamePath, std::fstream::out | std::fstream::trunc);
+
+    // Sort the floating routines, just to be extra sure
+
+    problem.sortFloatingRoutinesBySize();
+
+    // Place routines which should be stored in high-ROM
+
+    problem.placeHighRoutines(dbgOutput);
+
+    // Keep the routines at their previous addresses, if possible - if this makes the problem
+    // unsolvable, start again from scratch
+
+    if (layoutHint != nullptr && !problem.floatingRoutines.empty())
+    {
+        BinningProblem freshProblem = problem;
+
+        const int numFloating = problem.floatingRoutines.size();
+        const int numKept     = applyLayoutHint();
+
+        logOutput << "stable placement: " << numKept << " of " << numFloating <<
+                     " floating routines kept at their previous addresses" << "\n";
+
+        if (problem.placeConstrainedRoutines(dbgOutput))
+        {
+            problem.placeHotRoutines(dbgOutput);
+            fillGaps();
+        }
+        if (!problem.isSolved())
+        {
+            dbgOutput << "\n";
+            logOutput << "stable placement failed, placing all the routines anew" << "\n";
+            dbgOutput << "\n";
+
+            problem = freshProblem;
+        }
+        else
+        {
+            // Routines kept in place could fragment the free space more and more with each build -
+            // compare with a placement done from scratch, use it if considerably better
+
+            std::ostringstream quiet;
+            BinningProblem     compareProblem = freshProblem;
+            Solver             compareSolver(compareProblem, packerMs, nullptr, quiet);
+
+            if (compareProblem.placeConstrainedRoutines(compareSolver.dbgOutput))
+            {
+                compareProblem.placeHotRoutines(compareSolver.dbgOutput);
+                compareSolver.fillGaps();
+            }
+
+            const int stableFree = calcLargestFreeBlock(freshProblem, problem);
+            const int freshFree  = calcLargestFreeBlock(freshProblem, compareProblem);
+
+            if (compareProblem.isSolved() && freshFree - stableFree > STABLE_MAX_LOSS)
+            {
+                dbgOutput << "\n";
+                logOutput << "stable placement leaves " << stableFree << " bytes in one block, fresh one " << freshFree <<
+                             " - placing all the routines anew" << "\n";
+                dbgOutput << "\n";
+
+                problem = freshProblem;
+            }
+        }
+    }
+
+    if (!problem.isSolved())
+    {
+        if (!problem.placeConstrainedRoutines(dbgOutput)) ERROR("unable to satisfy routine placement constraints");
+        problem.placeHotRoutines(dbgOutput);
+        fillGaps();
+    }
+
+    // Print out the result
+
+    if (problem.isSolved())
+    {
+        dbgOutput << "\n";
+        logOutput << "all routines sucessfully placed" << "\n";
+        dbgOutput << "\n";
+        logOutput << "segment statistics:" << "\n";
+        // logOutput << "    - total size:   " << problem.statSize << "\n"; - for BASIC contains filling gap too
+        logOutput << "    - wasted bytes: " << problem.statWasted << "\n";
+        logOutput << "    - still free:   " << problem.statFree - problem.statWasted << "\n";
+    }
+
+    // Close the log file
+
+    if (!dbgOutput.good()) ERROR(std::string("error writing log file '") + logFileNamePath + "'");
+    dbgOutput.close();
+}
+
+int Solver::applyLayoutHint()
+{
+    // Put unchanged routines (same name and size) at their previous addresses,
+    // provided these are still within the free space; hot routines are only kept
+    // if they do not cross a page there
+
+    std::map<int, Routine *> hintedRoutines;
+    for (auto routine : problem.floatingRoutines)
+    {
+        auto iter = layoutHint->find(routine->fileName);
+        if (iter == layoutHint->end() || iter->second.second != routine->codeLength) continue;
+
+        const int address = iter->second.first;
+        if (routine->prefersSinglePage() && address / 0x100 != (address + routine->codeLength - 1) / 0x100) continue;
+
+        hintedRoutines[address] = routine;
+    }
+
+    dbgOutput << "applying the previous layout" << "\n";
+
+    int numKept = 0;
+    for (const auto &hintedRoutine : hintedRoutines)
+    {
+        if (problem.placeAt(dbgOutput, hintedRoutine.first, hintedRoutine.second)) numKept++;
+    }
+
+    dbgOutput << "\n";
+
+    return numKept;
+}
+
+void Solver::fillGaps()
+{
+    // Run the solver until all is done - if requested, try to find a better solution
+    // by considering all the gaps at once first
+
+    if (packerMs <= 0 || !fillGapsGlobal()) fillGapsGreedy();
+}
+
+void Solver::fillGapsGreedy()
+{
+    // Fill the gaps one by one, starting from the smallest one
+
+    while (!problem.gaps.empty() && !problem.floatingRoutines.empty())
+    {
+        problem.performObviousSteps(dbgOutput);
+        problem.removeUselessGaps(dbgOutput);
+
+        if (problem.gaps.empty() || problem.floatingRoutines.empty()) break;
+
+        int gapAddr = selectGapToFill();
+
+        dbgOutput << "selected gap: $" << std::hex << gapAddr << std::dec << " (size: " << problem.gaps[gapAddr] << ")" << "\n";
+
+        std::list<Routine *> partialSolution;
+        findPartialSolution(problem.gaps[gapAddr], partialSolution);
+        problem.fillGap(dbgOutput, gapAddr, partialSolution);
+    }
+}
+
+bool Solver::fillGapsGlobal()
+{
+    if (problem.floatingRoutines.empty() || problem.gaps.empty()) return false;
+
+    GlobalPacker packer(problem, packerMs);
+
+    // Greedy solution, calculated on a copy of the problem, is a starting point
+
+    BinningProblem greedyProblem = problem;
+    Solver         greedySolver(greedyProblem, 0);
+
+    greedySolver.fillGapsGreedy();
+    const int greedyWaste = greedyProblem.isSolved() ? packer.calcWaste(greedyProblem) : std::numeric_limits<int>::max();
+
+    packer.run(greedyWaste);
+
+    logOutput << "global packer: " << packer.numNodes << " nodes searched, " <<
+                 (packer.searchComplete ? "search complete" : "time budget exhausted") << "\n";
+    if (greedyProblem.isSolved())
+    {
+        logOutput << "    - greedy solution wastes:    " << greedyWaste << "\n";
+    }
+    if (packer.improved)
+    {
+        logOutput << "    - improved solution wastes:  " << packer.bestWaste << "\n";
+    }
+    logOutput << "    - lower bound for waste:     " << packer.lowerBound << "\n";
+
+    if (!packer.improved) return false;
+
+    // Apply the improved solution
+
+    dbgOutput << "applying solution from the global packer" << "\n";
+    for (const auto &gapSolution : packer.bestSolution)
+    {
+        dbgOutput << "selected gap: $" << std::hex << gapSolution.first << std::dec <<
+                     " (size: " << problem.gaps[gapSolution.first] << ")" << "\n";
+        problem.fillGap(dbgOutput, gapSolution.first, gapSolution.second);
+    }
+
+    problem.gaps.clear();
+    problem.statWasted = packer.bestWaste;
+
+    return true;
+}
+
+int Solver::selectGapToFill()
+{
+    // Find the smallest gap to fill-in
+
+    int gapAddr = -1;
+    int gapSize = -1;
+
+    for (auto &gap : problem.gaps)
+    {
+        if (gapSize < 0 || gap.second < gapSize)
+        {
+            gapAddr = gap.first;
+            gapSize = gap.second;
+        }
+    }
+
+    return gapAddr;
+}
+
+void Solver::findPartialSolution(int gapSize, std::list<Routine *> &partialSolution)
+{
+    // First filter out available routines, take only the ones not larger than our gap
+
+    std::vector<Routine *> routines;
+    routines.clear();
+    for (auto &routine : problem.floatingRoutines)
+    {
+        if (routine->codeLength <= gapSize)
+        {
+            routines.push_back(routine);
+        }
+        else break; // 'floatingRoutines' should be kept sorted
+    }
+
+    // Calculate all the sums which can be reached using the routines
+
+    SubsetSums subsetSums(routines, gapSize);
+
+    // Reconstruct the decisions, starting from the largest routine. Routine is taken if the best sum
+    // reachable with it is not worse than the best sum reachable without it.
+    //
+    // Note: if it seems equally good to take this routine, or not - take it! Evaluation starts
+    // from the largest routines, and we should prefer to leave a larger number of smaller routines -
+    // as this gives more possibilities while optimizing the usage of further gaps
+
+    int capacity = gapSize;
+    for (size_t n = routines.size(); n > 0; n--)
+    {
+        const int codeSize = routines[n - 1]->codeLength;
+        if (codeSize > capacity) continue;
+
+        if (subsetSums.bestSum(n - 1, capacity - codeSize) + codeSize >= subsetSums.bestSum(n - 1, capacity))
+        {
+            partialSolution.push_front(routines[n - 1]);
+            capacity -= codeSize;
+        }
+    }
+
+    return;
+}
+
+//
+// Binning problem dumps
+//
+
+void writeProblemDump(std::ostream &dumpFile, const std::list<const Routine *> &routines, int loAddress, int hiAddress)
+{
+    // Binning problem in a form which can be replayed without the sources
+
+    dumpFile << "range " << std::hex << loAddress << " " << hiAddress << std::dec << "\n";
+
+    for (const auto routine : routines)
+    {
+        // Line format is '<hex address or -> <size> <high> <alignment> <no page cross> <spans or -> <hotness> <file name>'
+
+        std::string spansStr;
+        for (const auto &pageSpan : routine->pageSpans)
+        {
+            spansStr += (spansStr.empty() ? "" : ",") + std::to_string(pageSpan.first) + "-" + std::to_string(pageSpan.second);
+        }
+
+        if (routine->floating) dumpFile << "-"; else dumpFile << std::hex << routine->startAddr << std::dec;
+        dumpFile << " " << routine->codeLength << " " << routine->high << " " << routine->alignment << " " <<
+                    routine->noPageCross << " " << (spansStr.empty() ? "-" : spansStr) << " " <<
+                    routine->hotness << " " << routine->fileName << "\n";
+    }
+}
+
+bool readProblemDump(const std::string &fileNamePath, std::list<Routine> &routines, int &loAddress, int &hiAddress)
+{
+    std::ifstream dumpFile(fileNamePath);
+    std::string line, keyword, loStr, hiStr;
+
+    if (!std::getline(dumpFile, line)) return false;
+    std::istringstream rangeStream(line);
+    if (!(rangeStream >> keyword >> loStr >> hiStr) || keyword != "range") return false;
+
+    loAddress = strtol(loStr.c_str(), nullptr, 16);
+    hiAddress = strtol(hiStr.c_str(), nullptr, 16);
+
+    while (std::getline(dumpFile, line))
+    {
+        std::istringstream stream(line);
+        std::string addrStr, spansStr, fileName;
+        int codeLength, alignment;
+        bool high, noPageCross;
+        uint64_t hotness;
+
+        if (!(stream >> addrStr >> codeLength >> high >> alignment >> noPageCross >> spansStr >> hotness) ||
+            !std::getline(stream >> std::ws, fileName)) return false;
+
+        routines.push_back(Routine(fileName));
+        auto &routine = routines.back();
+
+        routine.floating    = (addrStr == "-");
+        routine.startAddr   = routine.floating ? -1 : strtol(addrStr.c_str(), nullptr, 16);
+        routine.codeLength  = codeLength;
+        routine.high        = high;
+        routine.alignment   = alignment;
+        routine.noPageCross = noPageCross;
+        routine.hotness     = hotness;
+
+        std::istringstream spansStream(spansStr == "-" ? "" : spansStr);
+        std::string spanStr;
+        while (std::getline(spansStream, spanStr, ','))
+        {
+            const auto dashPos = spanStr.find('-');
+            if (dashPos == std::string::npos) return false;
+            routine.pageSpans.emplace_back(std::stoi(spanStr.substr(0, dashPos)), std::stoi(spanStr.substr(dashPos + 1)));
+        }
+        routine.numPageSpans = routine.pageSpans.size();
+    }
+
+    return true;
+}
@@ -0,0 +1,172 @@
+//
+// Routine placement solver, shared by the build segment tool
+// and the tool measuring its performance
+//
+
+#ifndef BINNING_H
+#define BINNING_H
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+const int STABLE_MAX_LOSS = 16; // bytes of the largest free block the stable placement may lose
+
+//
+// Class definitions
+//
+
+class Routine
+{
+public:
+    explicit Routine(const std::string &fileName);
+
+    std::string fileName;
+
+    bool floating;
+    bool high;
+
+    int startAddr;     // for fixed (non-floating) routines only
+    int codeLength;    // for both fixed and floating routines
+
+    int      alignment;    // required start address alignment, 1 = none
+    bool     noPageCross;  // whole routine has to fit within a single page
+    uint32_t numPageSpans; // number of marked page-sensitive spans
+
+    std::vector<std::pair<int, int>> pageSpans; // offsets of page-sensitive spans, retrieved during test run
+
+    uint64_t hotness;      // number of calls according to the profile, 0 = unknown
+
+    bool hasPlacementConstraints() const;
+    bool fitsAt(int address) const;
+    bool prefersSinglePage() const;
+};
+
+class BinningProblem
+{
+public:
+
+    BinningProblem() {};
+    BinningProblem(int loAddress, int hiAddress);
+
+    bool isSolved() const;
+
+    void addToProblem(Routine *routine);
+    void fillGap(std::ofstream &dbgOutput, int gapAddress, const std::list<Routine *> &routines);
+    bool placeAt(std::ofstream &dbgOutput, int address, Routine *routine);
+    void placeHighRoutines(std::ofstream &dbgOutput);
+    bool placeConstrainedRoutines(std::ofstream &dbgOutput);
+    void placeHotRoutines(std::ofstream &dbgOutput);
+    void performObviousSteps(std::ofstream &dbgOutput);
+    void removeUselessGaps(std::ofstream &dbgOutput);
+    void sortFloatingRoutinesBySize();
+
+    int findBestAddress(const Routine *routine, bool singlePage) const;
+
+    std::map<int, Routine *> fixedRoutines;    // routines with location already fixed
+    std::map<int, int>       gaps;             // gaps by address
+    std::vector<Routine *>   floatingRoutines; // routines not allocated to any address yet; always keep them sorted!
+
+    size_t maxFileNameLen = 0; // for formatting the logs
+
+    int statSize;
+    int statFree;
+    int statWasted;
+};
+
+class SubsetSums
+{
+public:
+    SubsetSums(const std::vector<Routine *> &routines, int capacity);
+
+    int bestSum(size_t n, int capacity) const;
+
+private:
+
+    size_t numWords;
+
+    std::vector<std::vector<uint64_t>> reachable; // bit 'x' of row 'n' set = sum 'x' possible using first 'n' routines
+};
+
+class GlobalPacker
+{
+public:
+    GlobalPacker(const BinningProblem &problem, int timeBudgetMs);
+
+    int  calcWaste(const BinningProblem &solvedProblem) const;
+    void run(int incumbentWaste);
+
+    int    lowerBound;     // no solution can waste less bytes than this
+    int    bestWaste;      // waste of the best solution found so far
+    bool   improved;       // true if solution better than the incumbent was found
+    bool   searchComplete; // true if the whole search space was examined
+    size_t numNodes;
+
+    std::map<int, std::list<Routine *>> bestSolution; // routines to place, by gap address
+
+private:
+
+    void calcLowerBound();
+    int  calcBound(size_t idx) const;
+    void search(size_t idx);
+
+    std::vector<int>       gapAddrs;
+    std::vector<int>       gapSizes;
+    std::vector<Routine *> routines;       // sorted by size, largest first
+
+    int totalFree;
+    int totalRoutines;
+
+    std::vector<int>       remaining;      // remaining space in each gap
+    std::vector<int>       choice;         // gap selected for each routine
+
+    std::chrono::milliseconds             timeBudget;
+    std::chrono::steady_clock::time_point deadline;
+    bool                                  timeout;
+};
+
+typedef std::map<std::string, std::pair<int, int>> RoutineLayout; // file name -> address, size
+
+class Solver
+{
+public:
+    Solver(BinningProblem &problem, int packerMs, const RoutineLayout *layoutHint = nullptr, std::ostream &console = std::cout) :
+        problem(problem), packerMs(packerMs), layoutHint(layoutHint), logOutput(dbgOutput, console) {}
+
+    void run(const std::string &logFileNamePath);
+
+    int  applyLayoutHint();
+    void fillGaps();
+    void fillGapsGreedy();
+    bool fillGapsGlobal();
+
+    int selectGapToFill();
+    void findPartialSolution(int gapSize, std::list<Routine *> &partialSolution);
+
+    static int calcLargestFreeBlock(const BinningProblem &unsolvedProblem, const BinningProblem &solvedProblem);
+
+private:
+
+    BinningProblem      &problem;
+    int                  packerMs;   // time budget for the global packer, 0 = disabled
+    const RoutineLayout *layoutHint;
+
+    std::ofstream dbgOutput;
+    DualStream    logOutput;
+};
+
+
+//
+// Binning problem dumps, see 'bench_binning' tool
+//
+
+void writeProblemDump(std::ostream &dumpFile, const std::list<const Routine *> &routines, int loAddress, int hiAddress);
+bool readProblemDump(const std::string &fileNamePath, std::list<Routine> &routines, int &loAddress, int &hiAddress);
+
+#endif // BINNING_H
@@ -4,26 +4,51 @@
 //
 
 #include "common.h"
+#include "binning.h"
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+    #include <sys/inotify.h>
+#endif
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fstream>
 #include <iomanip>
+#include <limits>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 const std::string LAB_OUT_START = "__routine_START_";
 const std::string LAB_OUT_END   = "__routine_END_";
-const std::string LAB_IN_START  = "\t" + LAB_OUT_START;
-const std::string LAB_IN_END    = "\t" + LAB_OUT_END;
+
+const std::string LAB_SPAN_BEGIN = "__span_BEGIN_";
+const std::string LAB_SPAN_END   = "__span_END_";
 
 //
 // Command line settings
@@ -37,6 +62,14 @@ std::string CMD_segInfo   = "(unnamed)";
 std::string CMD_romLayout = "STD";
 int         CMD_loAddress = 0xC000;
 int         CMD_hiAddress = 0xCFFF;
+int         CMD_jobs      = 1;
+int         CMD_packerMs  = 0;
+bool        CMD_stable    = false;
+std::string CMD_manifest;
+bool        CMD_server    = false;
+std::string CMD_profile;
+std::string CMD_exportRoot;
+std::string CMD_asmCache;
 
 std::list<std::string> CMD_inList;
 
@@ -50,8 +83,13 @@ void printUsage()
         "usage: build_segment [-a <assembler command>] [-o <out file>] [-d <out dir>]" << "\n" <<
         "                     [-l <start/low address>] [-h <end/high address>]" << "\n" <<
         "                     [-s <segment name>] [-i <segment display info>]" << "\n" <<
-        "                     [-r <rom layout>]" << "\n" <<
-        "                     <input dir/file list>" << "\n\n";
+        "                     [-r <rom layout>] [-j <parallel jobs, 0 = all cores>]" << "\n" <<
+        "                     [-g <global packer time budget in ms, 0 = disabled>]" << "\n" <<
+        "                     [-k (keep routines at their previous addresses, if possible)]" << "\n" <<
+        "                     [-p <routine hotness profile or program trace>]" << "\n" <<
+        "                     [-e <source tree root, drop unreferenced routines>]" << "\n" <<
+        "                     [-c <assembler output cache directory>]" << "\n" <<
+        "                     [-m <segment manifest> [-w]] <input dir/file list>" << "\n\n";
 }
 
 void printBanner()
@@ -71,34 +109,249 @@ std::string toLabel(const std::string &fileName)
     return retVal;
 }
 
+uint64_t calcHash(const char *data, size_t length, uint64_t hash = 0xCBF29CE484222325ULL)
+{
+    // FNV-1a, 64-bit variant - fast, and good enough to detect content changes
+
+    for (size_t idx = 0; idx < length; idx++)
+    {
+        hash ^= (uint8_t) data[idx];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+uint64_t calcFileHash(const std::string &fileNamePath)
+{
+    std::ifstream file(fileNamePath, std::fstream::binary);
+    if (!file.good()) return 0;
+
+    std::ostringstream content;
+    content << file.rdbuf();
+    return calcHash(content.str().data(), content.str().size());
+}
+
+std::string toHexString(uint64_t value)
+{
+    std::ostringstream stream;
+    stream << std::hex << std::setfill('0') << std::setw(16) << value;
+    return stream.str();
+}
+
+std::string toJsonString(const std::string &value)
+{
+    std::string retVal = "\"";
+
+    for (const char c : value)
+    {
+        if (c == '"' || c == '\\')
+        {
+            retVal += '\\';
+            retVal += c;
+        }
+        else if ((uint8_t) c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            retVal += buf;
+        }
+        else
+        {
+            retVal += c;
+        }
+    }
+
+    return retVal + "\"";
+}
+
+//
+// Assembler interface
+//
+
+typedef std::vector<std::pair<std::string, uint16_t>> SymbolList;
+typedef std::unordered_map<std::string, uint16_t>      SymbolIndex;
+
+pid_t startAssembler(const std::vector<std::string> &params, const std::string &logFileNameBare = "")
+{
+    // Launch the assembler directly, without a shell in between; it has to be started
+    // from within the output directory, all the file names passed are relative to it
+
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>(CMD_assembler.c_str()));
+    for (const auto &param : params) argv.push_back(const_cast<char *>(param.c_str()));
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0) ERROR("unable to launch the assembler");
+    if (pid == 0)
+    {
+        if (0 != chdir(CMD_outDir.c_str())) _exit(127);
+        if (!logFileNameBare.empty())
+        {
+            int fd = open(logFileNameBare.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0) _exit(127);
+            close(fd);
+        }
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+
+    return pid;
+}
+
+bool finishAssembler(pid_t pid)
+{
+    int status;
+    return waitpid(pid, &status, 0) >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void runAssembler(const std::vector<std::string> &params)
+{
+    std::cout << "asm call:";
+    for (const auto &param : params) std::cout << " " << param;
+    std::cout << "\n" << std::flush;
+
+    if (!finishAssembler(startAssembler(params))) ERROR("assembler running failed");
+}
+
+bool readSymbolFile(const std::string &fileNamePath, SymbolList &symbols)
+{
+    std::ifstream symFile(fileNamePath);
+    if (!symFile.good()) return false;
+
+    std::string line;
+    while (std::getline(symFile, line))
+    {
+        // Expected line format is '<tab><label><separator>= $<hex address>'
+
+        auto eqPos = line.rfind('=');
+        if (eqPos == std::string::npos || eqPos < 2 || eqPos + 3 > line.length()) continue;
+
+        symbols.emplace_back(line.substr(1, eqPos - 2), strtol(line.substr(eqPos + 3).c_str(), nullptr, 16));
+    }
+
+    symFile.close();
+    return true;
+}
+
+//
+// Assembler output cache
+//
+
+std::string getOutDirPath(const std::string &fileName)
+{
+    // Assembler is started from within the output directory, relative paths are relative to it
+
+    return (!fileName.empty() && fileName[0] == '/') ? fileName : CMD_outDir + DIR_SEPARATOR + fileName;
+}
+
+bool copyFile(const std::string &srcFileNamePath, const std::string &dstFileNamePath)
+{
+    std::ifstream srcFile(srcFileNamePath, std::fstream::binary);
+    if (!srcFile.good()) return false;
+
+    std::ofstream dstFile(dstFileNamePath, std::fstream::binary | std::fstream::trunc);
+    dstFile << srcFile.rdbuf();
+
+    return dstFile.good();
+}
+
+std::string calcAssemblerCacheKey(const std::string &sourceFileNamePath, const std::vector<std::string> &params)
+{
+    // Output only depends on the source, the assembler parameters, and the assembler itself; returns
+    // an empty key if the source includes other files - these are not tracked
+
+    std::ifstream sourceFile(sourceFileNamePath, std::fstream::binary);
+    std::ostringstream stream;
+    stream << sourceFile.rdbuf();
+    const std::string source = stream.str();
+
+    for (const auto &pseudoOp : { "!source", "!src", "!bin", "!convtab", "!ct " })
+    {
+        if (source.find(pseudoOp) != std::string::npos) return "";
+    }
+
+    // Assembler found using the PATH can only be identified by name
+
+    std::string context = "asm cache 1\n" + CMD_assembler + "\n";
+    if (CMD_assembler.find('/') != std::string::npos)
+    {
+        context += toHexString(calcFileHash(getOutDirPath(CMD_assembler))) + "\n";
+    }
+    for (const auto &param : params) context += param + "\n";
+
+    // Two differently seeded hashes make a 128-bit key
+
+    const uint64_t hash1 = calcHash(source.data(), source.size(), calcHash(context.data(), context.size()));
+    const uint64_t hash2 = calcHash(source.data(), source.size(), calcHash(context.data(), context.size(), hash1));
+
+    return toHexString(hash1) + toHexString(hash2);
+}
+
+bool fetchAssemblerOutput(const std::string &cacheKey, const std::vector<std::pair<std::string, std::string>> &outFiles)
+{
+    const std::string entryDir = CMD_asmCache + DIR_SEPARATOR + cacheKey;
+
+    for (const auto &outFile : outFiles)
+    {
+        if (!copyFile(entryDir + DIR_SEPARATOR + outFile.first, outFile.second)) return false;
+    }
+
+    return true;
+}
+
+void storeAssemblerOutput(const std::string &cacheKey, const std::vector<std::pair<std::string, std::string>> &outFiles)
+{
+    // Entry is prepared under a temporary name and then renamed, so that segments built
+    // in parallel never see an incomplete one
+
+    if (mkdir(CMD_asmCache.c_str(), 0755) < 0 && errno != EEXIST) return;
+
+    const std::string entryDir = CMD_asmCache + DIR_SEPARATOR + cacheKey;
+    const std::string tmpDir   = entryDir + ".tmp" + std::to_string(getpid());
+    if (mkdir(tmpDir.c_str(), 0755) < 0) return;
+
+    bool success = true;
+    for (const auto &outFile : outFiles)
+    {
+        success = success && copyFile(outFile.second, tmpDir + DIR_SEPARATOR + outFile.first);
+    }
+
+    if (success && rename(tmpDir.c_str(), entryDir.c_str()) == 0) return;
+
+    for (const auto &outFile : outFiles) unlink((tmpDir + DIR_SEPARATOR + outFile.first).c_str());
+    rmdir(tmpDir.c_str());
+}
+
 //
 // Class definitions
 //
 
-class SourceFile
+class SourceFile : public Routine
 {
 public:
     SourceFile(const std::string &fileName, const std::string &dirName);
 
-    void preprocess();
+    void preprocess(std::string_view input);
+
+    static std::string_view nextToken(std::string_view &line);
+    static bool nameMatch(std::string_view token, const std::string &name);
+    static void listImports(std::string_view input, const std::string &segName, std::set<std::string> &fileNames);
 
-    bool nameMatch(const std::string &token, const std::string &name);
+    bool isConfigFile() const { return !configEntries.empty(); }
 
-    std::string fileName;
     std::string dirName;
 
     bool ignore;
-    bool floating;
-    bool high;
 
-    std::map<std::string, std::list<std::pair<std::string, uint16_t>>> symbolImports;
+    std::map<std::string, std::vector<const SymbolIndex *>> symbolImports;
     std::map<uint32_t, std::pair<std::string, uint16_t>>               symbolAliases;
 
     std::vector<char> content;
 
     std::string label;
-    int startAddr;     // for fixed (non-floating) routines only
-    int codeLength;    // for both fixed and floating routines
+    uint64_t    contentHash; // hash of the preprocessed content
 
     int testAddrStart; // start address during test run
     int testAddrEnd;   // end address during test run
@@ -106,6 +359,9 @@ public:
 private:
 
     bool layoutProcessingDone;
+    bool pageSpanOpen;
+
+    std::map<uint32_t, std::string> spanLabels;
 
     typedef struct ConfigEntry {
         std::string          key;
@@ -116,56 +372,30 @@ private:
 
     std::map<uint32_t, ConfigEntry> configEntries;
 
-    void preprocessLine(const std::string &line, uint32_t lineNum);
-    void preprocessLine_Alias(const std::list<std::string> &tokens, std::list<std::string>::iterator &iter, uint32_t lineNum);
-    void preprocessLine_Config(const std::list<std::string> &tokens, std::list<std::string>::iterator &iter,
-                               const std::string &line, uint32_t lineNum);
-    void preprocessLine_Import(const std::list<std::string> &tokens, std::list<std::string>::iterator &iter);
-    void preprocessLine_Layout(const std::list<std::string> &tokens, std::list<std::string>::iterator &iter);
-};
-
-class BinningProblem
-{
-public:
-
-    BinningProblem() {};
-    BinningProblem(int loAddress, int hiAddress);
-
-    bool isSolved() const;
-
-    void addToProblem(SourceFile *routine);
-    void fillGap(std::ofstream &dbgOutput, int gapAddress, const std::list<SourceFile *> &routines);
-    void placeHighRoutines(std::ofstream &dbgOutput);
-    void performObviousSteps(std::ofstream &dbgOutput);
-    void removeUselessGaps(std::ofstream &dbgOutput);
-    void sortFloatingRoutinesBySize();
-
-    std::map<int, SourceFile *> fixedRoutines;    // routines with location already fixed
-    std::map<int, int>          gaps;             // gaps by address
-    std::vector<SourceFile *>   floatingRoutines; // routines not allocated to any address yet; always keep them sorted!
-
-    int statSize;
-    int statFree;
-    int statWasted;
+    bool preprocessLine(std::string_view line, uint32_t lineNum);
+    void preprocessLine_Alias(std::string_view rest, uint32_t lineNum);
+    void preprocessLine_Config(std::string_view rest, std::string_view line, uint32_t lineNum);
+    void preprocessLine_Import(std::string_view rest);
+    void preprocessLine_Layout(std::string_view rest);
+    void preprocessLine_Placement(std::string_view rest, uint32_t lineNum);
 };
 
-class Solver
-{
-public:
-    explicit Solver(BinningProblem &problem) : problem(problem), logOutput(dbgOutput, std::cout) {}
-
-    void run();
-
-    int selectGapToFill();
-    void findPartialSolution(int gapSize, std::list<SourceFile *> &partialSolution);
-
-private:
-
-    BinningProblem &problem;
-
-    std::ofstream dbgOutput;
-    DualStream    logOutput;
-};
+typedef struct ManifestEntry {
+    std::string            segName;
+    std::string            segInfo;
+    std::string            outFile;
+    int                    loAddress;
+    int                    hiAddress;
+    std::list<std::string> inList;
+    std::set<size_t>       dependencies; // segments which have to be built first
+    bool                   failed = false;
+} ManifestEntry;
+
+typedef struct FoldedRoutine {
+    std::string       fileName;
+    const SourceFile *keptRoutine; // identical routine, which gets placed instead
+    std::vector<std::pair<std::string, std::string>> aliases;
+} FoldedRoutine;
 
 //
 // Global variables
@@ -173,21 +403,61 @@ private:
 
 std::list<SourceFile> GLOBAL_sourceFiles;
 std::list<SourceFile> GLOBAL_sourceFiles_noCode;
+std::list<FoldedRoutine> GLOBAL_foldedRoutines;
 size_t                GLOBAL_maxFileNameLen    = 0;
 size_t                GLOBAL_totalRoutinesSize = 0;
 BinningProblem        GLOBAL_binningProblem;
+std::map<int, int>    GLOBAL_initialGaps;      // free space before placing the floating routines
+RoutineLayout         GLOBAL_previousLayout;   // layout hint used by the solver
+
+std::vector<std::pair<std::string, double>> GLOBAL_phaseTimes; // wall-clock milliseconds, by build phase
+std::chrono::steady_clock::time_point       GLOBAL_phaseStart;
+
+std::map<std::string, SymbolIndex> GLOBAL_symbolIndexes; // imported symbol files, by path
+
+std::vector<ManifestEntry>                      GLOBAL_manifest;
+std::map<std::string, std::string_view>         GLOBAL_sourceTexts;  // raw source file content, by path
+std::map<std::string, std::vector<std::string>> GLOBAL_dirListings;  // assembler files, by directory
+std::mutex                                      GLOBAL_cacheMutex;   // protects the maps above, sources are loaded in parallel
 
 //
 // Top-level functions
 //
 
+void finishPhase(const std::string &phase)
+{
+    const auto now = std::chrono::steady_clock::now();
+
+    GLOBAL_phaseTimes.emplace_back(phase, std::chrono::duration<double, std::milli>(now - GLOBAL_phaseStart).count());
+    GLOBAL_phaseStart = now;
+}
+
+const SymbolIndex *getSymbolIndex(const std::string &fileNamePath)
+{
+    // Each symbol file is only read once, no matter how many source files import it
+
+    std::lock_guard<std::mutex> lock(GLOBAL_cacheMutex);
+
+    auto iter = GLOBAL_symbolIndexes.find(fileNamePath);
+    if (iter != GLOBAL_symbolIndexes.end()) return &iter->second;
+
+    SymbolList symbols;
+    if (!readSymbolFile(fileNamePath, symbols)) return nullptr;
+
+    auto &symbolIndex = GLOBAL_symbolIndexes[fileNamePath];
+    symbolIndex.reserve(symbols.size());
+    for (const auto &symbol : symbols) symbolIndex.insert(symbol); // first definition wins
+
+    return &symbolIndex;
+}
+
 void parseCommandLine(int argc, char **argv)
 {
     int opt;
 
     // Retrieve command line options
 
-    while ((opt = getopt(argc, argv, "a:o:d:s:i:r:l:h:")) != -1)
+    while ((opt = getopt(argc, argv, "a:o:d:s:i:r:l:h:j:g:m:p:e:c:wk")) != -1)
     {
         switch(opt)
         {
@@ -199,6 +469,14 @@ void parseCommandLine(int argc, char **argv)
             case 'r': CMD_romLayout = optarg; break;
             case 'l': CMD_loAddress = strtol(optarg, nullptr, 16); break;
             case 'h': CMD_hiAddress = strtol(optarg, nullptr, 16); break;
+            case 'j': CMD_jobs      = strtol(optarg, nullptr, 10); break;
+            case 'g': CMD_packerMs  = strtol(optarg, nullptr, 10); break;
+            case 'm': CMD_manifest  = optarg; break;
+            case 'w': CMD_server    = true;   break;
+            case 'k': CMD_stable    = true;   break;
+            case 'p': CMD_profile   = optarg; break;
+            case 'e': CMD_exportRoot = optarg; break;
+            case 'c': CMD_asmCache   = optarg; break;
             default: printUsage(); ERROR();
         }
     }
@@ -210,14 +488,154 @@ void parseCommandLine(int argc, char **argv)
         CMD_inList.push_back(argv[idx]);
     }
 
-    if (CMD_inList.empty()) { printUsage(); ERROR("empty directory/file list"); }
+    if (CMD_inList.empty() && CMD_manifest.empty()) { printUsage(); ERROR("empty directory/file list"); }
+    if (CMD_server && CMD_manifest.empty()) { printUsage(); ERROR("resident build server needs a segment manifest"); }
 }
 
-void readSourceFiles()
+std::string_view getSourceText(const std::string &fileNamePath)
 {
+    // Each file is mapped into memory only once, and stays there until the program ends;
+    // this way all the segments built from a manifest share the same copy
+
+    {
+        std::lock_guard<std::mutex> lock(GLOBAL_cacheMutex);
+
+        auto iter = GLOBAL_sourceTexts.find(fileNamePath);
+        if (iter != GLOBAL_sourceTexts.end()) return iter->second;
+    }
+
+    int fd = open(fileNamePath.c_str(), O_RDONLY);
+    if (fd < 0) ERROR(fileNamePath + " - unable to open file");
+
     struct stat statBuf;
-    for (const auto &objName : CMD_inList)
+    if (fstat(fd, &statBuf) < 0) ERROR(fileNamePath + " - unable to open file");
+    if (statBuf.st_size == 0) ERROR(fileNamePath + " - file is empty");
+
+    void *mapping = mmap(nullptr, statBuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) ERROR(fileNamePath + " - error reading file content");
+
+    // File is mapped without holding the lock - another thread might have been faster
+
+    std::lock_guard<std::mutex> lock(GLOBAL_cacheMutex);
+
+    const auto result = GLOBAL_sourceTexts.emplace(fileNamePath, std::string_view(static_cast<const char *>(mapping), statBuf.st_size));
+    if (!result.second) munmap(mapping, statBuf.st_size);
+
+    return result.first->second;
+}
+
+bool isSourceFileName(const std::string &fileName)
+{
+    // Filter-out files which are not assembler files, temporary, etc.
+
+    if (fileName.length() < 3)   return false;
+    if (fileName.front() == '#') return false;
+    if (fileName.front() == '~') return false;
+
+    return fileName.substr(fileName.length() - 2) == ".s";
+}
+
+std::pair<std::string, std::string> splitPath(const std::string &objName)
+{
+    char *tmp1 = strdup(objName.c_str());
+    char *tmp2 = strdup(objName.c_str());
+
+    std::pair<std::string, std::string> retVal(basename(tmp2), dirname(tmp1)); // file name, directory name
+
+    free(tmp1);
+    free(tmp2);
+
+    return retVal;
+}
+
+int getNumJobs()
+{
+    return (CMD_jobs > 0) ? CMD_jobs : std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+template <typename Task> void runParallel(size_t numTasks, const Task &task)
+{
+    // Worker threads take the tasks one by one, so that a slow one (like a file on
+    // a network drive) does not hold back the rest
+
+    const size_t numThreads = std::min(size_t(getNumJobs()), numTasks);
+    if (numThreads <= 1)
+    {
+        for (size_t idx = 0; idx < numTasks; idx++) task(idx);
+        return;
+    }
+
+    std::atomic<size_t>      nextTask(0);
+    std::atomic<bool>        failed(false);
+    std::vector<std::thread> threads;
+    std::mutex               errorMutex;
+    std::string              errorMessage;
+
+    for (size_t idx = 0; idx < numThreads; idx++)
+    {
+        threads.emplace_back([&]()
+        {
+            // On error, remember the first message and stop taking new tasks
+
+            GLOBAL_errorThrows = true;
+            try
+            {
+                for (size_t taskIdx = nextTask++; taskIdx < numTasks && !failed; taskIdx = nextTask++) task(taskIdx);
+            }
+            catch (const ErrorException &error)
+            {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!failed.exchange(true)) errorMessage = error.what();
+            }
+        });
+    }
+
+    for (auto &thread : threads) thread.join();
+
+    if (failed && errorMessage.empty()) ERROR();
+    if (failed) ERROR(errorMessage);
+}
+
+const std::vector<std::string> &getDirListing(const std::string &dirName)
+{
+    {
+        std::lock_guard<std::mutex> lock(GLOBAL_cacheMutex);
+
+        auto iter = GLOBAL_dirListings.find(dirName);
+        if (iter != GLOBAL_dirListings.end()) return iter->second;
+    }
+
+    DIR *dirHandle = opendir(dirName.c_str());
+    if (!dirHandle) ERROR(std::string("unable to open directory '") + dirName + "'");
+
+    std::vector<std::string> dirListing;
+
+    struct dirent *dirEntry;
+    while ((dirEntry = readdir(dirHandle)) != nullptr)
+    {
+        const std::string fileName = dirEntry->d_name;
+        if (isSourceFileName(fileName)) dirListing.push_back(fileName);
+    }
+
+    closedir(dirHandle);
+
+    std::lock_guard<std::mutex> lock(GLOBAL_cacheMutex);
+    return GLOBAL_dirListings.emplace(dirName, std::move(dirListing)).first->second;
+}
+
+std::vector<std::pair<std::string, std::string>> collectInputFiles(const std::list<std::string> &inList)
+{
+    // Directories are scanned in parallel, results are merged in the command line order
+
+    const std::vector<std::string> objNames(inList.begin(), inList.end());
+    std::vector<std::vector<std::pair<std::string, std::string>>> objFiles(objNames.size());
+
+    runParallel(objNames.size(), [&](size_t idx)
     {
+        const auto &objName = objNames[idx];
+
+        struct stat statBuf;
         if (stat(objName.c_str(), &statBuf) < 0)
         {
             ERROR(std::string("can't get information about '") + objName + "'");
@@ -227,44 +645,39 @@ void readSourceFiles()
         {
             // This is a regular file
 
-            char *tmp1  = strdup(objName.c_str());
-            char *tmp2 = strdup(objName.c_str());
-
-            std::string dirName  = dirname(tmp1);
-            std::string fileName = basename(tmp2);
-
-            free(tmp1);
-            free(tmp2);
-
-            GLOBAL_sourceFiles.push_back(SourceFile(fileName, dirName));
-            GLOBAL_maxFileNameLen = std::max(GLOBAL_maxFileNameLen, fileName.length());
-            continue;
+            objFiles[idx].push_back(splitPath(objName));
+            return;
         }
 
         // This should be a directory
 
-        DIR *dirHandle = opendir(objName.c_str());
-        if (!dirHandle) ERROR(std::string("unable to open directory '") + objName + "'");
+        for (const auto &fileName : getDirListing(objName)) objFiles[idx].emplace_back(fileName, objName);
+    });
 
-        struct dirent *dirEntry;
-        while ((dirEntry = readdir(dirHandle)) != nullptr)
-        {
-            const std::string fileName = dirEntry->d_name;
+    std::vector<std::pair<std::string, std::string>> inputFiles; // file name, directory name
+    for (const auto &files : objFiles) inputFiles.insert(inputFiles.end(), files.begin(), files.end());
 
-            // Filter-out files which are not assembler files, temporary, etc.
+    return inputFiles;
+}
 
-            if (fileName.length() < 3)   continue;
-            if (fileName.front() == '#') continue;
-            if (fileName.front() == '~') continue;
-            if (fileName.substr(fileName.length() - 2) != ".s") continue;
+void readSourceFiles()
+{
+    const auto inputFiles = collectInputFiles(CMD_inList);
+    finishPhase("read");
 
-            // Add file to the global list
+    // Each file is loaded and preprocessed by the same worker, so that waiting for one file
+    // overlaps with processing the others
 
-            GLOBAL_sourceFiles.push_back(SourceFile(fileName, objName));
-            GLOBAL_maxFileNameLen = std::max(GLOBAL_maxFileNameLen, fileName.length());
-        }
+    std::vector<std::unique_ptr<SourceFile>> loadedFiles(inputFiles.size());
+    runParallel(inputFiles.size(), [&](size_t idx)
+    {
+        loadedFiles[idx] = std::make_unique<SourceFile>(inputFiles[idx].first, inputFiles[idx].second);
+    });
 
-        closedir(dirHandle);
+    for (size_t idx = 0; idx < inputFiles.size(); idx++)
+    {
+        GLOBAL_sourceFiles.push_back(std::move(*loadedFiles[idx]));
+        GLOBAL_maxFileNameLen = std::max(GLOBAL_maxFileNameLen, inputFiles[idx].first.length());
     }
 
     // Filter-out files marked as ignored
@@ -294,309 +707,2429 @@ void checkInputFileLabels()
     }
 }
 
-void calcRoutineSizes()
+std::string getCacheFileNamePath(const std::string &extension, const std::string &segName = CMD_segName)
 {
-    const std::string nameBase = CMD_segName + "_sizetest";
-    const std::string filePath = CMD_outDir + DIR_SEPARATOR;
-
-    const std::string outFileNameBare = nameBase + ".s";
-    const std::string outFileNamePath = filePath + outFileNameBare;
-    const std::string symFileNamePath = filePath + nameBase + ".sym";
+    // Cache is kept in a subdirectory, so that it survives removing the segment output files
 
-    // Remove old files
+    return CMD_outDir + DIR_SEPARATOR + ",cache" + DIR_SEPARATOR + segName + extension;
+}
 
-    unlink(outFileNamePath.c_str());
-    unlink(symFileNamePath.c_str());
+std::ofstream createCacheFile(const std::string &cacheFileNamePath)
+{
+    const std::string cacheDir = CMD_outDir + DIR_SEPARATOR + ",cache";
+    if (mkdir(cacheDir.c_str(), 0755) < 0 && errno != EEXIST) return std::ofstream();
 
-    // Write test file to determine routine sizes
+    return std::ofstream(cacheFileNamePath, std::fstream::out | std::fstream::trunc);
+}
 
-    std::ofstream outFile(outFileNamePath, std::fstream::out | std::fstream::trunc);
-    if (!outFile.good()) ERROR(std::string("can't open temporary file '") + outFileNamePath + "'");
+uint64_t calcSizeCacheContext()
+{
+    // Everything (besides the routine content itself) which might influence the routine sizes
 
-    // Start at $100, so that no local data gets accesses using ZP addressing modes
-    // during this pass, which would otherwise upset things later
+    std::string context = "sizes 2\n" + CMD_assembler + "\n" + CMD_romLayout + "\n" + CMD_segName + "\n";
+    uint64_t hash = calcHash(context.data(), context.size());
 
-    outFile << "\n" << "*=$100" << "\n";
-    outFile << "!set SEGMENT_" << CMD_segName << " = 1\n";
-    outFile << "!set ROM_LAYOUT_" << CMD_romLayout << " = 1\n";
+    // Config file is moved to the list of files without code once the sizes are known
 
-    for (const auto &sourceFile : GLOBAL_sourceFiles)
+    for (const auto sourceFiles : { &GLOBAL_sourceFiles, &GLOBAL_sourceFiles_noCode })
     {
-        outFile << "\n\n\n\n";
-        outFile << ";--- Source file " << sourceFile.fileName << "\n\n";
-        outFile << "!zone " << toLabel(sourceFile.fileName) << "\n\n";
-        outFile << LAB_OUT_START << sourceFile.label << ":" << "\n\n";
-
-        outFile << std::string(sourceFile.content.begin(), sourceFile.content.end());
-
-        outFile << "\n\n";
-        outFile << LAB_OUT_END << sourceFile.label << ":" << "\n";
+        for (const auto &sourceFile : *sourceFiles)
+        {
+            if (sourceFile.isConfigFile()) hash = calcHash(sourceFile.content.data(), sourceFile.content.size(), hash);
+        }
     }
 
-    if (!outFile.good()) ERROR(std::string("error writing temporary file '") + outFileNamePath + "'");
-    outFile.close();
+    return hash;
+}
 
-    // All written - now launch the assembler
+bool readSizeCache(std::set<const SourceFile *> &toMeasure)
+{
+    // Returns false if the cache can't be used at all; otherwise the sizes of unchanged routines
+    // are taken from the cache, and only the new or modified routines are left to be measured
 
-    const std::string cmdParams = std::string(" ") + "--color --outfile /dev/null --symbollist " +
-                                  CMD_segName + "_sizetest.sym " + outFileNameBare;
-    const std::string cmd       = "cd " + filePath + " && " + CMD_assembler + cmdParams;
+    for (const auto &sourceFile : GLOBAL_sourceFiles) toMeasure.insert(&sourceFile);
 
-    std::cout << "asm call:" << cmdParams << "\n" << std::flush;
-    if (0 != system(cmd.c_str()))
-    {
-        ERROR("assembler running failed");
-    }
+    std::ifstream cacheFile(getCacheFileNamePath(".sizes"));
+    if (!cacheFile.good()) return false;
 
-    // Read addresses
+    // Check if the cache was created for the same build context
+
+    std::string line;
+    if (!std::getline(cacheFile, line) || line.compare("context " + toHexString(calcSizeCacheContext())) != 0) return false;
+
+    // Read the cached routine sizes
+
+    std::map<std::string, std::pair<uint64_t, int>> cachedSizes;
+    std::map<std::string, std::vector<std::pair<int, int>>> cachedSpans;
+    while (std::getline(cacheFile, line))
+    {
+        // Expected line format is '<content hash> <code length> <page-sensitive spans> <file name>',
+        // spans are given as comma-separated '<start>-<end>' offsets, or '-' if there are none
+
+        std::istringstream stream(line);
+        std::string hashStr, spansStr, fileName;
+        int codeLength;
+
+        if (!(stream >> hashStr >> codeLength >> spansStr) || !std::getline(stream >> std::ws, fileName)) return false;
+        cachedSizes[fileName] = std::make_pair(std::stoull(hashStr, nullptr, 16), codeLength);
+
+        std::istringstream spansStream(spansStr);
+        int spanStart, spanEnd;
+        char separator;
+        while (spansStream >> spanStart >> separator >> spanEnd)
+        {
+            cachedSpans[fileName].emplace_back(spanStart, spanEnd);
+            spansStream >> separator;
+        }
+    }
+
+    // Take the sizes of the routines which have not changed
+
+    for (auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        auto iter = cachedSizes.find(sourceFile.fileName);
+        if (iter == cachedSizes.end() || iter->second.first != sourceFile.contentHash) continue;
+
+        sourceFile.codeLength = iter->second.second;
+        sourceFile.pageSpans  = cachedSpans[sourceFile.fileName];
+        toMeasure.erase(&sourceFile);
+    }
+
+    return true;
+}
+
+void writeSizeCache()
+{
+    // Failure to write the cache is not fatal, next run will just be slower
+
+    const std::string cacheFileNamePath = getCacheFileNamePath(".sizes");
+    std::ofstream cacheFile = createCacheFile(cacheFileNamePath);
+    if (!cacheFile.good()) return;
+
+    cacheFile << "context " << toHexString(calcSizeCacheContext()) << "\n";
+    for (const auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        std::string spansStr;
+        for (const auto &pageSpan : sourceFile.pageSpans)
+        {
+            spansStr += (spansStr.empty() ? "" : ",") + std::to_string(pageSpan.first) + "-" + std::to_string(pageSpan.second);
+        }
+
+        cacheFile << toHexString(sourceFile.contentHash) << " " << sourceFile.codeLength << " " <<
+                     (spansStr.empty() ? "-" : spansStr) << " " << sourceFile.fileName << "\n";
+    }
+
+    if (!cacheFile.good()) unlink(cacheFileNamePath.c_str());
+}
 
-    std::ifstream symFile;
-    symFile.open(symFileNamePath);
-    if (!symFile.good()) ERROR(std::string("unable to open results file '") + symFileNamePath + "'");
+bool readSymbolCache(std::map<std::string, uint16_t> &symbols)
+{
+    // Symbol values from the previous test run, in the assembler symbol file format
+
+    const std::string cacheFileNamePath = getCacheFileNamePath(".symbols");
 
+    std::ifstream cacheFile(cacheFileNamePath);
     std::string line;
-    while (std::getline(symFile, line))
+    if (!std::getline(cacheFile, line) || line.compare("; context " + toHexString(calcSizeCacheContext())) != 0) return false;
+    cacheFile.close();
+
+    SymbolList symbolList;
+    if (!readSymbolFile(cacheFileNamePath, symbolList)) return false;
+
+    symbols.insert(symbolList.begin(), symbolList.end());
+    return true;
+}
+
+void writeSymbolCache(const std::map<std::string, uint16_t> &symbols)
+{
+    const std::string cacheFileNamePath = getCacheFileNamePath(".symbols");
+    std::ofstream cacheFile = createCacheFile(cacheFileNamePath);
+    if (!cacheFile.good()) return;
+
+    cacheFile << "; context " << toHexString(calcSizeCacheContext()) << "\n";
+    for (const auto &symbol : symbols)
+    {
+        // Routine boundary labels are always generated anew
+
+        if (0 == symbol.first.compare(0, LAB_OUT_START.size(), LAB_OUT_START)) continue;
+        if (0 == symbol.first.compare(0, LAB_OUT_END.size(), LAB_OUT_END)) continue;
+
+        cacheFile << "\t" << symbol.first << "\t= $" << std::hex << std::setfill('0') << std::setw(4) << symbol.second << "\n";
+    }
+
+    if (!cacheFile.good()) unlink(cacheFileNamePath.c_str());
+}
+
+bool readLayoutCache(RoutineLayout &layout, const std::string &segName = CMD_segName)
+{
+    // Addresses of the floating routines from the previous build
+
+    std::ifstream cacheFile(getCacheFileNamePath(".layout", segName));
+    if (!cacheFile.good()) return false;
+
+    std::string line;
+    while (std::getline(cacheFile, line))
+    {
+        // Expected line format is '<hex address> <code length> <file name>'
+
+        std::istringstream stream(line);
+        std::string addrStr, fileName;
+        int codeLength;
+
+        if (!(stream >> addrStr >> codeLength) || !std::getline(stream >> std::ws, fileName)) return false;
+        layout[fileName] = std::make_pair((int) strtol(addrStr.c_str(), nullptr, 16), codeLength);
+    }
+
+    return true;
+}
+
+void writeLayoutCache()
+{
+    const std::string cacheFileNamePath = getCacheFileNamePath(".layout");
+    std::ofstream cacheFile = createCacheFile(cacheFileNamePath);
+    if (!cacheFile.good()) return;
+
+    for (const auto &routine : GLOBAL_binningProblem.fixedRoutines)
+    {
+        if (!routine.second->floating) continue;
+
+        cacheFile << std::hex << std::setfill('0') << std::setw(4) << routine.first << std::dec << " " <<
+                     routine.second->codeLength << " " << routine.second->fileName << "\n";
+    }
+
+    if (!cacheFile.good()) unlink(cacheFileNamePath.c_str());
+}
+
+bool scanDefinitions(const SourceFile &sourceFile, std::set<std::string> &labels)
+{
+    // Collect global labels defined by the routine. Returns true if the file defines something
+    // else too (assigned symbols, macros) - such files are included in every test shard
+
+    bool otherDefinitions = false;
+
+    auto isSymbolStart = [](char c) -> bool { return isalpha(c) || c == '_'; };
+    auto isSymbolChar  = [](char c) -> bool { return isalnum(c) || c == '_'; };
+
+    std::istringstream stream(std::string(sourceFile.content.begin(), sourceFile.content.end()));
+    std::string line;
+    while (std::getline(stream, line))
+    {
+        line = line.substr(0, line.find(';'));
+
+        if (line.find("!set")   != std::string::npos ||
+            line.find("!addr")  != std::string::npos ||
+            line.find("!macro") != std::string::npos)
+        {
+            otherDefinitions = true;
+            continue;
+        }
+
+        // Labels start at the first column, assignments might be indented
+
+        size_t pos = 0;
+        while (pos < line.length() && isspace(line[pos])) pos++;
+        if (pos >= line.length() || !isSymbolStart(line[pos])) continue;
+
+        const size_t symStart = pos;
+        while (pos < line.length() && isSymbolChar(line[pos])) pos++;
+        const std::string symbol = line.substr(symStart, pos - symStart);
+
+        while (pos < line.length() && isspace(line[pos])) pos++;
+        if (pos < line.length() && line[pos] == '=' && (pos + 1 >= line.length() || line[pos + 1] != '='))
+        {
+            otherDefinitions = true;
+        }
+        else if (symStart == 0)
+        {
+            labels.insert(symbol);
+        }
+    }
+
+    return otherDefinitions;
+}
+
+void writeSizeTestFile(const std::string &outFileNamePath, const std::list<const SourceFile *> &sourceFiles,
+                       const std::map<std::string, uint16_t> &stubs)
+{
+    std::ofstream outFile(outFileNamePath, std::fstream::out | std::fstream::trunc);
+    if (!outFile.good()) ERROR(std::string("can't open temporary file '") + outFileNamePath + "'");
+
+    // Start at $100, so that no local data gets accesses using ZP addressing modes
+    // during this pass, which would otherwise upset things later
+
+    outFile << "\n" << "*=$100" << "\n";
+    outFile << "!set SEGMENT_" << CMD_segName << " = 1\n";
+    outFile << "!set ROM_LAYOUT_" << CMD_romLayout << " = 1\n";
+
+    // Labels of routines being measured in other shards
+
+    if (!stubs.empty()) outFile << "\n";
+    for (const auto &stub : stubs)
+    {
+        outFile << stub.first << " = $" << std::hex << stub.second << std::dec << "\n";
+    }
+
+    for (const auto sourceFile : sourceFiles)
+    {
+        outFile << "\n\n\n\n";
+        outFile << ";--- Source file " << sourceFile->fileName << "\n\n";
+        outFile << "!zone " << toLabel(sourceFile->fileName) << "\n\n";
+        outFile << LAB_OUT_START << sourceFile->label << ":" << "\n\n";
+
+        outFile << std::string(sourceFile->content.begin(), sourceFile->content.end());
+
+        outFile << "\n\n";
+        outFile << LAB_OUT_END << sourceFile->label << ":" << "\n";
+    }
+
+    if (!outFile.good()) ERROR(std::string("error writing temporary file '") + outFileNamePath + "'");
+    outFile.close();
+}
+
+void readSizeTestResults(const SymbolList &symbols, const std::set<const SourceFile *> &sourceFiles)
+{
+    std::map<std::string, SourceFile *> labelMap;
+    for (auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        if (sourceFiles.count(&sourceFile) != 0) labelMap[sourceFile.label] = &sourceFile;
+    }
+
+    std::map<std::pair<std::string, uint32_t>, std::pair<int, int>> spanAddrs; // by label and span number
+
+    for (const auto &symbol : symbols)
     {
         bool startLabel;
+        std::string refLabel;
+
+        // Page-sensitive span boundaries - label format is '<prefix><span number>_<routine label>'
+
+        const bool spanBegin = (0 == symbol.first.compare(0, LAB_SPAN_BEGIN.size(), LAB_SPAN_BEGIN));
+        const bool spanEnd   = (0 == symbol.first.compare(0, LAB_SPAN_END.size(), LAB_SPAN_END));
+        if (spanBegin || spanEnd)
+        {
+            const std::string rest = symbol.first.substr(spanBegin ? LAB_SPAN_BEGIN.size() : LAB_SPAN_END.size());
+            const auto sepPos = rest.find('_');
+            if (sepPos == std::string::npos) continue;
+
+            auto &spanAddr = spanAddrs[std::make_pair(rest.substr(sepPos + 1), std::stoul(rest.substr(0, sepPos)))];
+            (spanBegin ? spanAddr.first : spanAddr.second) = symbol.second;
+            continue;
+        }
 
-        if (0 == line.compare(0, LAB_IN_START.size(), LAB_IN_START))
+        if (0 == symbol.first.compare(0, LAB_OUT_START.size(), LAB_OUT_START))
         {
-            line.erase(0, LAB_IN_START.length());
+            refLabel   = symbol.first.substr(LAB_OUT_START.length());
             startLabel = true;
         }
-        else if (0 == line.compare(0, LAB_IN_END.size(), LAB_IN_END))
+        else if (0 == symbol.first.compare(0, LAB_OUT_END.size(), LAB_OUT_END))
         {
-            line.erase(0, LAB_IN_END.length());
+            refLabel   = symbol.first.substr(LAB_OUT_END.length());
             startLabel = false;
         }
         else continue;
 
-        // Decode address, write it into the object
+        // Write the address into the object
+
+        auto iter = labelMap.find(refLabel);
+        if (iter == labelMap.end()) continue;
+
+        if (startLabel)
+        {
+            iter->second->testAddrStart = symbol.second;
+        }
+        else
+        {
+            iter->second->testAddrEnd = symbol.second;
+        }
+    }
+
+    // Convert the span boundaries to offsets within the routines; spans within
+    // code which was not assembled (conditional compilation) are skipped
+
+    for (auto &labelEntry : labelMap)
+    {
+        SourceFile *sourceFile = labelEntry.second;
+        sourceFile->pageSpans.clear();
+
+        for (uint32_t idx = 0; idx < sourceFile->numPageSpans; idx++)
+        {
+            auto iter = spanAddrs.find(std::make_pair(labelEntry.first, idx));
+            if (iter == spanAddrs.end() || iter->second.first == 0 || iter->second.second == 0) continue;
+
+            sourceFile->pageSpans.emplace_back(iter->second.first  - sourceFile->testAddrStart,
+                                               iter->second.second - sourceFile->testAddrStart);
+        }
+    }
+}
+
+bool measureRoutineSizesSharded(const std::set<const SourceFile *> &toMeasure)
+{
+    // Shards need label values from the previous test run, to resolve references to routines
+    // measured in other shards - or not measured at all, if their sizes were taken from the cache;
+    // without a previous run, placeholders are used - like the single test run (which starts
+    // at $100) does, this assumes sizes do not depend on the addresses, as long as these are >= $100
+
+    const uint16_t placeholder = 0x100;
+
+    std::map<std::string, uint16_t> prevSymbols;
+    const bool coldRun   = !readSymbolCache(prevSymbols);
+    const bool partial   = (toMeasure.size() < GLOBAL_sourceFiles.size());
+    int        numShards = getNumJobs();
+
+    if (coldRun && partial) return false;
+
+    // Split the files into shared ones and routines to distribute
+
+    std::map<const SourceFile *, std::set<std::string>> fileLabels;
+    std::vector<const SourceFile *>                     routines;
+    std::vector<const SourceFile *>                     allRoutines;
+    std::list<const SourceFile *>                       sharedFiles;
+
+    for (const auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        if (scanDefinitions(sourceFile, fileLabels[&sourceFile]))
+        {
+            sharedFiles.push_back(&sourceFile);
+            continue;
+        }
+
+        allRoutines.push_back(&sourceFile);
+        if (toMeasure.count(&sourceFile) != 0) routines.push_back(&sourceFile);
+    }
+
+    // Changed macros or symbol definitions might affect the size of every routine
+
+    for (const auto sharedFile : sharedFiles)
+    {
+        if (partial && toMeasure.count(sharedFile) != 0) return false;
+    }
+
+    numShards = std::min(numShards, int(routines.size()));
+    if (numShards < 1 || (numShards == 1 && !partial)) return false;
+
+    // Distribute the routines, largest sources first, always to the least loaded shard
+
+    std::stable_sort(routines.begin(), routines.end(),
+        [](const SourceFile *a, const SourceFile *b) -> bool { return a->content.size() > b->content.size(); });
+
+    std::vector<std::set<const SourceFile *>> shards(numShards);
+    std::vector<size_t>                       shardLoad(numShards, 0);
+
+    for (const auto routine : routines)
+    {
+        const int shard = std::min_element(shardLoad.begin(), shardLoad.end()) - shardLoad.begin();
+        shards[shard].insert(routine);
+        shardLoad[shard] += routine->content.size();
+    }
+
+    // Prepare and launch the test runs
+
+    const std::string filePath = CMD_outDir + DIR_SEPARATOR;
+
+    std::vector<std::map<std::string, uint16_t>> shardStubs(numShards);
+    std::vector<pid_t>                           shardPids(numShards);
+
+    for (int shard = 0; shard < numShards; shard++)
+    {
+        const std::string nameBase = CMD_segName + "_sizetest_" + std::to_string(shard);
+
+        std::list<const SourceFile *> shardFiles;
+        std::set<std::string>         ownLabels;
+
+        for (const auto &sourceFile : GLOBAL_sourceFiles)
+        {
+            // Keep the original file order, it might matter for the assembler
+
+            if (shards[shard].count(&sourceFile) == 0 &&
+                std::find(sharedFiles.begin(), sharedFiles.end(), &sourceFile) == sharedFiles.end()) continue;
+
+            shardFiles.push_back(&sourceFile);
+            ownLabels.insert(fileLabels[&sourceFile].begin(), fileLabels[&sourceFile].end());
+        }
+
+        for (const auto routine : allRoutines)
+        {
+            if (shards[shard].count(routine) != 0) continue;
+            for (const auto &label : fileLabels[routine])
+            {
+                if (ownLabels.count(label) != 0) continue;
+
+                auto iter = prevSymbols.find(label);
+                if (iter != prevSymbols.end()) shardStubs[shard].insert(*iter);
+                else if (coldRun) shardStubs[shard].emplace(label, placeholder);
+            }
+        }
+
+        unlink((filePath + nameBase + ".sym").c_str());
+        writeSizeTestFile(filePath + nameBase + ".s", shardFiles, shardStubs[shard]);
+
+        shardPids[shard] = startAssembler({ "--color", "--outfile", "/dev/null", "--symbollist", nameBase + ".sym",
+                                            nameBase + ".s" }, nameBase + ".log");
+    }
+
+    if (partial)
+    {
+        std::cout << "measuring " << routines.size() << " new or changed routines using " << numShards <<
+                     " test runs, sizes of the other " << allRoutines.size() - routines.size() << " taken from cache\n" << std::flush;
+    }
+    else
+    {
+        std::cout << "measuring routine sizes using " << numShards << " parallel test runs\n" << std::flush;
+    }
+
+    bool success = true;
+    for (int shard = 0; shard < numShards; shard++)
+    {
+        if (!finishAssembler(shardPids[shard])) success = false;
+    }
+
+    // Retrieve the results; files shared by all the shards are taken from the first one, labels
+    // of the routines not measured this time keep their values from the previous run
+
+    std::set<const SourceFile *>    measured(sharedFiles.begin(), sharedFiles.end());
+    std::map<std::string, uint16_t> newSymbols;
+    if (partial) newSymbols = prevSymbols;
+    for (int shard = 0; shard < numShards && success; shard++)
+    {
+        const std::string symFileNamePath = filePath + CMD_segName + "_sizetest_" + std::to_string(shard) + ".sym";
+
+        SymbolList symbols;
+        if (!readSymbolFile(symFileNamePath, symbols)) { success = false; break; }
+
+        std::set<const SourceFile *> measuredFiles = shards[shard];
+        if (shard == 0) measuredFiles.insert(sharedFiles.begin(), sharedFiles.end());
+        readSizeTestResults(symbols, measuredFiles);
+        measured.insert(shards[shard].begin(), shards[shard].end());
+
+        std::set<std::string> ownLabels;
+        for (const auto routine : shards[shard]) ownLabels.insert(fileLabels[routine].begin(), fileLabels[routine].end());
+
+        for (const auto &symbol : symbols)
+        {
+            if (ownLabels.count(symbol.first) != 0) newSymbols[symbol.first] = symbol.second;
+            else if (shardStubs[shard].count(symbol.first) == 0) newSymbols.insert(symbol);
+        }
+    }
+
+    for (const auto sourceFile : measured)
+    {
+        if (sourceFile->testAddrStart <= 0 || sourceFile->testAddrEnd <= 0 ||
+            sourceFile->testAddrStart > sourceFile->testAddrEnd) success = false;
+    }
+
+    if (!success)
+    {
+        // Most likely a routine references a symbol not known from the previous run - a stub
+        // is missing, because the label is brand new
+
+        std::cout << (partial ? "test runs of the changed routines failed, measuring all of them\n" :
+                                "parallel test runs failed, falling back to a single one\n");
+        for (auto &sourceFile : GLOBAL_sourceFiles) sourceFile.testAddrStart = sourceFile.testAddrEnd = -1;
+        return false;
+    }
+
+    for (auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        if (measured.count(&sourceFile) == 0) continue;
+        sourceFile.codeLength = sourceFile.testAddrEnd - sourceFile.testAddrStart;
+    }
+
+    writeSymbolCache(newSymbols);
+    return true;
+}
+
+void measureRoutineSizes()
+{
+    const std::string nameBase = CMD_segName + "_sizetest";
+    const std::string filePath = CMD_outDir + DIR_SEPARATOR;
+
+    const std::string outFileNameBare = nameBase + ".s";
+    const std::string outFileNamePath = filePath + outFileNameBare;
+    const std::string symFileNamePath = filePath + nameBase + ".sym";
+
+    // Remove old files
+
+    unlink(outFileNamePath.c_str());
+    unlink(symFileNamePath.c_str());
+
+    // Write test file to determine routine sizes
+
+    std::list<const SourceFile *> sourceFiles;
+    for (const auto &sourceFile : GLOBAL_sourceFiles) sourceFiles.push_back(&sourceFile);
+
+    writeSizeTestFile(outFileNamePath, sourceFiles, {});
+
+    // All written - now launch the assembler
+
+    runAssembler({ "--color", "--outfile", "/dev/null", "--symbollist", nameBase + ".sym", outFileNameBare });
+
+    // Read addresses
+
+    SymbolList symbols;
+    if (!readSymbolFile(symFileNamePath, symbols))
+    {
+        ERROR(std::string("unable to open results file '") + symFileNamePath + "'");
+    }
+
+    readSizeTestResults(symbols, std::set<const SourceFile *>(sourceFiles.begin(), sourceFiles.end()));
+
+    // Calculate size of each and every routine
+
+    for (auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        if (sourceFile.testAddrStart <= 0 || sourceFile.testAddrEnd <= 0 ||
+            sourceFile.testAddrStart > sourceFile.testAddrEnd)
+        {
+            ERROR(std::string("unable to determine code length in '") + sourceFile.fileName + "'");
+        }
+
+        sourceFile.codeLength = sourceFile.testAddrEnd - sourceFile.testAddrStart;
+    }
+
+    // Remember the symbol values, parallel test runs need them
+
+    writeSymbolCache(std::map<std::string, uint16_t>(symbols.begin(), symbols.end()));
+}
+
+void calcRoutineSizes()
+{
+    // Assemble the routines to measure them - only the ones changed since the previous run,
+    // if possible; if this fails, measure all of them
+
+    std::set<const SourceFile *> toMeasure;
+    const bool cacheValid = readSizeCache(toMeasure);
+
+    if (toMeasure.empty())
+    {
+        std::cout << "routine sizes taken from cache\n";
+    }
+    else
+    {
+        std::set<const SourceFile *> allFiles;
+        for (const auto &sourceFile : GLOBAL_sourceFiles) allFiles.insert(&sourceFile);
+
+        bool measured = false;
+        if (cacheValid && toMeasure.size() < allFiles.size()) measured = measureRoutineSizesSharded(toMeasure);
+        if (!measured && CMD_jobs != 1) measured = measureRoutineSizesSharded(allFiles);
+
+        if (!measured) measureRoutineSizes();
+        writeSizeCache();
+    }
+
+    for (const auto &sourceFile : GLOBAL_sourceFiles) GLOBAL_totalRoutinesSize += sourceFile.codeLength;
+
+    // Check whether total code size is sane
+
+    if (0 == GLOBAL_totalRoutinesSize) ERROR("total code size is 0");
+    if (signed(GLOBAL_totalRoutinesSize) > CMD_hiAddress - CMD_loAddress)
+    {
+        ERROR(std::string("total code size is ") + std::to_string(GLOBAL_totalRoutinesSize) + ", too much for this segment!");
+    }
+
+    // Report routines with placement constraints
+
+    for (const auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        if (!sourceFile.hasPlacementConstraints()) continue;
+
+        std::cout << "placement constraints for '" << sourceFile.fileName << "':" << std::hex;
+        if (sourceFile.alignment > 1) std::cout << " align $" << sourceFile.alignment;
+        if (sourceFile.noPageCross)   std::cout << " no page crossing";
+        for (const auto &pageSpan : sourceFile.pageSpans)
+        {
+            std::cout << " page-sensitive span +$" << pageSpan.first << "-$" << pageSpan.second - 1;
+        }
+        std::cout << std::dec << "\n";
+    }
+
+    // Sort the file list by code size, starting from the smallest
+
+    auto compare = [](const SourceFile &a, const SourceFile &b) -> bool { return a.codeLength < b.codeLength; };
+    GLOBAL_sourceFiles.sort(compare);
+
+    // Move zero-sized element to a separate list
+
+    while (GLOBAL_sourceFiles.front().codeLength == 0)
+    {
+        GLOBAL_sourceFiles_noCode.push_back(GLOBAL_sourceFiles.front());
+        GLOBAL_sourceFiles.pop_front();
+    }
+}
+
+void collectExportedLabels(const std::string &dirName, std::set<std::string> &labels)
+{
+    // Labels used by other segments are only visible as aliases, like '#ALIAS# panic = KERNAL_0.panic'
+
+    DIR *dirHandle = opendir(dirName.c_str());
+    if (!dirHandle) ERROR(std::string("unable to open directory '") + dirName + "'");
+
+    struct dirent *dirEntry;
+    while ((dirEntry = readdir(dirHandle)) != nullptr)
+    {
+        const std::string fileName = dirEntry->d_name;
+        const std::string fileNamePath = dirName + DIR_SEPARATOR + fileName;
+        if (fileName == "." || fileName == "..") continue;
+
+        struct stat statBuf;
+        if (stat(fileNamePath.c_str(), &statBuf) != 0) continue;
+
+        if (S_ISDIR(statBuf.st_mode))
+        {
+            collectExportedLabels(fileNamePath, labels);
+            continue;
+        }
+
+        if (!isSourceFileName(fileName)) continue;
+
+        std::istringstream stream{std::string(getSourceText(fileNamePath))};
+        std::string line;
+        while (std::getline(stream, line))
+        {
+            const auto pos = line.find("#ALIAS#");
+            if (pos == std::string::npos) continue;
+
+            std::istringstream lineStream(line.substr(pos));
+            std::string token;
+            while (lineStream >> token)
+            {
+                const auto dotPos = token.find('.');
+                if (dotPos != std::string::npos && dotPos > 0) labels.insert(token.substr(dotPos + 1));
+            }
+        }
+    }
+
+    closedir(dirHandle);
+}
+
+void scanReferences(const SourceFile &sourceFile, const std::map<std::string, uint16_t> &symbols,
+                    std::set<std::string> &active, std::set<std::string> &inactive)
+{
+    // Collect symbols used by the file; the ones within '!ifdef' / '!ifndef' blocks disabled
+    // according to the assembled symbol list are put into the 'inactive' set. Conditions are
+    // tri-state: 1 = true (or not a conditional block), 0 = false, -1 = unknown
+
+    auto negate = [](int value) -> int { return (value < 0) ? -1 : 1 - value; };
+    auto both   = [](int value1, int value2) -> int
+    {
+        if (value1 == 0 || value2 == 0) return 0;
+        return (value1 == 1 && value2 == 1) ? 1 : -1;
+    };
+    auto either = [](int value1, int value2) -> int
+    {
+        if (value1 == 1 || value2 == 1) return 1;
+        return (value1 == 0 && value2 == 0) ? 0 : -1;
+    };
+
+    typedef struct BlockState {
+        bool active;
+        int  chainTaken; // whether any block of the 'if ... else if ... else' chain so far is taken
+    } BlockState;
+
+    std::vector<BlockState> blocks = { { true, 1 } };
+
+    int  pendingCondition = 1;     // condition for the next block
+    int  pendingChain     = 1;
+    int  lastChain        = 1;     // chain state of the most recently closed block
+    bool afterElse        = false;
+    int  pendingSymbol    = 0;     // 1 = next symbol is an '!ifdef' argument, -1 = '!ifndef' one
+
+    auto isSymbolStart = [](char c) -> bool { return isalpha(c) || c == '_'; };
+    auto isSymbolChar  = [](char c) -> bool { return isalnum(c) || c == '_'; };
+
+    auto addCondition = [&](int condition)
+    {
+        if (afterElse)
+        {
+            pendingCondition = both(negate(lastChain), condition);
+            pendingChain     = either(lastChain, condition);
+        }
+        else
+        {
+            pendingCondition = pendingChain = condition;
+        }
+
+        afterElse = false;
+    };
+
+    const std::vector<char> &text = sourceFile.content;
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        const char c = text[pos];
+
+        if (c == ';')
+        {
+            while (pos < text.size() && text[pos] != '\n') pos++;
+        }
+        else if (c == '\n')
+        {
+            pendingCondition = pendingChain = 1;
+            afterElse        = false;
+            pendingSymbol    = 0;
+            pos++;
+        }
+        else if (c == '"' || c == '\'')
+        {
+            for (pos++; pos < text.size() && text[pos] != c && text[pos] != '\n'; pos++)
+            {
+                if (text[pos] == '\\') pos++;
+            }
+            pos++;
+        }
+        else if (c == '{')
+        {
+            blocks.push_back({ blocks.back().active && pendingCondition != 0, pendingChain });
+            pendingCondition = pendingChain = 1;
+            afterElse        = false;
+            pos++;
+        }
+        else if (c == '}')
+        {
+            if (blocks.size() > 1)
+            {
+                lastChain = blocks.back().chainTaken;
+                blocks.pop_back();
+            }
+            pos++;
+        }
+        else if (c == '$' || c == '%' || isdigit(c))
+        {
+            // Number - skip it, so that hex digits are not taken for a symbol
+
+            for (pos++; pos < text.size() && isalnum(text[pos]); pos++);
+        }
+        else if (isSymbolStart(c))
+        {
+            const size_t start = pos;
+            while (pos < text.size() && isSymbolChar(text[pos])) pos++;
+
+            const std::string symbol(&text[start], pos - start);
+            const char prefix = (start > 0) ? text[start - 1] : ' ';
+
+            if (pendingSymbol != 0)
+            {
+                int condition = -1;
+                if (!symbols.empty()) condition = ((symbols.count(symbol) != 0) == (pendingSymbol > 0)) ? 1 : 0;
+
+                addCondition(condition);
+                pendingSymbol = 0;
+            }
+            else if (prefix == '!' || afterElse)
+            {
+                // Pseudo opcode; after 'else' it comes without the exclamation mark
+
+                if (symbol == "ifdef" || symbol == "ifndef")
+                {
+                    pendingSymbol = (symbol == "ifdef") ? 1 : -1;
+                }
+                else if (symbol == "if")
+                {
+                    addCondition(-1);
+                }
+            }
+            else if (prefix == '.' || prefix == '@')
+            {
+                // Local label
+            }
+            else if (symbol == "else")
+            {
+                afterElse        = true;
+                pendingCondition = negate(lastChain);
+                pendingChain     = 1;
+            }
+            else
+            {
+                (blocks.back().active ? active : inactive).insert(symbol);
+            }
+        }
+        else
+        {
+            pos++;
+        }
+    }
+}
+
+void dropUnreferencedRoutines()
+{
+    if (CMD_exportRoot.empty()) return;
+
+    // Assembled symbols tell which conditional code is enabled; without them all the code counts
+
+    std::map<std::string, uint16_t> symbols;
+    if (!readSymbolCache(symbols)) std::cout << "no assembled symbol list, conditional code not evaluated\n";
+
+    // Find the owner of each label
+
+    std::map<std::string, SourceFile *> labelMap;
+    std::set<SourceFile *>              roots;
+
+    for (auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        std::set<std::string> labels;
+        if (scanDefinitions(sourceFile, labels) || !sourceFile.floating) roots.insert(&sourceFile);
+
+        for (const auto &label : labels) labelMap.emplace(label, &sourceFile);
+    }
+
+    // Routines used by other segments, or by files without code (only definitions) are roots too
+
+    std::set<std::string> rootLabels;
+    collectExportedLabels(CMD_exportRoot, rootLabels);
+
+    std::set<std::string> unusedLabels;
+    for (const auto &sourceFile : GLOBAL_sourceFiles_noCode) scanReferences(sourceFile, symbols, rootLabels, unusedLabels);
+
+    for (const auto &label : rootLabels)
+    {
+        if (labelMap.count(label) != 0) roots.insert(labelMap[label]);
+    }
+
+    // Build the reference graph
+
+    std::map<SourceFile *, std::set<SourceFile *>> references;       // routine -> routines it uses
+    std::map<SourceFile *, std::set<SourceFile *>> referencedBy;     // routine -> routines using it
+    std::set<SourceFile *>                         inactiveReferences;
+
+    for (auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        std::set<std::string> active, inactive;
+        scanReferences(sourceFile, symbols, active, inactive);
+
+        for (const auto &symbol : active)
+        {
+            auto iter = labelMap.find(symbol);
+            if (iter == labelMap.end() || iter->second == &sourceFile) continue;
+
+            references[&sourceFile].insert(iter->second);
+            referencedBy[iter->second].insert(&sourceFile);
+        }
+
+        for (const auto &symbol : inactive)
+        {
+            auto iter = labelMap.find(symbol);
+            if (iter != labelMap.end() && iter->second != &sourceFile) inactiveReferences.insert(iter->second);
+        }
+    }
+
+    // Mark everything reachable from the roots
+
+    std::set<SourceFile *>    reachable(roots.begin(), roots.end());
+    std::vector<SourceFile *> toVisit(roots.begin(), roots.end());
+
+    while (!toVisit.empty())
+    {
+        SourceFile *routine = toVisit.back();
+        toVisit.pop_back();
+
+        for (auto used : references[routine])
+        {
+            if (reachable.insert(used).second) toVisit.push_back(used);
+        }
+    }
+
+    // Drop the rest, report why
+
+    size_t numDropped  = 0;
+    size_t sizeDropped = 0;
+
+    for (auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        if (reachable.count(&sourceFile) != 0) continue;
+
+        std::cout << "dropping unreferenced routine '" << sourceFile.fileName << "', " << sourceFile.codeLength << " bytes: ";
+        if (!referencedBy[&sourceFile].empty())
+        {
+            std::cout << "only used by dropped routines:";
+            for (const auto user : referencedBy[&sourceFile]) std::cout << " '" << user->fileName << "'";
+        }
+        else if (inactiveReferences.count(&sourceFile) != 0)
+        {
+            std::cout << "only used by code disabled in the configuration";
+        }
+        else
+        {
+            std::cout << "not used at all";
+        }
+        std::cout << "\n";
+
+        numDropped++;
+        sizeDropped += sourceFile.codeLength;
+    }
+
+    GLOBAL_sourceFiles.remove_if([&reachable](SourceFile &sourceFile) -> bool { return reachable.count(&sourceFile) == 0; });
+    GLOBAL_totalRoutinesSize -= sizeDropped;
+
+    std::cout << "dropped " << numDropped << " unreferenced routines, " << sizeDropped << " bytes freed\n";
+}
+
+std::string normalizeRoutine(const SourceFile &sourceFile, const std::set<std::string> &ownLabels,
+                             std::vector<std::string> &labelOrder)
+{
+    // Strip comments and formatting, replace own labels with their numbers (in order of appearance) -
+    // routines giving the same result assemble to the same bytes, wherever they get placed
+
+    std::string result;
+    std::map<std::string, size_t> labelNumbers;
+
+    auto isSymbolStart = [](char c) -> bool { return isalpha(c) || c == '_'; };
+    auto isSymbolChar  = [](char c) -> bool { return isalnum(c) || c == '_'; };
+
+    const std::vector<char> &text = sourceFile.content;
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        const char c = text[pos];
+
+        if (c == ';')
+        {
+            while (pos < text.size() && text[pos] != '\n') pos++;
+        }
+        else if (c == '\n' || c == '\r')
+        {
+            if (!result.empty() && result.back() == ' ') result.pop_back();
+            if (!result.empty() && result.back() != '\n') result += '\n';
+            pos++;
+        }
+        else if (isspace(c))
+        {
+            if (!result.empty() && result.back() != '\n' && result.back() != ' ') result += ' ';
+            pos++;
+        }
+        else if (c == '"' || c == '\'')
+        {
+            const size_t start = pos;
+            for (pos++; pos < text.size() && text[pos] != c && text[pos] != '\n'; pos++)
+            {
+                if (text[pos] == '\\') pos++;
+            }
+            pos = std::min(pos + 1, text.size());
+            result.append(&text[start], pos - start);
+        }
+        else if (isSymbolStart(c) && (pos == 0 || !isSymbolChar(text[pos - 1])))
+        {
+            const size_t start = pos;
+            while (pos < text.size() && isSymbolChar(text[pos])) pos++;
+
+            const std::string symbol(&text[start], pos - start);
+            const char prefix = (start > 0) ? text[start - 1] : ' ';
+
+            if (prefix != '.' && prefix != '@' && prefix != '!' && ownLabels.count(symbol) != 0)
+            {
+                if (labelNumbers.count(symbol) == 0)
+                {
+                    labelNumbers[symbol] = labelOrder.size();
+                    labelOrder.push_back(symbol);
+                }
+
+                result += "\x01" + std::to_string(labelNumbers[symbol]);
+            }
+            else
+            {
+                result += symbol;
+            }
+        }
+        else
+        {
+            result += c;
+            pos++;
+        }
+    }
+
+    return result;
+}
+
+void writeRoutineFingerprints(std::map<const SourceFile *, uint64_t> &fingerprints)
+{
+    // Routines identical to the ones from other segments are reported once all the segments
+    // are built; file is prepared under a temporary name and then renamed, so that segments
+    // built in parallel never leave an incomplete one
+
+    const std::string cacheFileNamePath = getCacheFileNamePath(".fingerprints");
+    const std::string tmpFileNamePath   = cacheFileNamePath + ".tmp" + std::to_string(getpid());
+
+    std::ofstream cacheFile = createCacheFile(tmpFileNamePath);
+    if (!cacheFile.good()) return;
+
+    for (const auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        if (fingerprints.count(&sourceFile) == 0) continue;
+
+        cacheFile << toHexString(fingerprints[&sourceFile]) << " " << sourceFile.codeLength << " " <<
+                     sourceFile.fileName << "\n";
+    }
+
+    cacheFile.close();
+    if (!cacheFile.good() || rename(tmpFileNamePath.c_str(), cacheFileNamePath.c_str()) != 0)
+    {
+        unlink(tmpFileNamePath.c_str());
+    }
+}
+
+void foldIdenticalRoutines()
+{
+    // Floating routines which only define labels can be folded if identical to another one -
+    // only the first of them gets placed, labels of the others become aliases
+
+    typedef struct Candidate {
+        SourceFile              *routine;
+        std::vector<std::string> labelOrder;
+    } Candidate;
+
+    std::map<std::string, std::vector<Candidate>> candidates; // by normalized content
+    std::map<const SourceFile *, uint64_t>        fingerprints;
+
+    for (auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        std::set<std::string> labels;
+        if (scanDefinitions(sourceFile, labels)) continue;
+
+        Candidate candidate = { &sourceFile, {} };
+        const std::string normalized = normalizeRoutine(sourceFile, labels, candidate.labelOrder);
+
+        // Code depending on the segment assembles differently elsewhere, do not fingerprint it
+
+        if (normalized.find("SEGMENT_") == std::string::npos)
+        {
+            fingerprints[&sourceFile] = calcHash(normalized.data(), normalized.size());
+        }
+
+        if (!sourceFile.floating || sourceFile.hasPlacementConstraints() || sourceFile.numPageSpans != 0) continue;
+        candidates[normalized].push_back(candidate);
+    }
+
+    std::set<const SourceFile *> folded;
+    size_t sizeFolded = 0;
+
+    for (const auto &entry : candidates)
+    {
+        const Candidate &kept = entry.second.front();
+
+        for (size_t idx = 1; idx < entry.second.size(); idx++)
+        {
+            const Candidate &current = entry.second[idx];
+
+            if (current.routine->high       != kept.routine->high ||
+                current.routine->codeLength != kept.routine->codeLength) continue;
+
+            FoldedRoutine foldedRoutine = { current.routine->fileName, kept.routine, {} };
+            for (size_t labelIdx = 0; labelIdx < current.labelOrder.size(); labelIdx++)
+            {
+                foldedRoutine.aliases.emplace_back(current.labelOrder[labelIdx], kept.labelOrder[labelIdx]);
+            }
+
+            std::cout << "folding routine '" << current.routine->fileName << "' into identical '" <<
+                         kept.routine->fileName << "', " << current.routine->codeLength << " bytes\n";
+
+            GLOBAL_foldedRoutines.push_back(foldedRoutine);
+            folded.insert(current.routine);
+            sizeFolded += current.routine->codeLength;
+        }
+    }
+
+    writeRoutineFingerprints(fingerprints);
+
+    GLOBAL_sourceFiles.remove_if([&folded](const SourceFile &sourceFile) { return folded.count(&sourceFile) != 0; });
+    GLOBAL_totalRoutinesSize -= sizeFolded;
+}
+
+std::string findJumpTarget(const SourceFile &sourceFile)
+{
+    // If the routine is just a 'jmp <label>' (like the KERNAL jump table entries), returns the label
+
+    if (sourceFile.codeLength != 3) return "";
+
+    std::istringstream stream(std::string(sourceFile.content.begin(), sourceFile.content.end()));
+    std::string line;
+    while (std::getline(stream, line))
+    {
+        std::istringstream lineStream(line.substr(0, line.find(';')));
+        std::string mnemonic, target;
+
+        if (!(lineStream >> mnemonic)) continue;
+        if (mnemonic != "jmp" || !(lineStream >> target) || target[0] == '(') return "";
+
+        return target;
+    }
+
+    return "";
+}
+
+void applyProfile()
+{
+    if (CMD_profile.empty()) return;
+
+    std::ifstream profileFile(CMD_profile);
+    if (!profileFile.good()) ERROR(std::string("can't open profile file '") + CMD_profile + "'");
+
+    // Accepted line formats are '<count> <label or $address>', and the program trace one,
+    // '$<address> called from ...', as produced by the 'collect_data' tool
+
+    std::map<std::string, uint64_t> entries;
+
+    std::string line;
+    while (std::getline(profileFile, line))
+    {
+        std::istringstream stream(line.substr(0, line.find(';')));
+        std::string token1, token2;
+
+        if (!(stream >> token1)) continue;
+
+        if (token1[0] == '$')
+        {
+            entries[token1]++;
+        }
+        else if (isdigit(token1[0]) && (stream >> token2))
+        {
+            entries[token2] += std::stoull(token1);
+        }
+    }
+
+    // Map labels and addresses to the routines; only fixed location routines can be given by address,
+    // as floating ones might be placed differently than in the build the profile was taken from
+
+    std::map<std::string, SourceFile *> labelMap;
+    std::map<int, SourceFile *>         addrMap;
+
+    for (auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        std::set<std::string> labels;
+        scanDefinitions(sourceFile, labels);
+        for (const auto &label : labels) labelMap.emplace(label, &sourceFile);
+
+        if (!sourceFile.floating) addrMap[sourceFile.startAddr] = &sourceFile;
+    }
+
+    auto findByAddress = [&addrMap](int address) -> SourceFile *
+    {
+        auto iter = addrMap.upper_bound(address);
+        if (iter == addrMap.begin()) return nullptr;
+        iter--;
+
+        return (address < iter->first + iter->second->codeLength) ? iter->second : nullptr;
+    };
+
+    // Assign the hotness; calls to jump table entries are attributed to the routines they jump to
+
+    size_t numUnresolved = 0;
+    for (const auto &entry : entries)
+    {
+        SourceFile *routine = nullptr;
+        if (entry.first[0] == '$')
+        {
+            routine = findByAddress(strtol(entry.first.c_str() + 1, nullptr, 16));
+        }
+        else if (labelMap.count(entry.first) != 0)
+        {
+            routine = labelMap[entry.first];
+        }
+
+        for (int hop = 0; routine != nullptr && hop < 4; hop++)
+        {
+            const std::string target = findJumpTarget(*routine);
+            if (target.empty() || labelMap.count(target) == 0) break;
+
+            routine = labelMap[target];
+        }
+
+        if (routine == nullptr)
+        {
+            numUnresolved++;
+            continue;
+        }
+
+        routine->hotness += entry.second;
+    }
+
+    // Report the hot routines
+
+    size_t numHot = 0;
+    for (const auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        if (sourceFile.hotness == 0) continue;
+
+        numHot++;
+        std::cout << "profile: '" << sourceFile.fileName << "' called " << sourceFile.hotness << " times";
+        if (sourceFile.codeLength > 0x100) std::cout << ", too large to fit in a single page";
+        std::cout << "\n";
+
+        // Code in the banked segments can only be called through the remapping code
+
+        if (CMD_segName.size() > 2 && CMD_segName.compare(CMD_segName.size() - 2, 2, "_1") == 0)
+        {
+            std::cout << "warning: hot routine '" << sourceFile.fileName << "' resides in a banked segment\n";
+        }
+    }
+
+    std::cout << "profile: " << numHot << " hot routines, " << numUnresolved << " entries not resolved within this segment\n";
+}
+
+void writeProblemDump()
+{
+    // Binning problem in a form which can be replayed without the sources, see 'bench_binning' tool
+
+    const std::string cacheFileNamePath = getCacheFileNamePath(".binning");
+    std::ofstream cacheFile = createCacheFile(cacheFileNamePath);
+    if (!cacheFile.good()) return;
+
+    std::list<const Routine *> routines;
+    for (const auto &sourceFile : GLOBAL_sourceFiles) routines.push_back(&sourceFile);
+
+    writeProblemDump(cacheFile, routines, CMD_loAddress, CMD_hiAddress);
+
+    if (!cacheFile.good()) unlink(cacheFileNamePath.c_str());
+}
+
+void prepareBinningProblem()
+{
+    // Prepare the log file
+
+    const std::string logFileNamePath = CMD_outDir + DIR_SEPARATOR + CMD_segName + "_binproblem.log";
+    unlink(logFileNamePath.c_str());
+    std::ofstream dbgOutput(logFileNamePath, std::fstream::out | std::fstream::trunc);
+    DualStream    logOutput(dbgOutput, std::cout);
+
+    // Print out code length information
+
+    for (const auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        std::string spacing;
+        spacing.resize(GLOBAL_maxFileNameLen + 4 - sourceFile.fileName.length(), ' ');
+        std::string floating_high;
+
+        if (sourceFile.high)
+        {
+            floating_high = "(floating, high)  ";
+        }
+        else if (sourceFile.floating)
+        {
+            floating_high = "(floating)        ";
+        }
+        else
+        {
+            floating_high = "                  ";
+        }
+
+        dbgOutput << "file:    " << floating_high << sourceFile.fileName << spacing << "size: " << std::to_string(sourceFile.codeLength) << "\n";
+    }
+
+    // Create the binning problem
+
+    GLOBAL_binningProblem = BinningProblem(CMD_loAddress, CMD_hiAddress);
+
+    for (auto &sourceFile : GLOBAL_sourceFiles)
+    {
+        GLOBAL_binningProblem.addToProblem(&sourceFile);
+    }
+
+    // Print out some more statistics
+
+    logOutput << "\n" <<
+                 "free space (after floating routines are placed):    " <<
+                 std::to_string(CMD_hiAddress - CMD_loAddress + 1 - GLOBAL_totalRoutinesSize) << "\n" <<
+                 "number of floating routines:                        " <<
+                 std::to_string(GLOBAL_binningProblem.floatingRoutines.size()) << "\n" <<
+                 "number of gaps for the floating routines:           " <<
+                 std::to_string(GLOBAL_binningProblem.gaps.size()) << "\n" <<
+                 "\n";
+
+    writeProblemDump();
+
+    // Print out the available gaps
+
+    for (auto& gap : GLOBAL_binningProblem.gaps)
+    {
+        dbgOutput << "gap address: $" << std::uppercase << std::hex << gap.first <<
+                     "    size: " << std::to_string(gap.second) << "\n";
+    }
+
+    dbgOutput << "\n";
+
+    // Close the log file
+
+    if (!dbgOutput.good()) ERROR(std::string("error writing log file '") + logFileNamePath + "'");
+    dbgOutput.close();
+}
+
+void solveBinningProblem()
+{
+    // If requested, try to keep the routines where they were during the previous build, so that small
+    // changes do not move everything around - this makes the result depend on the build history
+
+    const bool useLayoutHint = CMD_stable && readLayoutCache(GLOBAL_previousLayout);
+    if (!useLayoutHint) GLOBAL_previousLayout.clear();
+
+    GLOBAL_initialGaps = GLOBAL_binningProblem.gaps;
+
+    // Do some routine actions on the binning problem object
+
+    Solver solver(GLOBAL_binningProblem, CMD_packerMs, useLayoutHint ? &GLOBAL_previousLayout : nullptr);
+    solver.run(CMD_outDir + DIR_SEPARATOR + CMD_segName + "_binsolution.log");
+
+    if (!GLOBAL_binningProblem.isSolved())
+    {
+        ERROR("unable to solve the routine binning problem");
+    }
+
+    writeLayoutCache();
+
+    std::cout << "\n";
+}
+
+void compileSegment()
+{
+    // First combine everything into one assembler file
+
+    const std::string outFileNameBare = CMD_segName + "_combined.s";
+    const std::string vlfFileNamePath = CMD_segName + "_combined.vs";
+    const std::string symFileNamePath = CMD_segName + "_combined.sym";
+    const std::string filePath        = CMD_outDir + DIR_SEPARATOR;
+    const std::string outFileNamePath = filePath + outFileNameBare;
+    unlink(outFileNamePath.c_str());
+    unlink(vlfFileNamePath.c_str());
+    unlink(symFileNamePath.c_str());
+    std::ofstream outFile(outFileNamePath, std::fstream::out | std::fstream::trunc);
+    if (!outFile.good()) ERROR(std::string("can't open temporary file '") + outFileNamePath + "'");
+
+    // Write the header
+
+    outFile << "!set SEGMENT_" << CMD_segName << " = 1\n";
+    outFile << "!set ROM_LAYOUT_" << CMD_romLayout << " = 1\n\n";
+    outFile << "\t* = $" << std::hex << CMD_loAddress << ", INVISIBLE\n";
+    outFile << "\t!fill $" << std::hex << (CMD_hiAddress + 1 - CMD_loAddress) << "\n\n";
+
+    // Write files which only contain definitions (no routines)
+
+    for (const auto &sourceFile : GLOBAL_sourceFiles_noCode)
+    {
+        outFile << "\n\n\n\n";
+        outFile << ";--- Source file " << sourceFile.fileName << "\n\n";
+        outFile << "!zone " << toLabel(sourceFile.fileName) << "\n\n";
+        outFile << std::string(sourceFile.content.begin(), sourceFile.content.end());
+        outFile << "\n";
+    }
+
+    // Write remaining files, these should be placed under their proper locations
+
+    for (const auto &routine : GLOBAL_binningProblem.fixedRoutines)
+    {
+        outFile << "\n\n\n\n";
+        outFile << ";--- Source file " << routine.second->fileName << "\n\n";
+        outFile << "!zone " << toLabel(routine.second->fileName) << "\n\n";
+        outFile << "\t* = $" << std::hex << routine.first << "\n\n";
+        const auto &content = static_cast<const SourceFile *>(routine.second)->content;
+        outFile << std::string(content.begin(), content.end());
+        outFile << "\n";
+    }
+
+    // Write the folded routines, as aliases to the labels of the identical ones
+
+    for (const auto &foldedRoutine : GLOBAL_foldedRoutines)
+    {
+        outFile << "\n\n\n\n";
+        outFile << ";--- Source file " << foldedRoutine.fileName << ", folded into " << foldedRoutine.keptRoutine->fileName << "\n\n";
+        for (const auto &alias : foldedRoutine.aliases) outFile << alias.first << " = " << alias.second << "\n";
+    }
+
+    outFile << "\n\n";
+
+    if (!outFile.good()) ERROR(std::string("error writing temporary file '") + outFileNamePath + "'");
+    outFile.close();
+
+    // All written - now launch the assembler, unless the result is already known
+
+    const std::vector<std::string> params = { "--strict-segments", "--color",
+                                              "--outfile",    CMD_outFile,
+                                              "--symbollist", symFileNamePath,
+                                              "--vicelabels", vlfFileNamePath,
+                                              outFileNameBare };
+    const std::vector<std::pair<std::string, std::string>> outFiles = { { "out.bin",      getOutDirPath(CMD_outFile)     },
+                                                                        { "combined.sym", getOutDirPath(symFileNamePath) },
+                                                                        { "combined.vs",  getOutDirPath(vlfFileNamePath) } };
+
+    const std::string cacheKey = CMD_asmCache.empty() ? "" : calcAssemblerCacheKey(outFileNamePath, params);
+    if (!cacheKey.empty() && fetchAssemblerOutput(cacheKey, outFiles))
+    {
+        std::cout << "assembler output taken from the cache, key " << cacheKey << "\n";
+        return;
+    }
+
+    runAssembler(params);
+
+    if (!cacheKey.empty()) storeAssemblerOutput(cacheKey, outFiles);
+}
+
+//
+// Cross-segment calls
+//
+
+std::string decodeVectorSegment(const std::string &symbol, std::string &label)
+{
+    // Routines of the banked out segments are called through vectors like 'VK1__IOINIT' -
+    // 'K' stands for KERNAL, 'B' for BASIC, 'D' for DOS, the rest is the segment suffix
+
+    const auto sepPos = symbol.find("__");
+    if (symbol.length() < 3 || symbol[0] != 'V' || sepPos == std::string::npos || sepPos < 3) return "";
+
+    std::string segName;
+    switch (symbol[1])
+    {
+        case 'K': segName = "KERNAL_"; break;
+        case 'B': segName = "BASIC_";  break;
+        case 'D': segName = "DOS_";    break;
+        default: return "";
+    }
+
+    label = symbol.substr(sepPos + 2);
+    return label.empty() ? "" : segName + symbol.substr(2, sepPos - 2);
+}
+
+void reportCrossSegmentCalls()
+{
+    // Each call to a banked out segment (through a vector) or back (through a proxy routine)
+    // costs a memory remap there and back again; estimate the number of remaps for each target
+
+    typedef struct CallTarget {
+        std::string                segName;
+        std::string                label;
+        bool                       viaProxy;
+        std::map<std::string, int> callSites; // number of call sites by calling routine
+        uint64_t                   remaps;
+        uint64_t                   hotRemaps; // the ones from the routines found in the profile
+    } CallTarget;
+
+    std::map<std::string, CallTarget> targets; // by '<segment>.<label>'
+
+    // Find aliases of the proxy routines, like '#ALIAS# JCHROUT = BASIC_0.proxy_B1_JCHROUT'
+
+    std::map<std::string, std::pair<std::string, std::string>> proxyAliases;
+
+    for (const auto sourceFiles : { &GLOBAL_sourceFiles, &GLOBAL_sourceFiles_noCode })
+    {
+        for (const auto &sourceFile : *sourceFiles)
+        {
+            std::istringstream stream(std::string(sourceFile.content.begin(), sourceFile.content.end()));
+            std::string line;
+            while (std::getline(stream, line))
+            {
+                const auto pos = line.find("#ALIAS#");
+                if (pos == std::string::npos) continue;
+
+                std::istringstream lineStream(line.substr(pos + 7));
+                std::string symbol, assignment, target;
+                if (!(lineStream >> symbol >> assignment >> target) || assignment != "=") continue;
+
+                const auto dotPos = target.rfind('.');
+                if (dotPos == std::string::npos || target.compare(dotPos + 1, 6, "proxy_") != 0) continue;
+
+                proxyAliases[symbol] = std::make_pair(target.substr(0, dotPos), target.substr(dotPos + 1));
+            }
+        }
+    }
+
+    // Collect the call sites, skipping code disabled in the configuration
+
+    std::map<std::string, uint16_t> symbols;
+    readSymbolCache(symbols);
+
+    auto isSymbolChar = [](char c) -> bool { return isalnum(c) || c == '_'; };
+
+    for (const auto &routine : GLOBAL_sourceFiles)
+    {
+        std::set<std::string> active, inactive;
+        scanReferences(routine, symbols, active, inactive);
+
+        std::istringstream stream(std::string(routine.content.begin(), routine.content.end()));
+        std::string line;
+        while (std::getline(stream, line))
+        {
+            line = line.substr(0, line.find(';'));
+
+            for (size_t pos = 0; pos + 3 < line.length(); pos++)
+            {
+                if (line.compare(pos, 3, "jsr") != 0 && line.compare(pos, 3, "jmp") != 0) continue;
+                if ((pos > 0 && isSymbolChar(line[pos - 1])) || !isspace(line[pos + 3])) continue;
+
+                size_t start = pos + 3;
+                while (start < line.length() && (isspace(line[start]) || line[start] == '(')) start++;
+                size_t end = start;
+                while (end < line.length() && isSymbolChar(line[end])) end++;
+
+                const std::string symbol = line.substr(start, end - start);
+                if (symbol.empty() || active.count(symbol) == 0) continue;
+
+                CallTarget target;
+                target.segName  = decodeVectorSegment(symbol, target.label);
+                target.viaProxy = target.segName.empty();
+                target.remaps   = 0;
+                target.hotRemaps = 0;
+
+                if (target.viaProxy)
+                {
+                    const auto iter = proxyAliases.find(symbol);
+                    if (iter == proxyAliases.end()) continue;
+
+                    target.segName = iter->second.first;
+                    target.label   = iter->second.second;
+                }
+
+                if (target.segName == CMD_segName) continue;
+
+                // Without the profile, assume every call site is executed once
+
+                auto &entry = targets.emplace(target.segName + "." + target.label, target).first->second;
+                entry.callSites[routine.fileName]++;
+                entry.remaps    += 2 * std::max(routine.hotness, (uint64_t) 1);
+                entry.hotRemaps += 2 * routine.hotness;
+            }
+        }
+    }
+
+    const std::string reportFileNamePath = CMD_outDir + DIR_SEPARATOR + CMD_segName + "_crosscalls.txt";
+    unlink(reportFileNamePath.c_str());
+
+    if (targets.empty()) return;
+
+    std::vector<const CallTarget *> sortedTargets;
+    for (const auto &entry : targets) sortedTargets.push_back(&entry.second);
+    std::stable_sort(sortedTargets.begin(), sortedTargets.end(),
+                     [](const CallTarget *a, const CallTarget *b) -> bool { return a->remaps > b->remaps; });
+
+    std::ofstream reportFile(reportFileNamePath, std::fstream::out | std::fstream::trunc);
+    if (!reportFile.good()) ERROR(std::string("can't open report file '") + reportFileNamePath + "'");
+
+    reportFile << "Cross-segment calls from segment " << CMD_segName << ", 2 remaps per call, " <<
+                  (CMD_profile.empty() ? "each call site executed once" : "call sites executed as often as the caller") << "\n\n";
+    reportFile << "  remaps  sites  target\n\n";
+
+    uint64_t totalRemaps    = 0;
+    size_t   totalCallSites = 0;
+
+    for (const auto target : sortedTargets)
+    {
+        size_t callSites = 0;
+        std::string callers;
+        for (const auto &caller : target->callSites)
+        {
+            callSites += caller.second;
+            callers   += (callers.empty() ? "" : ", ") + caller.first + " (" + std::to_string(caller.second) + ")";
+        }
+
+        reportFile << std::setw(8) << target->remaps << std::setw(7) << callSites << "  " <<
+                      target->segName << "." << target->label << (target->viaProxy ? " (proxy)" : "") << "\n";
+        reportFile << std::string(17, ' ') << "called from " << callers << "\n";
+
+        totalRemaps    += target->remaps;
+        totalCallSites += callSites;
+    }
+
+    std::cout << "cross-segment calls: " << targets.size() << " targets, " << totalCallSites << " call sites, " <<
+                 totalRemaps << " remaps estimated, see '" << reportFileNamePath << "'\n";
+
+    // Suggest moving the hot targets reached through vectors into this segment, if they fit into the gaps
+    // left; their location is only known if the other segment was already built into the same directory
+
+    std::multiset<int> freeGaps;
+    for (const auto &gap : GLOBAL_binningProblem.gaps) freeGaps.insert(gap.second);
+
+    std::map<std::string, std::pair<uint64_t, int>> candidates; // remaps and size, by '<segment>.<file name>'
+    std::vector<std::string>                        candidatesOrder;
+
+    for (const auto target : sortedTargets)
+    {
+        if (target->viaProxy || target->hotRemaps == 0) continue;
+
+        RoutineLayout layout;
+        const SymbolIndex *symbolIndex = getSymbolIndex(CMD_outDir + DIR_SEPARATOR + target->segName + "_combined.sym");
+        if (symbolIndex == nullptr || !readLayoutCache(layout, target->segName)) continue;
+
+        const auto iterSymbol = symbolIndex->find(target->label);
+        if (iterSymbol == symbolIndex->end()) continue;
+
+        for (const auto &routine : layout)
+        {
+            if (iterSymbol->second < routine.second.first ||
+                iterSymbol->second >= routine.second.first + routine.second.second) continue;
+
+            const std::string key = target->segName + "." + routine.first;
+            if (candidates.count(key) == 0) candidatesOrder.push_back(key);
+
+            candidates[key].first  += target->hotRemaps;
+            candidates[key].second  = routine.second.second;
+            break;
+        }
+    }
+
+    reportFile << "\n";
+    for (const auto &key : candidatesOrder)
+    {
+        const int size = candidates[key].second;
+
+        const auto iterGap = freeGaps.lower_bound(size);
+        if (iterGap == freeGaps.end()) continue;
+
+        const int gapLeft = *iterGap - size;
+        freeGaps.erase(iterGap);
+        freeGaps.insert(gapLeft);
+
+        const std::string suggestion = "suggestion: take routine '" + key.substr(key.find('.') + 1) + "' (" +
+                                       std::to_string(size) + " bytes) from segment " + key.substr(0, key.find('.')) +
+                                       " into " + CMD_segName + " and call it directly, saves " +
+                                       std::to_string(candidates[key].first) + " remaps";
+
+        reportFile << suggestion << "\n";
+        std::cout  << suggestion << "\n";
+    }
+
+    if (!reportFile.good()) ERROR(std::string("error writing report file '") + reportFileNamePath + "'");
+}
+
+//
+// Layout artefact
+//
+
+std::string getPlacementReason(int address, const Routine &routine)
+{
+    // Reconstructed from the final layout - the solver tries several placements on problem copies
+
+    if (!routine.floating)                                   return "fixed";
+    if (routine.high && !routine.hasPlacementConstraints()) return "high";
+    if (routine.hasPlacementConstraints())                  return "constraints";
+
+    const auto iter = GLOBAL_previousLayout.find(routine.fileName);
+    if (iter != GLOBAL_previousLayout.end() && iter->second == std::make_pair(address, routine.codeLength)) return "previous";
+
+    if (routine.prefersSinglePage() && address / 0x100 == (address + routine.codeLength - 1) / 0x100) return "hot";
+
+    return "packed";
+}
+
+void writeLayoutArtefact()
+{
+    finishPhase("reports");
+
+    const std::string outFileNamePath = CMD_outDir + DIR_SEPARATOR + CMD_segName + "_layout.json";
+    std::ofstream outFile(outFileNamePath, std::fstream::out | std::fstream::trunc);
+    if (!outFile.good()) ERROR(std::string("can't open layout file '") + outFileNamePath + "'");
+
+    const auto &problem = GLOBAL_binningProblem;
+
+    outFile << "{\n";
+    outFile << "  \"segment\": "    << toJsonString(CMD_segName)   << ",\n";
+    outFile << "  \"info\": "       << toJsonString(CMD_segInfo)   << ",\n";
+    outFile << "  \"romLayout\": "  << toJsonString(CMD_romLayout) << ",\n";
+    outFile << "  \"loAddress\": "  << CMD_loAddress << ",\n";
+    outFile << "  \"hiAddress\": "  << CMD_hiAddress << ",\n";
+    outFile << "  \"routinesSize\": " << GLOBAL_totalRoutinesSize << ",\n";
+    outFile << "  \"wasted\": "     << problem.statWasted << ",\n";
+    outFile << "  \"free\": "       << problem.statFree - problem.statWasted << ",\n";
+
+    // Wall-clock time of each build phase, in milliseconds
+
+    outFile << "  \"timings\": {";
+    for (size_t idx = 0; idx < GLOBAL_phaseTimes.size(); idx++)
+    {
+        outFile << (idx ? ", " : " ") << toJsonString(GLOBAL_phaseTimes[idx].first) << ": " <<
+                   std::fixed << std::setprecision(3) << GLOBAL_phaseTimes[idx].second;
+    }
+    outFile << " },\n";
+
+    // Routines, by address
+
+    outFile << "  \"routines\": [";
+    bool first = true;
+    for (const auto &entry : problem.fixedRoutines)
+    {
+        const int         address = entry.first;
+        const Routine    &routine = *entry.second;
+
+        std::string gap = "null";
+        if (routine.floating)
+        {
+            // Free area (before the floating routines were placed) the routine landed in
+
+            auto iterGap = GLOBAL_initialGaps.upper_bound(address);
+            if (iterGap != GLOBAL_initialGaps.begin())
+            {
+                iterGap--;
+                gap = "{ \"address\": " + std::to_string(iterGap->first) + ", \"size\": " + std::to_string(iterGap->second) + " }";
+            }
+        }
+
+        const int pageCrossings = (routine.codeLength == 0) ? 0 : (address + routine.codeLength - 1) / 0x100 - address / 0x100;
+
+        outFile << (first ? "\n" : ",\n") << "    { " <<
+                   "\"file\": "          << toJsonString(routine.fileName) << ", " <<
+                   "\"address\": "       << address << ", " <<
+                   "\"size\": "          << routine.codeLength << ", " <<
+                   "\"segment\": "       << toJsonString(CMD_segName) << ", " <<
+                   "\"gap\": "           << gap << ", " <<
+                   "\"placement\": "     << toJsonString(getPlacementReason(address, routine)) << ", " <<
+                   "\"pageCrossings\": " << pageCrossings << ", " <<
+                   "\"hotness\": "       << routine.hotness << " }";
+        first = false;
+    }
+    outFile << "\n  ],\n";
+
+    // Routines folded into identical ones
+
+    outFile << "  \"folded\": [";
+    first = true;
+    for (const auto &foldedRoutine : GLOBAL_foldedRoutines)
+    {
+        outFile << (first ? "\n" : ",\n") << "    { \"file\": " << toJsonString(foldedRoutine.fileName) <<
+                   ", \"into\": " << toJsonString(foldedRoutine.keptRoutine->fileName) << " }";
+        first = false;
+    }
+    outFile << (first ? "],\n" : "\n  ],\n");
+
+    // Space left unused
+
+    outFile << "  \"freeAreas\": [";
+    first = true;
+    int freeStart = CMD_loAddress;
+    auto writeFreeArea = [&](int freeEnd)
+    {
+        if (freeEnd <= freeStart) return;
+
+        outFile << (first ? "\n" : ",\n") << "    { \"address\": " << freeStart << ", \"size\": " << freeEnd - freeStart << " }";
+        first = false;
+    };
+    for (const auto &entry : problem.fixedRoutines)
+    {
+        writeFreeArea(entry.first);
+        freeStart = std::max(freeStart, entry.first + entry.second->codeLength);
+    }
+    writeFreeArea(CMD_hiAddress + 1);
+    outFile << (first ? "]\n" : "\n  ]\n");
+
+    outFile << "}\n";
+
+    if (!outFile.good()) ERROR(std::string("error writing layout file '") + outFileNamePath + "'");
+}
+
+//
+// Main function
+//
+
+void buildSegment()
+{
+    printBanner();
+
+    GLOBAL_phaseStart = std::chrono::steady_clock::now();
+
+    readSourceFiles();
+    checkInputFileLabels();
+    finishPhase("preprocess");
+    calcRoutineSizes();
+    finishPhase("sizing");
+    dropUnreferencedRoutines();
+    foldIdenticalRoutines();
+    applyProfile();
+    finishPhase("analysis");
+
+    prepareBinningProblem();
+    solveBinningProblem();
+    finishPhase("solve");
+    compileSegment();
+    finishPhase("assembly");
+    reportCrossSegmentCalls();
+    writeLayoutArtefact();
+}
+
+void readManifest()
+{
+    std::ifstream manifestFile(CMD_manifest);
+    if (!manifestFile.good()) ERROR(std::string("unable to read manifest '") + CMD_manifest + "'");
+
+    std::string line;
+    while (std::getline(manifestFile, line))
+    {
+        // Expected line format is '<segment name> <lo> <hi> <out file> <display info> <input dir/file list>',
+        // lines starting with ';' are comments
+
+        std::istringstream stream(line);
+        std::string segName, loStr, hiStr;
+        if (!(stream >> segName) || segName[0] == ';') continue;
+
+        ManifestEntry entry;
+        entry.segName = segName;
+        if (!(stream >> loStr >> hiStr >> entry.outFile >> entry.segInfo))
+        {
+            ERROR(std::string("syntax error in manifest, segment '") + segName + "'");
+        }
+
+        entry.loAddress = strtol(loStr.c_str(), nullptr, 16);
+        entry.hiAddress = strtol(hiStr.c_str(), nullptr, 16);
+
+        // Inputs given on the command line are common for all the segments
+
+        entry.inList = CMD_inList;
+        for (std::string objName; stream >> objName; ) entry.inList.push_back(objName);
+        if (entry.inList.empty()) ERROR(std::string("empty directory/file list for segment '") + segName + "'");
+
+        for (const auto &other : GLOBAL_manifest)
+        {
+            if (other.segName == segName) ERROR(std::string("segment '") + segName + "' listed twice in manifest");
+        }
+
+        GLOBAL_manifest.push_back(entry);
+    }
+
+    if (GLOBAL_manifest.empty()) ERROR("no segments in manifest");
+}
+
+void findManifestDependencies()
+{
+    // Read all the source files once, before splitting into separate processes;
+    // a segment depends on another one if it imports its symbol file
+
+    for (auto &entry : GLOBAL_manifest)
+    {
+        std::set<std::string> imports;
+        for (const auto &inputFile : collectInputFiles(entry.inList))
+        {
+            SourceFile::listImports(getSourceText(inputFile.second + DIR_SEPARATOR + inputFile.first), entry.segName, imports);
+        }
+
+        entry.dependencies.clear();
+        for (size_t idx = 0; idx < GLOBAL_manifest.size(); idx++)
+        {
+            if (GLOBAL_manifest[idx].segName == entry.segName) continue;
+            if (imports.count(GLOBAL_manifest[idx].segName + "_combined.sym") == 0) continue;
+
+            entry.dependencies.insert(idx);
+        }
+    }
+}
+
+std::string getSegmentFileNamePath(const ManifestEntry &entry, const std::string &suffix)
+{
+    return CMD_outDir + DIR_SEPARATOR + entry.segName + suffix;
+}
+
+pid_t startSegmentBuild(const ManifestEntry &entry, int numJobs)
+{
+    // Each segment is built by a separate process - it inherits the already read source
+    // files, and keeps its own copy of the global state; nothing is passed back, routine
+    // sizes survive between the server rebuilds only through the per-routine size cache
+
+    std::cout << std::flush;
+
+    pid_t pid = fork();
+    if (pid < 0) ERROR("unable to start building segment");
+    if (pid == 0)
+    {
+        const std::string logFileNamePath = getSegmentFileNamePath(entry, "_build.log");
+
+        int fd = open(logFileNamePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0) _exit(127);
+        close(fd);
+
+        // Remove the previous results, so that nothing outdated remains if the build fails
+
+        unlink((CMD_outDir + DIR_SEPARATOR + entry.outFile).c_str());
+        unlink(getSegmentFileNamePath(entry, "_combined.s").c_str());
+        unlink(getSegmentFileNamePath(entry, "_combined.sym").c_str());
+        unlink(getSegmentFileNamePath(entry, "_combined.vs").c_str());
+
+        CMD_segName   = entry.segName;
+        CMD_segInfo   = entry.segInfo;
+        CMD_outFile   = entry.outFile;
+        CMD_loAddress = entry.loAddress;
+        CMD_hiAddress = entry.hiAddress;
+        CMD_inList    = entry.inList;
+        CMD_jobs      = numJobs;
+
+        buildSegment();
+
+        std::cout << std::flush;
+        exit(0);
+    }
+
+    return pid;
+}
+
+void reportIdenticalRoutines(std::ostream &output)
+{
+    // Report routines identical to the ones from other segments of the manifest; these can't be
+    // folded automatically, as the other segment might be banked out - hint for the developer only
+
+    typedef struct Fingerprint {
+        std::string segName;
+        std::string fileName;
+        int         codeLength;
+    } Fingerprint;
+
+    std::map<uint64_t, std::vector<Fingerprint>> routines; // by fingerprint
+
+    for (const auto &entry : GLOBAL_manifest)
+    {
+        // Failed segment might have left outdated fingerprints
+
+        if (entry.failed) continue;
+
+        std::ifstream cacheFile(getCacheFileNamePath(".fingerprints", entry.segName));
+        std::string line;
+        while (std::getline(cacheFile, line))
+        {
+            // Expected line format is '<hash> <code length> <file name>'
+
+            std::istringstream stream(line);
+            std::string hashStr, fileName;
+            int codeLength;
+            if (!(stream >> hashStr >> codeLength) || !std::getline(stream >> std::ws, fileName)) continue;
+
+            routines[strtoull(hashStr.c_str(), nullptr, 16)].push_back({ entry.segName, fileName, codeLength });
+        }
+    }
+
+    bool first = true;
+    for (const auto &routine : routines)
+    {
+        const auto &copies = routine.second;
+
+        std::set<std::string> segNames;
+        for (const auto &copy : copies) segNames.insert(copy.segName);
+        if (segNames.size() < 2) continue;
+
+        if (first) output << "\n";
+        first = false;
+
+        output << "routine '" << copies[0].fileName << "' (" << copies[0].codeLength << " bytes) from segment '" <<
+                  copies[0].segName << "' is identical to";
+        std::string separator = " ";
+        for (size_t idx = 1; idx < copies.size(); idx++)
+        {
+            if (copies[idx].segName == copies[0].segName) continue;
+            output << separator << "'" << copies[idx].fileName << "' from segment '" << copies[idx].segName << "'";
+            separator = ", ";
+        }
+        output << "\n";
+    }
+
+    output << std::flush;
+}
+
+std::vector<std::string> buildManifestSegments(const std::set<size_t> &toBuild, std::ostream &output)
+{
+    // Build the selected segments, as many at once as the dependencies allow; if symbols
+    // of a segment change, all the segments importing them have to be rebuilt too
+
+    enum class State { IDLE, PENDING, RUNNING, DONE, FAILED };
+
+    std::vector<State>       states(GLOBAL_manifest.size(), State::IDLE);
+    std::vector<uint64_t>    symbolHashes(GLOBAL_manifest.size(), 0);
+    std::vector<int>         segmentJobs(GLOBAL_manifest.size(), 0);
+    std::map<pid_t, size_t>  running;
+    std::vector<std::string> failed;
+
+    auto markPending = [&](size_t idx)
+    {
+        states[idx]       = State::PENDING;
+        symbolHashes[idx] = calcFileHash(getSegmentFileNamePath(GLOBAL_manifest[idx], "_combined.sym"));
+    };
+
+    for (const auto idx : toBuild) markPending(idx);
+
+    while (true)
+    {
+        // Segments depending on failed ones won't be built at all
+
+        for (bool changed = true; changed; )
+        {
+            changed = false;
+            for (size_t idx = 0; idx < GLOBAL_manifest.size(); idx++)
+            {
+                if (states[idx] != State::PENDING) continue;
+                for (const auto depIdx : GLOBAL_manifest[idx].dependencies)
+                {
+                    if (states[depIdx] != State::FAILED) continue;
+
+                    states[idx] = State::FAILED;
+                    GLOBAL_manifest[idx].failed = true;
+                    failed.push_back(GLOBAL_manifest[idx].segName + " (depends on " + GLOBAL_manifest[depIdx].segName + ")");
+                    changed = true;
+                    break;
+                }
+            }
+        }
+
+        // Start all the segments which have their dependencies ready
+
+        std::vector<size_t> toStart;
+        for (size_t idx = 0; idx < GLOBAL_manifest.size(); idx++)
+        {
+            if (states[idx] != State::PENDING) continue;
+
+            bool ready = true;
+            for (const auto depIdx : GLOBAL_manifest[idx].dependencies)
+            {
+                if (states[depIdx] != State::DONE && states[depIdx] != State::IDLE) ready = false;
+            }
+            if (ready) toStart.push_back(idx);
+        }
+
+        // Segments use parallel jobs too - split whatever the running ones left among the new ones,
+        // so that the total number of jobs stays within the limit
+
+        int freeJobs = getNumJobs();
+        for (const auto &runningSegment : running) freeJobs -= segmentJobs[runningSegment.second];
+
+        for (const auto idx : toStart)
+        {
+            segmentJobs[idx] = std::max(1, freeJobs / int(toStart.size()));
+
+            running[startSegmentBuild(GLOBAL_manifest[idx], segmentJobs[idx])] = idx;
+            states[idx] = State::RUNNING;
+        }
+
+        if (running.empty()) break;
 
-        auto eqPos = line.rfind('=');
+        // Wait for any segment to finish, print its output in one piece
 
-        auto address         = strtol(line.substr(eqPos + 3).c_str(), nullptr , 16);
-        std::string refLabel = line.substr(0, eqPos - 1);
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) ERROR("error waiting for segment build");
 
-        for (auto &sourceFile : GLOBAL_sourceFiles)
-        {
-            if (refLabel.compare(sourceFile.label) != 0) continue;
-            if (startLabel)
-            {
-                sourceFile.testAddrStart = address;
-            }
-            else
-            {
-                sourceFile.testAddrEnd = address;
-            }
-        }
-    }
+        auto iter = running.find(pid);
+        if (iter == running.end()) continue;
 
-    symFile.close();
+        const size_t idx   = iter->second;
+        auto        &entry = GLOBAL_manifest[idx];
+        running.erase(iter);
 
-    // Calculate size of each and every routine
+        std::ifstream logFile(getSegmentFileNamePath(entry, "_build.log"));
+        if (logFile.good()) output << logFile.rdbuf();
+        output << std::flush;
 
-    for (auto &sourceFile : GLOBAL_sourceFiles)
-    {
-        if (sourceFile.testAddrStart <= 0 || sourceFile.testAddrEnd <= 0 ||
-            sourceFile.testAddrStart > sourceFile.testAddrEnd)
+        entry.failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        if (entry.failed)
         {
-            ERROR(std::string("unable to determine code length in '") + sourceFile.fileName + "'");
+            states[idx] = State::FAILED;
+            failed.push_back(entry.segName);
+            continue;
         }
 
-        sourceFile.codeLength = sourceFile.testAddrEnd - sourceFile.testAddrStart;
-        GLOBAL_totalRoutinesSize += sourceFile.codeLength;
+        states[idx] = State::DONE;
+        if (calcFileHash(getSegmentFileNamePath(entry, "_combined.sym")) == symbolHashes[idx]) continue;
+
+        for (size_t depIdx = 0; depIdx < GLOBAL_manifest.size(); depIdx++)
+        {
+            if (GLOBAL_manifest[depIdx].dependencies.count(idx) == 0) continue;
+            if (states[depIdx] == State::IDLE || states[depIdx] == State::DONE) markPending(depIdx);
+        }
     }
 
-    // Check whether total code size is sane
+    // Whatever is still pending has circular dependencies
 
-    if (0 == GLOBAL_totalRoutinesSize) ERROR("total code size is 0");
-    if (signed(GLOBAL_totalRoutinesSize) > CMD_hiAddress - CMD_loAddress)
+    for (size_t idx = 0; idx < GLOBAL_manifest.size(); idx++)
     {
-        ERROR(std::string("total code size is ") + std::to_string(GLOBAL_totalRoutinesSize) + ", too much for this segment!");
+        if (states[idx] != State::PENDING) continue;
+
+        GLOBAL_manifest[idx].failed = true;
+        failed.push_back(GLOBAL_manifest[idx].segName + " (circular dependency)");
     }
 
-    // Sort the file list by code size, starting from the smallest
+    reportIdenticalRoutines(output);
+    return failed;
+}
 
-    auto compare = [](const SourceFile &a, const SourceFile &b) -> bool { return a.codeLength < b.codeLength; };
-    GLOBAL_sourceFiles.sort(compare);
+std::string describeFailures(const std::vector<std::string> &failed)
+{
+    std::string message = "failed to build segments:";
+    for (const auto &segName : failed) message += " " + segName;
+    return message;
+}
 
-    // Move zero-sized element to a separate list
+//
+// Resident build server
+//
 
-    while (GLOBAL_sourceFiles.front().codeLength == 0)
-    {
-        GLOBAL_sourceFiles_noCode.push_back(GLOBAL_sourceFiles.front());
-        GLOBAL_sourceFiles.pop_front();
-    }
+std::string getServerSocketPath()
+{
+    return CMD_outDir + DIR_SEPARATOR + ",segments.socket";
 }
 
-void prepareBinningProblem()
+uint64_t calcServerContext()
 {
-    // Prepare the log file
+    // Server can only handle requests from clients with exactly the same settings
 
-    const std::string logFileNamePath = CMD_outDir + DIR_SEPARATOR + CMD_segName + "_binproblem.log";
-    unlink(logFileNamePath.c_str());
-    std::ofstream dbgOutput(logFileNamePath, std::fstream::out | std::fstream::trunc);
-    DualStream    logOutput(dbgOutput, std::cout);
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) cwd[0] = 0;
 
-    // Print out code length information
+    std::string context = std::string("server 1\n") + cwd + "\n" + CMD_assembler + "\n" + CMD_romLayout + "\n" +
+                          CMD_outDir + "\n" + std::to_string(CMD_jobs) + "\n" + std::to_string(CMD_packerMs) + "\n" +
+                          std::to_string(CMD_stable) + "\n";
+    for (const auto &objName : CMD_inList) context += objName + "\n";
+    if (!CMD_profile.empty()) context += CMD_profile + " " + toHexString(calcFileHash(CMD_profile)) + "\n";
+    if (!CMD_exportRoot.empty()) context += "export root " + CMD_exportRoot + "\n";
+    if (!CMD_asmCache.empty())   context += "asm cache " + CMD_asmCache + "\n";
 
-    for (const auto &sourceFile : GLOBAL_sourceFiles)
-    {
-        std::string spacing;
-        spacing.resize(GLOBAL_maxFileNameLen + 4 - sourceFile.fileName.length(), ' ');
-        std::string floating_high;
+    return calcHash(context.data(), context.size(), calcFileHash(CMD_manifest));
+}
 
-        if (sourceFile.high)
-        {
-            floating_high = "(floating, high)  ";
-        }
-        else if (sourceFile.floating)
-        {
-            floating_high = "(floating)        ";
-        }
-        else
-        {
-            floating_high = "                  ";
-        }
+bool requestServerBuild()
+{
+    // If a resident build server is running for the output directory, let it do the job
 
-        dbgOutput << "file:    " << floating_high << sourceFile.fileName << spacing << "size: " << std::to_string(sourceFile.codeLength) << "\n";
-    }
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, getServerSocketPath().c_str(), sizeof(addr.sun_path) - 1);
 
-    // Create the binning problem
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) { close(fd); return false; }
 
-    GLOBAL_binningProblem = BinningProblem(CMD_loAddress, CMD_hiAddress);
+    const std::string request = "build " + toHexString(calcServerContext()) + "\n";
+    if (write(fd, request.data(), request.size()) != (ssize_t) request.size()) { close(fd); return false; }
 
-    for (auto &sourceFile : GLOBAL_sourceFiles)
+    std::string reply;
+    char buffer[4096];
+    for (ssize_t len; (len = read(fd, buffer, sizeof(buffer))) > 0; ) reply.append(buffer, len);
+    close(fd);
+
+    // First line of the reply is a status, the rest is the build output
+
+    const auto eolPos = reply.find('\n');
+    const std::string status = reply.substr(0, eolPos);
+
+    if (eolPos == std::string::npos || status == "reject")
     {
-        GLOBAL_binningProblem.addToProblem(&sourceFile);
+        std::cout << "resident build server has different settings, building directly\n";
+        return false;
     }
 
-    // Print out some more statistics
+    std::cout << reply.substr(eolPos + 1) << std::flush;
+    if (status != "ok") ERROR(status);
 
-    logOutput << "\n" <<
-                 "free space (after floating routines are placed):    " <<
-                 std::to_string(CMD_hiAddress - CMD_loAddress + 1 - GLOBAL_totalRoutinesSize) << "\n" <<
-                 "number of floating routines:                        " <<
-                 std::to_string(GLOBAL_binningProblem.floatingRoutines.size()) << "\n" <<
-                 "number of gaps for the floating routines:           " <<
-                 std::to_string(GLOBAL_binningProblem.gaps.size()) << "\n" <<
-                 "\n";
+    return true;
+}
 
-    // Print out the available gaps
+#ifdef __linux__
 
-    for (auto& gap : GLOBAL_binningProblem.gaps)
+bool segmentUsesFile(const ManifestEntry &entry, const std::string &dirName, const std::string &fileName)
+{
+    for (const auto &objName : entry.inList)
     {
-        dbgOutput << "gap address: $" << std::uppercase << std::hex << gap.first <<
-                     "    size: " << std::to_string(gap.second) << "\n";
+        if (objName == dirName && isSourceFileName(fileName)) return true;
+        if (splitPath(objName) == std::make_pair(fileName, dirName)) return true;
     }
 
-    dbgOutput << "\n";
-
-    // Close the log file
-
-    if (!dbgOutput.good()) ERROR(std::string("error writing log file '") + logFileNamePath + "'");
-    dbgOutput.close();
+    return false;
 }
 
-void solveBinningProblem()
+void readWatchEvents(int inotifyFd, const std::map<int, std::string> &watchedDirs, std::set<size_t> &dirty)
 {
-    // Do some routine actions on the binning problem object
-
-    Solver solver(GLOBAL_binningProblem);
-    solver.run();
+    alignas(inotify_event) char buffer[4096];
 
-    if (!GLOBAL_binningProblem.isSolved())
+    ssize_t len;
+    while ((len = read(inotifyFd, buffer, sizeof(buffer))) > 0)
     {
-        ERROR("unable to solve the routine binning problem");
-    }
+        const inotify_event *event;
+        for (char *ptr = buffer; ptr < buffer + len; ptr += sizeof(inotify_event) + event->len)
+        {
+            event = reinterpret_cast<const inotify_event *>(ptr);
 
-    std::cout << "\n";
+            auto iter = watchedDirs.find(event->wd);
+            if (iter == watchedDirs.end() || event->len == 0) continue;
+
+            const std::string &dirName  = iter->second;
+            const std::string  fileName = event->name;
+
+            // Forget the outdated file content and directory listing
+
+            GLOBAL_dirListings.erase(dirName);
+
+            auto iterText = GLOBAL_sourceTexts.find(dirName + DIR_SEPARATOR + fileName);
+            if (iterText != GLOBAL_sourceTexts.end())
+            {
+                munmap(const_cast<char *>(iterText->second.data()), iterText->second.size());
+                GLOBAL_sourceTexts.erase(iterText);
+            }
+
+            for (size_t idx = 0; idx < GLOBAL_manifest.size(); idx++)
+            {
+                if (segmentUsesFile(GLOBAL_manifest[idx], dirName, fileName)) dirty.insert(idx);
+            }
+        }
+    }
 }
 
-void compileSegment()
+void runServer()
 {
-    // First combine everything into one assembler file
+    readManifest();
+    findManifestDependencies();
 
-    const std::string outFileNameBare = CMD_segName + "_combined.s";
-    const std::string vlfFileNamePath = CMD_segName + "_combined.vs";
-    const std::string symFileNamePath = CMD_segName + "_combined.sym";
-    const std::string filePath        = CMD_outDir + DIR_SEPARATOR;
-    const std::string outFileNamePath = filePath + outFileNameBare;
-    unlink(outFileNamePath.c_str());
-    unlink(vlfFileNamePath.c_str());
-    unlink(symFileNamePath.c_str());
-    std::ofstream outFile(outFileNamePath, std::fstream::out | std::fstream::trunc);
-    if (!outFile.good()) ERROR(std::string("can't open temporary file '") + outFileNamePath + "'");
+    const uint64_t context = calcServerContext();
 
-    // Write the header
+    signal(SIGPIPE, SIG_IGN);
 
-    outFile << "!set SEGMENT_" << CMD_segName << " = 1\n";
-    outFile << "!set ROM_LAYOUT_" << CMD_romLayout << " = 1\n\n";
-    outFile << "\t* = $" << std::hex << CMD_loAddress << ", INVISIBLE\n";
-    outFile << "\t!fill $" << std::hex << (CMD_hiAddress + 1 - CMD_loAddress) << "\n\n";
+    // Watch all the directories the source files come from
 
-    // Write files which only contain definitions (no routines)
+    int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd < 0) ERROR("unable to watch the source files");
 
-    for (const auto &sourceFile : GLOBAL_sourceFiles_noCode)
+    std::map<int, std::string> watchedDirs;
+    for (const auto &entry : GLOBAL_manifest)
     {
-        outFile << "\n\n\n\n";
-        outFile << ";--- Source file " << sourceFile.fileName << "\n\n";
-        outFile << "!zone " << toLabel(sourceFile.fileName) << "\n\n";
-        outFile << std::string(sourceFile.content.begin(), sourceFile.content.end());
-        outFile << "\n";
+        for (const auto &objName : entry.inList)
+        {
+            struct stat statBuf;
+            const std::string dirName = (stat(objName.c_str(), &statBuf) == 0 && S_ISDIR(statBuf.st_mode)) ?
+                                        objName : splitPath(objName).second;
+
+            const int wd = inotify_add_watch(inotifyFd, dirName.c_str(),
+                                             IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE);
+            if (wd < 0) ERROR(std::string("unable to watch directory '") + dirName + "'");
+            watchedDirs[wd] = dirName;
+        }
     }
 
-    // Write remaining files, these should be placed under their proper locations
+    // Listen for build requests
 
-    for (const auto &routine : GLOBAL_binningProblem.fixedRoutines)
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, getServerSocketPath().c_str(), sizeof(addr.sun_path) - 1);
+    unlink(addr.sun_path);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0 ||
+        bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        listen(listenFd, 8) < 0)
     {
-        outFile << "\n\n\n\n";
-        outFile << ";--- Source file " << routine.second->fileName << "\n\n";
-        outFile << "!zone " << toLabel(routine.second->fileName) << "\n\n";
-        outFile << "\t* = $" << std::hex << routine.first << "\n\n";
-        outFile << std::string(routine.second->content.begin(), routine.second->content.end());
-        outFile << "\n";
+        ERROR(std::string("unable to create socket '") + addr.sun_path + "'");
     }
 
-    outFile << "\n\n";
+    printBannerLineTop();
+    std::cout << "// Resident build server, watching " << watchedDirs.size() << " directories" << "\n";
+    printBannerLineBottom();
 
-    if (!outFile.good()) ERROR(std::string("error writing temporary file '") + outFileNamePath + "'");
-    outFile.close();
+    // Initial build - of everything
 
-    // All written - now launch the assembler
+    std::set<size_t> dirty;
+    for (size_t idx = 0; idx < GLOBAL_manifest.size(); idx++) dirty.insert(idx);
+
+    auto rebuild = [&dirty](std::ostream &output) -> std::vector<std::string>
+    {
+        // Segments with missing results (removed manually, failed to build) have to be built again
+
+        for (size_t idx = 0; idx < GLOBAL_manifest.size(); idx++)
+        {
+            const auto &entry = GLOBAL_manifest[idx];
+            if (access((CMD_outDir + DIR_SEPARATOR + entry.outFile).c_str(), F_OK) != 0 ||
+                access(getSegmentFileNamePath(entry, "_combined.sym").c_str(), F_OK) != 0)
+            {
+                dirty.insert(idx);
+            }
+        }
+
+        if (dirty.empty()) return std::vector<std::string>();
 
-    const std::string cmdParams = std::string(" ") + "--strict-segments --color" +
-                                  " --outfile "     + CMD_outFile +
-                                  " --symbollist "  + symFileNamePath +
-                                  " --vicelabels "  + vlfFileNamePath +
-                                  " " + outFileNameBare;
-    const std::string cmd = "cd " + filePath + " && " + CMD_assembler + cmdParams;
+        findManifestDependencies();
+        auto failed = buildManifestSegments(dirty, output);
+        dirty.clear();
 
-    std::cout << "asm call:" << cmdParams << "\n" << std::flush;
-    if (0 != system(cmd.c_str()))
+        return failed;
+    };
+
+    auto failed = rebuild(std::cout);
+    if (!failed.empty()) std::cout << "\n" << describeFailures(failed) << "\n";
+    std::cout << std::flush;
+
+    while (true)
     {
-        ERROR("assembler running failed");
+        // Wait a moment after a change is noticed, editors tend to write several files at once
+
+        pollfd fds[2] = { { inotifyFd, POLLIN, 0 }, { listenFd, POLLIN, 0 } };
+        int ret = poll(fds, 2, dirty.empty() ? -1 : 100);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) ERROR("error waiting for events");
+
+        if (fds[0].revents & POLLIN) readWatchEvents(inotifyFd, watchedDirs, dirty);
+
+        if (fds[1].revents & POLLIN)
+        {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+
+            std::string request;
+            char byte;
+            while (request.length() < 64 && read(fd, &byte, 1) == 1 && byte != '\n') request.push_back(byte);
+
+            std::string reply;
+            if (request != "build " + toHexString(context))
+            {
+                reply = "reject\n";
+            }
+            else
+            {
+                // Make sure all the changes done so far are taken into account
+
+                readWatchEvents(inotifyFd, watchedDirs, dirty);
+
+                std::ostringstream output;
+                failed = rebuild(output);
+                if (output.str().empty()) output << "all segments up to date\n";
+
+                reply = (failed.empty() ? "ok" : describeFailures(failed)) + "\n" + output.str();
+            }
+
+            for (size_t pos = 0; pos < reply.size(); )
+            {
+                ssize_t len = write(fd, reply.data() + pos, reply.size() - pos);
+                if (len <= 0) break;
+                pos += len;
+            }
+            close(fd);
+        }
+        else if (ret == 0 && !dirty.empty())
+        {
+            failed = rebuild(std::cout);
+            if (!failed.empty()) std::cout << "\n" << describeFailures(failed) << "\n";
+            std::cout << std::flush;
+        }
     }
 }
 
-//
-// Main function
-//
+#else
 
-int main(int argc, char **argv)
+void runServer()
 {
-    parseCommandLine(argc, argv);
+    ERROR("resident build server is not supported on this platform");
+}
 
-    printBanner();
+#endif
 
-    readSourceFiles();
-    checkInputFileLabels();
-    calcRoutineSizes();
+void buildManifest()
+{
+    if (requestServerBuild()) return;
 
-    prepareBinningProblem();
-    solveBinningProblem();
-    compileSegment();
+    readManifest();
+    findManifestDependencies();
+
+    std::set<size_t> toBuild;
+    for (size_t idx = 0; idx < GLOBAL_manifest.size(); idx++) toBuild.insert(idx);
+
+    const auto failed = buildManifestSegments(toBuild, std::cout);
+    if (!failed.empty()) ERROR(describeFailures(failed));
+}
+
+int main(int argc, char **argv)
+{
+    parseCommandLine(argc, argv);
+
+    if (CMD_manifest.empty())
+    {
+        buildSegment();
+    }
+    else if (CMD_server)
+    {
+        runServer();
+    }
+    else
+    {
+        buildManifest();
+    }
 
     return 0;
 }
@@ -606,39 +3139,14 @@ int main(int argc, char **argv)
 //
 
 SourceFile::SourceFile(const std::string &fileName, const std::string &dirName) :
-    fileName(fileName),
+    Routine(fileName),
     dirName(dirName),
     ignore(false),
-    floating(false),
-    high(false),
-    startAddr(-1),
-    codeLength(-1),
     testAddrStart(-1),
     testAddrEnd(-1),
-    layoutProcessingDone(false)
+    layoutProcessingDone(false),
+    pageSpanOpen(false)
 {
-    const std::string fileNameWithPath = dirName + DIR_SEPARATOR + fileName;
-
-    // Open the file
-
-    std::ifstream inFile;
-    inFile.open(fileNameWithPath);
-    if (!inFile.good()) ERROR(fileNameWithPath + " - unable to open file");
-
-    // Read the content
-
-    inFile.seekg(0, inFile.end);
-    auto fileLength = inFile.tellg();
-    if (fileLength == 0) ERROR(fileNameWithPath + " - file is empty");
-    content.resize(fileLength);
-
-    inFile.seekg(0);
-    inFile.read(&content[0], fileLength);
-    if (!inFile.good()) ERROR(fileNameWithPath + " - error reading file content");
-    if (content.back() != '\n') content.push_back('\n');
-
-    inFile.close();
-
     // Determine if the file content is floating or fixed position one,
     // retrieve start address
 
@@ -662,171 +3170,208 @@ SourceFile::SourceFile(const std::string &fileName, const std::string &dirName)
 
     // Preprocess the file (apply settings from the content)
 
-    preprocess();
+    preprocess(getSourceText(dirName + DIR_SEPARATOR + fileName));
 
     // Generate assembler compatible label from the file name
 
     label = toLabel(fileName);
+
+    // Calculate content hash, to be able to reuse results from previous runs
+
+    contentHash = calcHash(content.data(), content.size());
 }
 
-void SourceFile::preprocess()
+std::string_view SourceFile::nextToken(std::string_view &line)
 {
-    std::string contentStr(content.begin(), content.end());
-    std::istringstream stream1(contentStr);
-    std::istringstream stream2(contentStr);
-    std::string line;
-    uint32_t    lineNum = 0;
+    // Tokens are separated by spaces/tabs; carriage return is not a part of any token
+
+    auto isSeparator = [](char c) -> bool { return c == ' ' || c == '\t' || c == '\r'; };
+
+    size_t start = 0;
+    while (start < line.length() && isSeparator(line[start])) start++;
+
+    size_t end = start;
+    while (end < line.length() && !isSeparator(line[end])) end++;
+
+    std::string_view token = line.substr(start, end - start);
+    line.remove_prefix(end);
 
-    // Preprocess all the lines
+    return token;
+}
+
+void SourceFile::preprocess(std::string_view input)
+{
+    // Scan the lines and apply the directives; remember where the lines
+    // which have to be rewritten start
+
+    std::vector<std::pair<uint32_t, size_t>> rewrites; // line number, offset
 
-    while (std::getline(stream1, line))
+    uint32_t lineNum   = 0;
+    size_t   lineStart = 0;
+
+    while (lineStart < input.length())
     {
-        lineNum++;
+        size_t lineEnd = input.find('\n', lineStart);
+        if (lineEnd == std::string_view::npos) lineEnd = input.length();
 
-        if (line.empty()) continue;
-        std::replace(line.begin(), line.end(), '\t', ' ');
-        line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
-        preprocessLine(line, lineNum - 1);
-    }
+        if (preprocessLine(input.substr(lineStart, lineEnd - lineStart), lineNum))
+        {
+            rewrites.emplace_back(lineNum, lineStart);
+        }
 
-    // Replace content with preprocessed one
+        lineStart = lineEnd + 1;
+        lineNum++;
+    }
 
-    std::string spacing;
-    content.clear();
-    lineNum = 0;
+    // Write the preprocessed content, copying everything between the rewritten lines as-is
 
     size_t maxSymLen = 0;
     for (const auto &symbolAlias : symbolAliases) maxSymLen = std::max(maxSymLen, symbolAlias.second.first.length());
 
-    while (std::getline(stream2, line))
+    content.clear();
+    content.reserve(input.length() + rewrites.size() * 48 + 1);
+
+    auto append = [this](const std::string &str) { content.insert(content.end(), str.begin(), str.end()); };
+    auto toHex  = [](uint32_t value) -> std::string
     {
-        std::ostringstream outStream;
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%x", value);
+        return buf;
+    };
 
-        if (symbolAliases.find(lineNum) != symbolAliases.end())
-        {
-            spacing.resize(maxSymLen + 2 - symbolAliases[lineNum].first.length(), ' ');
-            outStream << "!addr " << symbolAliases[lineNum].first << spacing << "= $" <<
-                         std::hex << symbolAliases[lineNum].second << "    " << line;
+    size_t copyStart = 0;
+    for (const auto &rewrite : rewrites)
+    {
+        content.insert(content.end(), input.begin() + copyStart, input.begin() + rewrite.second);
+        copyStart = rewrite.second;
 
-            const std::string outString = outStream.str();
-            content.insert(content.end(), outString.begin(), outString.end());
+        auto iterSpan = spanLabels.find(rewrite.first);
+        if (iterSpan != spanLabels.end())
+        {
+            append(iterSpan->second + "    ");
+            continue;
         }
-        else if (configEntries.find(lineNum) != configEntries.end())
+
+        auto iterAlias = symbolAliases.find(rewrite.first);
+        if (iterAlias != symbolAliases.end())
         {
+            const auto &alias = iterAlias->second;
+
+            append("!addr " + alias.first + std::string(maxSymLen + 2 - alias.first.length(), ' ') +
+                   "= $" + toHex(alias.second) + "    ");
+            continue;
+        }
+
+        auto iterConfig = configEntries.find(rewrite.first);
+        if (iterConfig == configEntries.end()) continue;
 
-            outStream << "!set CONFIG_" << configEntries[lineNum].key << " = ";
-            if (configEntries[lineNum].valIntValid)
-            {
-                outStream << "$" << std::hex << configEntries[lineNum].valInt;
-            }
-            else
-            {
-                outStream << "1";
-            }
+        const auto &config = iterConfig->second;
 
-            outStream << "    " << line;
+        append("!set CONFIG_" + config.key + " = " + (config.valIntValid ? "$" + toHex(config.valInt) : "1") + "    ");
+        if (config.valBlob.empty()) continue;
 
-            if (!configEntries[lineNum].valBlob.empty())
-            {
-                outStream << "\n!macro CONFIG_" << configEntries[lineNum].key << " { !byte ";
+        // Macro has to be put after the original line
 
-                bool first = true;
-                for (auto &byte : configEntries[lineNum].valBlob)
-                {
-                    outStream << std::string(first ? "$" : ", $") << std::string((byte < 10) ? "0" : "") <<
-                                 std::hex << (int) byte;
-                    first = false;
-                }
-                outStream << " }";
-            }
+        size_t lineEnd = input.find('\n', copyStart);
+        if (lineEnd == std::string_view::npos) lineEnd = input.length();
+        content.insert(content.end(), input.begin() + copyStart, input.begin() + lineEnd);
+        copyStart = lineEnd;
 
-            const std::string outString = outStream.str();
-            content.insert(content.end(), outString.begin(), outString.end());
-        }
-        else
+        append("\n!macro CONFIG_" + config.key + " { !byte ");
+
+        bool first = true;
+        for (auto &byte : config.valBlob)
         {
-            content.insert(content.end(), line.begin(), line.end());          
+            append(std::string(first ? "$" : ", $") + std::string((byte < 10) ? "0" : "") + toHex(byte));
+            first = false;
         }
-
-        content.push_back('\n');
-        lineNum++;
+        append(" }");
     }
 
+    content.insert(content.end(), input.begin() + copyStart, input.end());
+    if (content.back() != '\n') content.push_back('\n');
+
+    if (pageSpanOpen) ERROR(fileName + " - unfinished page-sensitive span in '#PLACEMENT#'");
+
     symbolAliases.clear();
     symbolImports.clear();
+    spanLabels.clear();
 }
 
-void SourceFile::preprocessLine(const std::string &line, uint32_t lineNum)
+bool SourceFile::preprocessLine(std::string_view line, uint32_t lineNum)
 {
-    // Split the line into tokens
-
-    std::list<std::string> tokens;
-
-    std::istringstream stream(line);
-    std::string token;
-    while(std::getline(stream, token, ' '))
-    {
-        if (token.empty()) continue;
-        tokens.push_back(token);
-    }
-    if (tokens.empty()) return;
-
-    // Now preprocess line using the token list
+    // Quickly reject everything which is not a directive comment
 
-    auto iter = tokens.begin();
+    std::string_view rest = line;
+    if (nextToken(rest) != ";;") return false;
 
-    // Injest the comment token
+    // Check if supported directive
 
-    if ((iter++)->compare(";;") != 0 || iter == tokens.end()) return;
+    const std::string_view directive = nextToken(rest);
 
-    // Check if supported directive
+    if (directive == "#ALIAS#")
+    {
+        preprocessLine_Alias(rest, lineNum);
+        return symbolAliases.count(lineNum) != 0;
+    }
+    else if (directive == "#CONFIG#")
+    {
+        preprocessLine_Config(rest, line, lineNum);
+        return configEntries.count(lineNum) != 0;
+    }
+    else if (directive == "#PLACEMENT#")
+    {
+        preprocessLine_Placement(rest, lineNum);
+        return spanLabels.count(lineNum) != 0;
+    }
+    else if (directive == "#IMPORT#") preprocessLine_Import(rest);
+    else if (directive == "#LAYOUT#") preprocessLine_Layout(rest);
 
-    if (iter->compare("#ALIAS#") == 0) preprocessLine_Alias(tokens,        ++iter, lineNum);
-    else if (iter->compare("#CONFIG#") == 0) preprocessLine_Config(tokens, ++iter, line, lineNum);
-    else if (iter->compare("#IMPORT#") == 0) preprocessLine_Import(tokens, ++iter);
-    else if (iter->compare("#LAYOUT#") == 0) preprocessLine_Layout(tokens, ++iter);
+    return false;
 }
 
-void SourceFile::preprocessLine_Alias(const std::list<std::string> &tokens, std::list<std::string>::iterator &iter, uint32_t lineNum)
+void SourceFile::preprocessLine_Alias(std::string_view rest, uint32_t lineNum)
 {
     if (ignore) return;
 
     // Extract symbol, namespace, and target
 
-    if (iter == tokens.end()) ERROR("syntax error, missing symbol in '#ALIAS#'");
-    std::string symbol = *(iter++);
+    const std::string_view symbol = nextToken(rest);
+    if (symbol.empty()) ERROR("syntax error, missing symbol in '#ALIAS#'");
 
-    if (iter == tokens.end() || (iter++)->compare("=") != 0) ERROR("syntax error, expected assignment in '#ALIAS#'");
-    if (iter == tokens.end()) ERROR("syntax error, missing namespace/target in '#ALIAS#'");
+    if (nextToken(rest) != "=") ERROR("syntax error, expected assignment in '#ALIAS#'");
 
-    auto dotPos = iter->rfind('.');
-    std::string symNameSpace = iter->substr(0, dotPos);
-    std::string symTarget    = iter->substr(dotPos + 1, std::string::npos);
+    const std::string_view target = nextToken(rest);
+    if (target.empty()) ERROR("syntax error, missing namespace/target in '#ALIAS#'");
+
+    auto dotPos = target.rfind('.');
+    std::string symNameSpace(target.substr(0, dotPos));
+    std::string symTarget(dotPos == std::string_view::npos ? target : target.substr(dotPos + 1));
 
     if (symNameSpace.empty()) ERROR("syntax error, missing namespace in '#ALIAS#'");
     if (symTarget.empty())    ERROR("syntax error, missing target in '#ALIAS#'");
 
     // Put the alias - if address found
 
-    for (const auto &alias : symbolImports[symNameSpace])
+    for (const auto symbolIndex : symbolImports[symNameSpace])
     {
-        if (alias.first.compare(symTarget) != 0) continue;
+        auto iter = symbolIndex->find(symTarget);
+        if (iter == symbolIndex->end()) continue;
 
-        symbolAliases[lineNum] = std::pair<std::string, uint16_t>(symbol, alias.second);
+        symbolAliases[lineNum] = std::pair<std::string, uint16_t>(std::string(symbol), iter->second);
         break;
     }
 }
 
-void SourceFile::preprocessLine_Config(const std::list<std::string> &tokens, std::list<std::string>::iterator &iter,
-                                       const std::string &line, uint32_t lineNum)
+void SourceFile::preprocessLine_Config(std::string_view rest, std::string_view line, uint32_t lineNum)
 {
     if (ignore) return;
 
-    if (iter == tokens.end()) ERROR("syntax error, missing key in '#CONFIG#'");
-    std::string key = *(iter++);
+    const std::string key(nextToken(rest));
+    if (key.empty()) ERROR("syntax error, missing key in '#CONFIG#'");
 
-    if (iter == tokens.end()) ERROR("syntax error, missing value in '#CONFIG#'");
-    std::string valStr = *(iter++);
+    const std::string valStr(nextToken(rest));
+    if (valStr.empty()) ERROR("syntax error, missing value in '#CONFIG#'");
 
     if (valStr.compare("NO") == 0) return;
     else if (valStr.compare("YES") == 0)
@@ -846,8 +3391,13 @@ void SourceFile::preprocessLine_Config(const std::list<std::string> &tokens, std
             char byte;
             auto advance = [&byte, &line, &pos]()
             {
-                if ((line.size() <= ++pos) || (line[pos] == '\n')) ERROR("syntax error, unfinished string in '#CONFIG#'");
-                byte = line[pos];
+                do
+                {
+                    if ((line.size() <= ++pos) || (line[pos] == '\n')) ERROR("syntax error, unfinished string in '#CONFIG#'");
+                }
+                while (line[pos] == '\r');
+
+                byte = (line[pos] == '\t') ? ' ' : line[pos];
             };
             auto byteToNibble = [&byte]() -> uint8_t
             {
@@ -930,81 +3480,65 @@ void SourceFile::preprocessLine_Config(const std::list<std::string> &tokens, std
     }
 }
 
-void SourceFile::preprocessLine_Import(const std::list<std::string> &tokens, std::list<std::string>::iterator &iter)
+void SourceFile::preprocessLine_Import(std::string_view rest)
 {
     if (ignore) return;
 
-    if (iter == tokens.end()) ERROR("syntax error, missing namespace in '#IMPORT#'");
-    std::string symNameSpace = *(iter++);
+    const std::string symNameSpace(nextToken(rest));
+    if (symNameSpace.empty()) ERROR("syntax error, missing namespace in '#IMPORT#'");
 
-    if (iter == tokens.end() || iter->compare("=") != 0) ERROR("syntax error, expected assignment in '#IMPORT#'");
+    if (nextToken(rest) != "=") ERROR("syntax error, expected assignment in '#IMPORT#'");
 
-    while (++iter != tokens.end())
+    for (auto token = nextToken(rest); !token.empty(); token = nextToken(rest))
     {
-        // Try to import sumbols for the file
-
-        std::ifstream impFile;
-        impFile.open(CMD_outDir + DIR_SEPARATOR + *iter);
-        if (!impFile.good())
-        {
-            impFile.close();
-            continue;
-        }
-
-        std::string line;
-        while (std::getline(impFile, line))
-        {
-            // Import label and address
-
-            auto eqPos = line.rfind('=');
-
-            auto address      = strtol(line.substr(eqPos + 3).c_str(), nullptr , 16);
-            std::string label = line.substr(1, eqPos - 2);
-
-            symbolImports[symNameSpace].push_back(std::pair<std::string, uint16_t>(label, address));
-        }
+        // Try to import symbols from the file
 
-        impFile.close();
+        const SymbolIndex *symbolIndex = getSymbolIndex(CMD_outDir + DIR_SEPARATOR + std::string(token));
+        if (symbolIndex != nullptr) symbolImports[symNameSpace].push_back(symbolIndex);
     }
 }
 
-void SourceFile::preprocessLine_Layout(const std::list<std::string> &tokens, std::list<std::string>::iterator &iter)
+void SourceFile::preprocessLine_Layout(std::string_view rest)
 {
     if (layoutProcessingDone) return;
 
     // Check if segment name and rom layout match
 
-    if (iter == tokens.end()) ERROR("syntax error, missing rom layout in '#LAYOUT#'");
-    if (!nameMatch(*(iter++), CMD_romLayout)) return;
+    const std::string_view romLayout = nextToken(rest);
+    if (romLayout.empty()) ERROR("syntax error, missing rom layout in '#LAYOUT#'");
+    if (!nameMatch(romLayout, CMD_romLayout)) return;
 
-    if (iter == tokens.end()) ERROR("syntax error, missing segment name in '#LAYOUT#'");
-    if (!nameMatch(*(iter++), CMD_segName)) return;
+    const std::string_view segName = nextToken(rest);
+    if (segName.empty()) ERROR("syntax error, missing segment name in '#LAYOUT#'");
+    if (!nameMatch(segName, CMD_segName)) return;
 
     // Retrieve and apply action
 
-    if (iter == tokens.end()) ERROR("syntax error, missing action in '#LAYOUT#'");
+    const std::string_view action = nextToken(rest);
+    if (action.empty()) ERROR("syntax error, missing action in '#LAYOUT#'");
 
-    if (iter->compare("#IGNORE") == 0)
+    if (action == "#IGNORE")
     {
         ignore   = true;
     }
-    else if (iter->compare("#TAKE-FLOAT") == 0)
+    else if (action == "#TAKE-FLOAT")
     {
         floating = true;
     }
-    else if (iter->compare("#TAKE-HIGH") == 0)
+    else if (action == "#TAKE-HIGH")
     {
         floating = true;
         high     = true;
     }
-    else if (iter->compare("#TAKE-OFFSET") == 0)
+    else if (action == "#TAKE-OFFSET")
     {
-        if (++iter == tokens.end()) ERROR("syntax error, missing parameter for '#TAKE-OFFSET'");
-        startAddr += strtol(iter->c_str(), nullptr, 16);
+        const std::string param(nextToken(rest));
+        if (param.empty()) ERROR("syntax error, missing parameter for '#TAKE-OFFSET'");
+        startAddr += strtol(param.c_str(), nullptr, 16);
     }
-    else if (iter->compare("#TAKE") != 0)
+    else if (action != "#TAKE")
     {
-        ERROR(std::string("syntax error, unsupported action '") + *iter + "' in '#LAYOUT#'");
+        ERROR(std::string("syntax error, unsupported action '") + std::string(action) + "' in '#LAYOUT#'");
     }
 
     // Mark the file - to tell that layout processing is finished
@@ -1012,533 +3546,83 @@ void SourceFile::preprocessLine_Layout(const std::list<std::string> &tokens, std
     layoutProcessingDone = true;
 }
 
-
-bool SourceFile::nameMatch(const std::string &token, const std::string &name)
+void SourceFile::preprocessLine_Placement(std::string_view rest, uint32_t lineNum)
 {
-    return (token.compare("*") == 0) || (token.compare(name) == 0);
-}
+    if (ignore) return;
 
-//
-// Class 'BinningProblem'
-//
+    const std::string_view constraint = nextToken(rest);
+    if (constraint.empty()) ERROR("syntax error, missing constraint in '#PLACEMENT#'");
 
-BinningProblem::BinningProblem(int loAddress, int hiAddress)
-{
-    if (hiAddress < loAddress || hiAddress < 0 || loAddress < 0 || hiAddress > 0xFFFF || loAddress > 0xFFFF)
+    if (constraint == "#ALIGN")
     {
-        ERROR("invalid lo/hi address");
-    }
-
-    // Create one large gap (initial) to represent the assembly
-
-    gaps[loAddress] = hiAddress - loAddress + 1;
-
-    // Initial value of statistics
-
-    statSize = gaps[loAddress];
-    statFree = gaps[loAddress];
-    statWasted = 0;
-}
-
-bool BinningProblem::isSolved() const
-{
-    return floatingRoutines.empty();
-}
+        const std::string param(nextToken(rest));
+        if (param.empty()) ERROR("syntax error, missing parameter for '#ALIGN'");
 
-void BinningProblem::addToProblem(SourceFile *routine)
-{
-    if (routine->floating)
-    {
-        floatingRoutines.push_back(routine);
+        alignment = strtol(param.c_str(), nullptr, 16);
+        if (alignment <= 0 || alignment > 0x10000) ERROR("syntax error, wrong parameter for '#ALIGN'");
     }
-    else
+    else if (constraint == "#NO-PAGE-CROSS")
     {
-        // For the fixed-address routines, we have to find the matching place
-
-        bool gapFound = false;
-        for (auto &gap: gaps)
-        {
-            if (gap.first > routine->startAddr || gap.first + gap.second - 1 < routine->startAddr)
-            {
-                continue; // not a suitable gap
-            }
-
-            // We have to put the routine into the current gap
-
-            if (gap.first + gap.second < routine->startAddr + routine->codeLength)
-            {
-                ERROR(std::string("fixed address file '") + routine->fileName + "' won't fit in the available gap");
-            }
-
-            gapFound = true;
-
-            // Put the routine into the gap, possibly removing it or splitting into two
-
-            fixedRoutines[routine->startAddr] = routine;
-            statFree -= routine->codeLength;
-
-            // Calculate possible new gap after the routine
-
-            int newGapSize  = (gap.first + gap.second) - (routine->startAddr + routine->codeLength);
-            int newGapStart = (newGapSize <= 0) ? -1 : routine->startAddr + routine->codeLength;
-
-            // Remove or shrink the current gap
-
-            if (gap.first == routine->startAddr)
-            {
-                gaps.erase(gap.first);
-            }
-            else
-            {
-                gap.second = routine->startAddr - gap.first;
-            }
-
-            // Add a new gap
-
-            if (newGapStart > 0) gaps[newGapStart] = newGapSize;
-
-            break; // iterator is not valid enymore, we have to stop the llop
-        }
-
-        if (!gapFound)
-        {
-            ERROR(std::string("start address of fixed address file '") +
-                  routine->fileName + "' (" + std::to_string(routine->startAddr) +
-                  ") already occupied or out of range");
-        }
+        noPageCross = true;
     }
-}
-
-void BinningProblem::fillGap(std::ofstream &dbgOutput, int gapAddress, const std::list<SourceFile *> &routines)
-{
-    int offset = 0;
-    std::string spacing;
-
-    for (auto &routine : routines)
+    else if (constraint == "#NO-PAGE-CROSS-BEGIN" || constraint == "#NO-PAGE-CROSS-END")
     {
-        int targetAddr = gapAddress + offset;
-
-        spacing.resize(GLOBAL_maxFileNameLen + 4 - routine->fileName.length(), ' ');
-        dbgOutput << "    $" << std::hex << targetAddr << std::dec << ": " <<
-                     routine->fileName << spacing << "size: " << routine->codeLength << "\n";
-
-        fixedRoutines[targetAddr] = routine;
-        offset   += routine->codeLength;
-        statFree -= routine->codeLength;
+        // Mark the span boundary with a label - this way the test run can tell where the span is
 
-        if (offset > gaps[gapAddress]) ERROR(std::string("internal error line ") + std::to_string(__LINE__));
+        const bool begin = (constraint == "#NO-PAGE-CROSS-BEGIN");
+        if (begin == pageSpanOpen) ERROR(std::string("syntax error, unbalanced '") + std::string(constraint) + "' in '#PLACEMENT#'");
 
-        floatingRoutines.erase(std::remove(floatingRoutines.begin(), floatingRoutines.end(), routine), floatingRoutines.end());
-    }
-
-    // Get rid of the gap, it's useless now
+        spanLabels[lineNum] = (begin ? LAB_SPAN_BEGIN : LAB_SPAN_END) + std::to_string(numPageSpans) + "_" + toLabel(fileName);
 
-    if (offset == gaps[gapAddress])
-    {
-        dbgOutput << "filled to the last byte" << "\n";
-    }
-    else if (!isSolved())
-    {
-        dbgOutput << "filled in - dropped bytes: " << gaps[gapAddress] - offset << "\n";
-        statWasted += gaps[gapAddress] - offset;
+        pageSpanOpen = begin;
+        if (!begin) numPageSpans++;
     }
     else
     {
-        dbgOutput << "out of routines" << "\n";
+        ERROR(std::string("syntax error, unsupported constraint '") + std::string(constraint) + "' in '#PLACEMENT#'");
     }
-
-    gaps.erase(gapAddress);
 }
 
-void BinningProblem::placeHighRoutines(std::ofstream &dbgOutput)
+bool SourceFile::nameMatch(std::string_view token, const std::string &name)
 {
-    // Place routines which has to be stored in the high ROM area
-    // It is expected there will be very few of them, so no complicated algorithms here
-
-    std::string spacing;
-
-    while (!floatingRoutines.empty())
-    {
-        // Find the largest high routine
-
-        auto iterRoutine = floatingRoutines.end();
-
-        for (auto iter = floatingRoutines.begin(); iter < floatingRoutines.end(); iter++)
-        {
-            if (!(*iter)->high) continue;
-
-            if (iterRoutine == floatingRoutines.end() ||
-                (*iterRoutine)->codeLength < (*iter)->codeLength)
-            {
-                iterRoutine = iter;
-                continue;
-            }
-
-            if ((*iterRoutine)->codeLength < (*iter)->codeLength)
-            {
-                iterRoutine = iter;   
-            }
-        }
-
-        if (iterRoutine == floatingRoutines.end()) break;
-
-        // Now we need to find a space to put it - just take the largest gap available,
-        // which is located in the high ROM area
-
-        int routineSize = (*iterRoutine)->codeLength;
-        int gapAddress  = -1;
-
-        for (auto &gap : gaps)
-        {
-            if (gap.second < routineSize || gap.first < 0xE000) continue;
-
-            if (gap.second == routineSize)
-            {
-                gapAddress = gap.first;
-                break;
-            }
-
-            if (gapAddress < 0 || gap.second > gaps[gapAddress])
-            {
-                gapAddress = gap.first;
-            }
-        }
-
-        if (gapAddress < 0) ERROR("no suitable space for a high routine");
-
-        // Place routine in the gap found
-
-        gaps[gapAddress] -= routineSize;
-
-        int targetAddr = gapAddress + gaps[gapAddress];
-        fixedRoutines[targetAddr] = *iterRoutine;
-        statFree   -= routineSize;
-
-        dbgOutput << "reducing gap $" << std::hex << gapAddress << std::dec <<
-                    " to size " << gaps[gapAddress] << "\n";
-
-        spacing.resize(GLOBAL_maxFileNameLen + 4 - (*iterRoutine)->fileName.length(), ' ');
-        dbgOutput << "    $" << std::hex << targetAddr << std::dec << ": " <<
-                     (*iterRoutine)->fileName << spacing << "size: " <<
-                     (*iterRoutine)->codeLength << "\n";
-
-        floatingRoutines.erase(iterRoutine);
-        if (gaps[gapAddress] == 0) gaps.erase(gapAddress);
-    }
+    return (token == "*") || (token == name);
 }
 
-void BinningProblem::performObviousSteps(std::ofstream &dbgOutput)
+void SourceFile::listImports(std::string_view input, const std::string &segName, std::set<std::string> &fileNames)
 {
-    // Get the size of the biggest routine; if there is just one gap which
-    // can handle it - put the routine exactly there
+    // Lightweight variant of the preprocessing - only finds symbol files which would be imported
+    // when building the given segment; '#LAYOUT#' has to be evaluated, as the import files
+    // are typically only used by one segment and ignored by the others
 
-    std::string spacing;
+    bool ignore     = false;
+    bool layoutDone = false;
 
-    bool repeat  = true;
-    bool lastGap = false;
-    while (repeat && !floatingRoutines.empty() && !gaps.empty())
+    size_t lineStart = 0;
+    while (lineStart < input.length())
     {
-        repeat = false;
-
-        int routineSize = floatingRoutines.back()->codeLength;
-
-        int gapAddress;
-        int matchingGaps = 0;
-        for (auto &gap : gaps)
-        {
-            if (gap.second >= routineSize)
-            {
-                matchingGaps++;
-                gapAddress = gap.first;
-            }
-        }
-
-        if (!lastGap && gaps.size() == 1)
-        {
-            lastGap = true;
-            dbgOutput << "selected gap: $" << std::hex << gapAddress << std::dec <<
-                         " (size: " << gaps[gapAddress] << ") - the last remaining" << "\n";
-        }
+        size_t lineEnd = input.find('\n', lineStart);
+        if (lineEnd == std::string_view::npos) lineEnd = input.length();
 
-        if (matchingGaps == 1)
-        {
-            // Routine can only be placed in this particular gap - do so
-
-            gaps[gapAddress] -= routineSize;
-            int targetAddr = gapAddress + gaps[gapAddress];
-            fixedRoutines[targetAddr] = floatingRoutines.back();
-            statFree   -= routineSize;
-
-            if (gaps.size() > 1)
-            {
-                dbgOutput << "forced reducing gap $" << std::hex << gapAddress << std::dec <<
-                             " to size " << gaps[gapAddress] << "\n";
-            }
-
-            spacing.resize(GLOBAL_maxFileNameLen + 4 - floatingRoutines.back()->fileName.length(), ' ');
-            dbgOutput << "    $" << std::hex << targetAddr << std::dec << ": " <<
-                         floatingRoutines.back()->fileName << spacing << "size: " <<
-                         floatingRoutines.back()->codeLength << "\n";
-
-            floatingRoutines.pop_back();
-            if (gaps[gapAddress] == 0) gaps.erase(gapAddress);
-
-            repeat = true;
-        }
-    }
-}
-
-void BinningProblem::removeUselessGaps(std::ofstream &dbgOutput)
-{
-    // Get the size of the smallest floating routine,
-    // remove all the gaps which are smaller in size
+        std::string_view rest = input.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 1;
 
-    int minUsefulSize = floatingRoutines[0]->codeLength;
+        if (nextToken(rest) != ";;") continue;
 
-    bool repeat = true;
-    while (repeat)
-    {
-        repeat = false;
-        for (auto &gap : gaps)
+        const std::string_view directive = nextToken(rest);
+        if (directive == "#LAYOUT#" && !layoutDone)
         {
-            if (gap.second < minUsefulSize)
-            {
-                dbgOutput << "dropping gap: $" << std::hex << gap.first << std::dec << " (size: " << gap.second << ")" << "\n";
-                statWasted += gap.second;
-                gaps.erase(gap.first);
-                repeat = true;
-                break;
-            }
-        }
-    }
-}
-
-void BinningProblem::sortFloatingRoutinesBySize()
-{
-    // Sort the unallocated routines by size, starting from the smallest one
-
-    auto compare = [](const SourceFile *a, const SourceFile *b) -> bool { return a->codeLength < b->codeLength; };
-    std::sort (floatingRoutines.begin(), floatingRoutines.end(), compare);
-}
-
-//
-// Class 'Solver'
-//
-
-void Solver::run()
-{
-    // Prepare the log file
-
-    const std::string logFileNamePath = CMD_outDir + DIR_SEPARATOR + CMD_segName + "_binsolution.log";
-    unlink(logFileNamePath.c_str());
-    dbgOutput.open(logFileNamePath, std::fstream::out | std::fstream::trunc);
-
-    // Sort the floating routines, just to be extra sure
-
-    problem.sortFloatingRoutinesBySize();
-
-    // Place routines which should be stored in high-ROM
-
-    problem.placeHighRoutines(dbgOutput);
-
-    // Run the solver until all is done
-
-    while (!problem.gaps.empty() && !problem.floatingRoutines.empty())
-    {
-        problem.performObviousSteps(dbgOutput);
-        problem.removeUselessGaps(dbgOutput);
-
-        if (problem.gaps.empty() || problem.floatingRoutines.empty()) break;
-
-        int gapAddr = selectGapToFill();
-
-        dbgOutput << "selected gap: $" << std::hex << gapAddr << std::dec << " (size: " << problem.gaps[gapAddr] << ")" << "\n";
-
-        std::list<SourceFile *> partialSolution;
-        findPartialSolution(problem.gaps[gapAddr], partialSolution);
-        problem.fillGap(dbgOutput, gapAddr, partialSolution);
-    }
-
-    // Print out the result
-
-    if (problem.isSolved())
-    {
-        dbgOutput << "\n";
-        logOutput << "all routines sucessfully placed" << "\n";
-        dbgOutput << "\n";
-        logOutput << "segment statistics:" << "\n";
-        // logOutput << "    - total size:   " << problem.statSize << "\n"; - for BASIC contains filling gap too
-        logOutput << "    - wasted bytes: " << problem.statWasted << "\n";
-        logOutput << "    - still free:   " << problem.statFree - problem.statWasted << "\n";
-    }
-
-    // Close the log file
-
-    if (!dbgOutput.good()) ERROR(std::string("error writing log file '") + logFileNamePath + "'");
-    dbgOutput.close();
-}
-
-int Solver::selectGapToFill()
-{
-    // Find the smallest gap to fill-in
-
-    int gapAddr = -1;
-    int gapSize = -1;
+            if (!nameMatch(nextToken(rest), CMD_romLayout)) continue;
+            if (!nameMatch(nextToken(rest), segName)) continue;
 
-    for (auto &gap : problem.gaps)
-    {
-        if (gapSize < 0 || gap.second < gapSize)
-        {
-            gapAddr = gap.first;
-            gapSize = gap.second;
+            ignore     = (nextToken(rest) == "#IGNORE");
+            layoutDone = true;
         }
-    }
-
-    return gapAddr;
-}
-
-int KS(const std::vector<SourceFile *> &routines,
-    std::vector<std::vector<int>> &cacheV,             // value cache
-    std::vector<std::vector<std::list<bool>>> &cacheS, // partial solution cache
-    int n, int C,
-    std::list<bool> &solution) // sequence of decisions for each routine, has to be empty when calling
-{
-    // This routine solves a knapsack problem using a dynamic programming.
-    //
-    // In short: 'routines' contains a list of routines that can potentially be placed in the gap of size C.
-    // We start from index n (the highest one), referencing the last routine from the list (the largest one,
-    // as the list is sorted). Our goal: by recursively searching the tree of all possible solutions
-    // (solution = a sequence of decisions, each telling whether to take the routine or not) find the one
-    // that fills the gap in the most complete way. Additional cache greatly speeds up the algorithm.
-    // See the comments below to fully understand how it works.
-
-    // XXX Possible efficiency improvement for the future: try to consider more than one gap at once,
-    //     this will need a serious rework of the dynamic cache handling and will probably hurt the performance
-
-    if (n == 0)
-    {
-        // No more routines to take the decision...
-        return 0;
-    }
-
-    if (C == 0)
-    {
-        // We have no capacity left - decisions for all the routines left should be not to take them
-        solution.resize(n, false);
-        return 0;
-    }
-
-    auto &cachedV = cacheV[n - 1][C - 1];
-    auto &cachedS = cacheS[n - 1][C - 1];
-    if (cachedV >= 0)
-    {
-        // We already hold the solution in our cache - return it
-        solution = cachedS;
-        return cachedV;
-    }
-
-    auto &codeSize = routines[n - 1]->codeLength;
-    if (codeSize > C)
-    {
-        // We can't take this routine, it's too large
-
-        cachedV = KS(routines, cacheV, cacheS, n - 1, C, solution);
-        solution.push_back(false);
-        cachedS = solution;
-
-        return cachedV;
-    }
-
-    // Note: it it seems equally good to take this routine, or not - take it!
-    // Evaluation starts from the largest routines, and we should prefer to leave
-    // a larger number of smaller routines - as this gives more possibilities
-    // while optimizing the usage of further gaps
-
-    std::list<bool> solution1;
-    int val1 = KS(routines, cacheV, cacheS, n - 1, C - codeSize, solution1) + codeSize; // take
-
-    if (val1 == C)
-    {
-        // By taking this routine we are filling all the space - contrary to the classic
-        // knapsack problem, this is an optimal solution for us, don't waste time calculating
-        // the others
-
-        cachedV = val1;
-        solution = solution1;
-        solution.push_back(true);
-        cachedS = solution;
-        return cachedV;
-    }
-
-    std::list<bool> solution2;
-    int val2 = KS(routines, cacheV, cacheS, n - 1, C, solution2); // don't take
-
-    if (val1 >= val2)
-    {
-        // It's better to take this particular routine
-
-        cachedV = val1;
-        solution = solution1;
-        solution.push_back(true);
-    }
-    else
-    {
-        // It's better not to take this particular routine
-
-        cachedV = val2;
-        solution = solution2;
-        solution.push_back(false);
-    }
-
-    cachedS = solution;
-    return cachedV;
-};
-
-void Solver::findPartialSolution(int gapSize, std::list<SourceFile *> &partialSolution)
-{
-    // First filter out available routines, take only the ones not larger than our gap
-
-    std::vector<SourceFile *> routines;
-    routines.clear();
-    for (auto &routine : problem.floatingRoutines)
-    {
-        if (routine->codeLength <= gapSize)
+        else if (directive == "#IMPORT#" && !ignore)
         {
-            routines.push_back(routine);
-        }
-        else break; // 'floatingRoutines' should be kept sorted
-    }
-
-    // Prepare value cache
-
-    std::vector<std::vector<int>> cacheV;
-    cacheV.resize(routines.size());
-    for (auto &cacheRow : cacheV) cacheRow.resize(gapSize, -1);
-
-    // Prepare partial solution cache
-    std::vector<std::vector<std::list<bool>>> cacheS;
-    cacheS.resize(routines.size());
-    for (auto &cacheRow : cacheS) cacheRow.resize(gapSize);
+            nextToken(rest);
+            if (nextToken(rest) != "=") continue;
 
-    // Calculate solution
-
-    std::list<bool> solution;
-    KS(routines, cacheV, cacheS, routines.size(), gapSize, solution);
-
-    if (routines.size() != solution.size()) ERROR(std::string("internal error line ") + std::to_string(__LINE__));
-
-    // Return the solution upstream
-
-    while (!routines.empty())
-    {
-        if (solution.back() != false)
-        {
-            partialSolution.push_front(routines.back());
+            for (auto token = nextToken(rest); !token.empty(); token = nextToken(rest)) fileNames.emplace(token);
         }
-
-        routines.pop_back();
-        solution.pop_back();
     }
-
-    return;
 }
@@ -3,7 +3,11 @@
 // for providing uniform user experience
 //
 
+#ifndef COMMON_H
+#define COMMON_H
+
 #include <iostream>
+#include <stdexcept>
 #include <string>
 
 
@@ -17,23 +21,36 @@
 const std::string BANNER_LINE = "//-------------------------------------------------------------------------------------------";
 
 
-void ERROR()
+// Worker threads must not exit the program while other threads still use the global data -
+// for them, errors are thrown, to be reported by the thread which started the workers
+
+class ErrorException : public std::runtime_error
+{
+public:
+    explicit ErrorException(const std::string &message) : std::runtime_error(message) {}
+};
+
+inline thread_local bool GLOBAL_errorThrows = false;
+
+inline void ERROR()
 {
+    if (GLOBAL_errorThrows) throw ErrorException("");
     exit(-1);
 }
 
-void ERROR(const std::string &message)
+inline void ERROR(const std::string &message)
 {
+    if (GLOBAL_errorThrows) throw ErrorException(message);
     std::cout << "\n" << "ERROR: " << message << "\n\n";
     exit(-1);
 }
 
-void printBannerLineTop()
+inline void printBannerLineTop()
 {
     std::cout << "\n\n\n" << BANNER_LINE << "\n";
 }
 
-void printBannerLineBottom()
+inline void printBannerLineBottom()
 {
     std::cout << BANNER_LINE << "\n\n";
 }
@@ -56,3 +73,5 @@ private:
     std::ostream& str1;
     std::ostream& str2;
 };
+
+#endif // COMMON_H
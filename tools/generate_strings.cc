@@ -12,6 +12,7 @@
 #include <regex>
 #include <sstream>
 #include <map>
+#include <set>
 #include <vector>
 
 //
@@ -20,6 +21,7 @@
 
 std::string CMD_outFile = "out.s";
 std::string CMD_cnfFile = "";
+size_t      CMD_sizeBudget = 0;
 
 //
 // Type definition for strings/keywords to generate
@@ -54,6 +56,28 @@ typedef struct StringEntryList
 typedef std::vector<uint8_t>       StringEncoded;
 typedef std::vector<StringEncoded> StringEncodedList;
 
+typedef std::vector<uint16_t>      StringParsed;      // characters and dictionary references
+typedef std::vector<StringParsed>  StringParsedList;
+
+const uint16_t DICT_REF = 0x100;                      // dictionary reference, add the entry index
+
+typedef struct EncodingCost
+{
+    size_t size         = 0;    // total size of the packed strings, in bytes
+    size_t cyclesDecode = 0;    // 6502 cycles to find and decode every string once
+    size_t cyclesPack   = 0;    // 6502 cycles to pack every keyword once by the tokenizer
+
+    size_t total() const { return cyclesDecode + cyclesPack; }
+} EncodingCost;
+
+typedef struct PackedLayout
+{
+    std::vector<size_t> owners;    // index of the string which stores the bytes, for each string
+    std::vector<size_t> offsets;   // offset of each string from the start of the list
+    size_t              size  = 0;
+    uint8_t             width = 0; // size of the offset table entry, in bytes
+} PackedLayout;
+
 // http://www.classic-games.com/commodore64/cbmtoken.html
 // https://www.c64-wiki.com/wiki/BASIC_token
 
@@ -466,22 +490,42 @@ class DictEncoder
 {
 public:
 
-    void addString(const std::string &inString, StringEncoded *outPtr);
+    void setCommonChars(const std::vector<char> &chars);
+    void setMaxEntries(size_t entries);
+    void addString(const std::string &inString, StringParsed *outPtr);
 
     void process(StringEntryList &outDictionary);
 
 private:
 
-    bool optimizeSplit();
-    bool optimizeJoin();
-    void optimizeOrder();
+    typedef struct Segment
+    {
+        std::string text;
+        bool        isPhrase;   // dictionary reference, literal text otherwise
+    } Segment;
+
+    typedef std::vector<std::vector<Segment>> Parsing; // segments, for each distinct input string
+
+    typedef struct Candidate
+    {
+        int32_t     estimate;   // estimated gain, in bytes
+        std::string phrase;
+    } Candidate;
 
-    void cleanupDictionary();
+    size_t calcNibbles(const std::string &str) const;
+    size_t calcCost(const Parsing &parsing, size_t &numEntries) const;
 
-    void extractWords(std::vector<std::string> &candidateList);
-    int32_t evaluateCandidate(std::string &candidate);
+    void findCandidates(const Parsing &parsing, std::vector<Candidate> &candidates) const;
+    Parsing applyPhrase(const Parsing &parsing, const std::string &phrase) const;
 
-    std::vector<StringEncoded *> encodings;
+    void buildDictionary(const Parsing &parsing);
+    void optimizeOrder();
+
+    std::vector<char>            commonChars;   // characters expected to be encoded as 1 nibble
+    size_t                       maxEntries = 255;
+    std::vector<std::string>     inputStrings;  // distinct strings to compress
+    std::vector<size_t>          inputIndexes;  // input string, for each encoding
+    std::vector<StringParsed *>  encodings;
     std::vector<std::string>     dictionary;
 };
 
@@ -501,10 +545,18 @@ private:
     void generateConfigDepStrings();
     void validateLists();
     void calculateFrequencies();
+    void assignEncoding(const std::vector<char> &chars1n);
+    void optimizeEncoding();
     void encodeStringsDict();
     void encodeStringsFreq();
 
     void encodeByFreq(const std::string &plain, StringEncoded &encoded) const;
+    void encodeByFreq(const StringParsed &parsed, StringEncoded &encoded) const;
+    void encodeEntry(size_t idxList, size_t idxEntry, StringEncoded &encoded) const;
+
+    EncodingCost calcEncodingCost() const;
+    size_t calcDecodeCycles(const StringEncoded &encoded) const;
+    size_t calcPackCycles(const std::string &plain) const;
 
     void prepareOutput();
     void prepareOutput_1n_3n(std::ostringstream &stream);
@@ -513,21 +565,41 @@ private:
                               const StringEncodedList &stringEncodedList);
     void prepareOutput_packed(std::ostringstream &stream,
                               const StringEntryList &stringEntryList,
-                              const StringEncodedList &stringEncodedList);
+                              const StringEncodedList &stringEncodedList,
+                              const PackedLayout *layout = nullptr);
+    void prepareOutput_offsets(std::ostringstream &stream,
+                               const StringEntryList &stringEntryList,
+                               const PackedLayout *layout);
+    void prepareOutput_offsetsReport(std::ostringstream &stream,
+                                     const StringEntryList &stringEntryList,
+                                     const StringEncodedList &stringEncodedList);
+
+    void prepareOutput_hashIndex(std::ostringstream &stream);
 
     void putCharEncoding(std::ostringstream &stream, uint8_t idx, char character, bool is3n);
 
+    static uint8_t calcKeywordHash(const StringEncoded &encoded, uint8_t seed);
+
     bool isCompressionLvl2(const StringEntryList &list) const;
+    bool isTailMerged(const StringEntryList &list) const;
+    bool hasOffsets(const StringEntryList &list) const;
+
+    static void calcLayout(const StringEncodedList &stringEncodedList, bool tailMerge, PackedLayout &layout);
+    static size_t calcSkipCycles(const StringEncoded &encoded);
 
     virtual bool isRelevant(const StringEntry &entry) const = 0;
     virtual std::string layoutName() const = 0;
 
     std::vector<StringEntryList>          stringEntryLists;
     std::vector<StringEncodedList>        stringEncodedLists;
+    std::vector<StringParsedList>         stringParsedLists; // only for lists compressed using the dictionary
 
     std::vector<char>                     as1n; // list of bytes to be encoded as 1 nibble
     std::vector<char>                     as3n; // list of bytes to be encoded as 3 nibbles
 
+    std::vector<char>                     charsByFreq;     // all the characters used, most frequent first
+    std::map<char, uint16_t>              freqMapKeywords; // frequency map for keywords
+
     uint8_t                               tk__packed_as_3n    = 0;
     uint8_t                               tk__max_keyword_len = 0;
 
@@ -569,421 +641,248 @@ class DataSetX16 : public DataSet
 // Work class implementation
 //
 
-void DictEncoder::addString(const std::string &inString, StringEncoded *outPtr)
+void DictEncoder::setCommonChars(const std::vector<char> &chars)
 {
-    // Store the pointer to encoding
-
-    encodings.push_back(outPtr);
+    commonChars = chars;
+}
 
-    // Check if string is already present in the dictionary
+void DictEncoder::setMaxEntries(size_t entries)
+{
+    maxEntries = std::min(entries, (size_t) 255);
+}
 
-    auto pos = std::find(dictionary.begin(), dictionary.end(), inString);
+void DictEncoder::addString(const std::string &inString, StringParsed *outPtr)
+{
+    // Store the pointer to encoding, identical strings are compressed only once
 
-    // Create initial encoding
+    encodings.push_back(outPtr);
 
-    if (pos != dictionary.end())
+    auto pos = std::find(inputStrings.begin(), inputStrings.end(), inString);
+    if (pos != inputStrings.end())
     {
-        encodings.back()->push_back(pos - dictionary.begin());
+        inputIndexes.push_back(pos - inputStrings.begin());
     }
     else
     {
-        if (dictionary.size() > 255)
-        {
-            ERROR("max 255 strings allowed for dictionary compression");
-        }
-
-        dictionary.push_back(inString);
-        encodings.back()->push_back(dictionary.size() - 1);
+        inputStrings.push_back(inString);
+        inputIndexes.push_back(inputStrings.size() - 1);
     }
 }
 
-
-void DictEncoder::extractWords(std::vector<std::string> &candidateList)
+size_t DictEncoder::calcNibbles(const std::string &str) const
 {
-    for (const auto &dictionaryEntry : dictionary)
+    size_t nibbles = 0;
+    for (const auto &character : str)
     {
-        // Split the dictionary entry into words
-       
-        std::istringstream entryStream(dictionaryEntry);
-        while (entryStream)
-        {
-            std::string word_1;
-            entryStream >> word_1;
+        nibbles += (std::find(commonChars.begin(), commonChars.end(), character) != commonChars.end()) ? 1 : 3;
+    }
+
+    return nibbles;
+}
 
-            if (word_1.empty()) continue;
-           
-            // Create possible variants with spaces
+size_t DictEncoder::calcCost(const Parsing &parsing, size_t &numEntries) const
+{
+    // Size after the frequency encoding - each dictionary reference takes 3 nibbles,
+    // each string and each dictionary entry needs an end of string mark
 
-            std::string word_2 = " " + word_1;
-            std::string word_3 = word_1 + " ";
-            std::string word_4 = word_2 + " ";
+    std::set<std::string> entries;
+    size_t cost = 0;
 
-            // If necessary, add the word to candidate list
-           
-            auto addToList = [&dictionaryEntry, &candidateList](std::string &word)
+    for (const auto &segments : parsing)
+    {
+        size_t nibbles = 0;
+        for (const auto &segment : segments)
+        {
+            if (segment.isPhrase)
+            {
+                nibbles += 3;
+                entries.insert(segment.text);
+            }
+            else
             {
-                // Before dding, make sure the word variant exists in the string,
-                // is not already on the list, and is long enough it makes sense to try
-
-                if (word.size() < 1) return;
-                if (dictionaryEntry.find(word) == std::string::npos) return;
-                if (std::find(candidateList.begin(), candidateList.end(), word) != candidateList.end()) return;
-
-                candidateList.push_back(word);
-            };
-           
-            addToList(word_1);
-            addToList(word_2);
-            addToList(word_3);
-            addToList(word_4);
+                nibbles += calcNibbles(segment.text);
+            }
         }
+
+        cost += (nibbles + 1) / 2 + 1;
     }
-}
 
-int32_t DictEncoder::evaluateCandidate(std::string &candidate)
-{
-    // XXX it looks like this is not 100% right - debug the algorithm if dictionary compression is reintroduced
+    for (const auto &entry : entries) cost += (calcNibbles(entry) + 1) / 2 + 1;
 
-    // Build the score - find how much bytes can be spared by extracting this particular candidate
-    // Limited size of the dictionary is taken into consideration
-   
-    int32_t  score      = -(candidate.size() + 1);
-    uint32_t targetSize = dictionary.size() + 1;
+    numEntries = entries.size();
+    return cost;
+}
 
-    // First check for situation when the candidate equals the currently existing dictionary entry
+void DictEncoder::findCandidates(const Parsing &parsing, std::vector<Candidate> &candidates) const
+{
+    // Build a suffix automaton over all the literal segments, separated by unique markers,
+    // so that no repeated substring crosses a segment boundary
 
-    for (const auto &dictionaryEntry : dictionary)
-    {   
-        if (dictionaryEntry == candidate)
+    typedef struct State
+    {
+        int32_t                    len;
+        int32_t                    link;
+        int32_t                    firstPos; // where the first occurence ends
+        uint32_t                   count;    // number of occurences
+        std::map<int32_t, int32_t> next;
+    } State;
+
+    std::vector<int32_t> text;
+    for (const auto &segments : parsing)
+    {
+        for (const auto &segment : segments)
         {
-            // Candidate equals the string
+            if (segment.isPhrase) continue;
 
-            score += candidate.size() + 1;
-            targetSize--;
-            continue;
+            for (const auto &character : segment.text) text.push_back((unsigned char) character);
+            text.push_back(0x100 + text.size());
         }
     }
 
-    // Now check the remaining cases
+    std::vector<State> states;
+    states.reserve(2 * text.size() + 1);
+    states.push_back({ 0, -1, -1, 0, {} });
 
-    for (const auto &dictionaryEntry : dictionary)
-    {   
-        if (dictionaryEntry == candidate) continue; // already handled
-
-        // Find all the occurences of the candidate in the current string
+    int32_t last = 0;
+    for (int32_t pos = 0; pos < (int32_t) text.size(); pos++)
+    {
+        const int32_t symbol  = text[pos];
+        const int32_t current = states.size();
+        states.push_back({ states[last].len + 1, 0, pos, 1, {} });
 
-        std::vector<uint8_t> occurences;
-        for (auto iter = dictionaryEntry.begin(); iter < (dictionaryEntry.end() - candidate.size() + 1); iter++)
+        int32_t prev = last;
+        while (prev != -1 && states[prev].next.count(symbol) == 0)
         {
-            if (candidate != std::string(iter, iter + candidate.size())) continue;
-           
-            occurences.push_back(iter - dictionaryEntry.begin());
-            iter += candidate.size() - 1; // to make sure we have no occurence overlapping
+            states[prev].next[symbol] = current;
+            prev = states[prev].link;
         }
-       
-        if (occurences.empty()) continue;
-       
-        // Now summarize what we are going to gain when doing replacement
-       
-        if (occurences[0] != 0)
-        {
-            // For the substring before the first occurence we need to create a separate entry
-            // in the dictionary - unless it is already there, it brings some additional cost
 
-            std::string otherStr = std::string(dictionaryEntry.begin(), dictionaryEntry.end() + occurences[0]);
-
-            if (std::find(dictionary.begin(), dictionary.end(), otherStr) != dictionary.end())
+        if (prev != -1)
+        {
+            const int32_t target = states[prev].next[symbol];
+            if (states[prev].len + 1 == states[target].len)
             {
-                // This extra string is already in the dictionary - that gives extra saving
-                score += otherStr.size() - 1;
+                states[current].link = target;
             }
             else
             {
-                // This extra string is not in the dictionary, it has to be added
-                score -= 2;
-                targetSize++;
+                const int32_t clone = states.size();
+                states.push_back({ states[prev].len + 1, states[target].link, states[target].firstPos, 0, states[target].next });
+
+                while (prev != -1 && states[prev].next[symbol] == target)
+                {
+                    states[prev].next[symbol] = clone;
+                    prev = states[prev].link;
+                }
+
+                states[target].link  = clone;
+                states[current].link = clone;
             }
         }
-       
-        for (auto iter = occurences.begin(); iter < occurences.end(); iter++)
-        {
-            // With a replacement, we should gain some bytes
-            score += candidate.size() - 1;
 
-            // If the occurence ends with the last byte of dictionary string - nothing more to do
-            if (*iter + candidate.size() == dictionaryEntry.size()) break;
-
-            // If next occurence starts immediately after this one - next iteration
-            if (iter + 1 != occurences.end() && (*(iter + 1) - *iter) == (uint8_t) candidate.size()) continue;
+        last = current;
+    }
 
-            // For the substring between this occurence and the next one (or the end of the string)
-            // we need to create a separate entry in the dictionary - unless it is already there,
-            // it brings some additional cost
+    // Propagate the occurence counts along the suffix links, longest states first
 
-            std::string otherStr;
-            if (iter + 1 == occurences.end())
-            {
-                otherStr = std::string(dictionaryEntry.begin() + *iter + candidate.size(),
-                                       dictionaryEntry.end());
-            }
-            else
-            {
-                otherStr = std::string(dictionaryEntry.begin() + *iter + candidate.size(),
-                                       dictionaryEntry.begin() + *(iter + 1));
-            }
+    std::vector<int32_t> order(states.size());
+    for (size_t idx = 0; idx < states.size(); idx++) order[idx] = idx;
+    std::sort(order.begin(), order.end(), [&states](int32_t a, int32_t b) { return states[a].len > states[b].len; });
 
-            if (std::find(dictionary.begin(), dictionary.end(), otherStr) != dictionary.end())
-            {
-                // This extra string is already in the dictionary - that gives extra saving
-                score += otherStr.size() - 1;
-            }
-            else
-            {
-                // This extra string is not in the dictionary, it has to be added
-                score -= 2;
-                targetSize++;
-            }           
-        }
-       
-        // We crossed the maximum number of strings (leave one free for the work buffer),
-        // do not consider this candidate
-       
-        if (targetSize > 254) return -1;
+    for (const auto &idx : order)
+    {
+        if (states[idx].link > 0) states[states[idx].link].count += states[idx].count;
     }
-   
-    return score;
-}
 
-void DictEncoder::cleanupDictionary()
-{
-    // Get rid of dictionary entries which are not needed anymore
-   
-    bool isClean = false;
-   
-    while (!isClean)
+    // All the substrings of a state have the same occurences, so the longest one is the best;
+    // estimate the gain from replacing each occurence with a 3-nibble reference
+
+    candidates.clear();
+    for (size_t idx = 1; idx < states.size(); idx++)
     {
-        isClean = true;
-       
-        for (auto iter = dictionary.begin(); iter < dictionary.end(); iter++)
-        {
-            if (!iter->empty()) continue;
-           
-            // Found an empty string in the dictionary - remove it and adapt encoding
-           
-            isClean = false;
-            uint8_t obsoleteStrIdx = iter - dictionary.begin();
-           
-            dictionary.erase(iter);
-           
-            for (auto &encoding : encodings) for (auto &byte : *encoding)
-            {
-                if (byte >= obsoleteStrIdx) byte--;
-            }
-           
-            break;
-        }
+        const auto &state = states[idx];
+        if (state.count < 2 || state.len < 2) continue;
+
+        std::string phrase;
+        for (int32_t pos = state.firstPos - state.len + 1; pos <= state.firstPos; pos++) phrase.push_back(text[pos]);
+
+        const int32_t nibbles = calcNibbles(phrase);
+        if (nibbles <= 3) continue;
+
+        candidates.push_back({ ((int32_t) state.count * (nibbles - 3) - nibbles) / 2 - 1, phrase });
     }
+
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b)
+    {
+        return (a.estimate != b.estimate) ? (a.estimate > b.estimate) : (a.phrase < b.phrase);
+    });
 }
 
-bool DictEncoder::optimizeSplit()
+DictEncoder::Parsing DictEncoder::applyPhrase(const Parsing &parsing, const std::string &phrase) const
 {
-    // XXX - The code here is not the best one - redesign and algorithm improvements
-    // (like - consider optimizing as a game and apply alpha-beta scheme to select the best
-    // candidate, incorporate frequency encoding into candidate evaluation) could result in
-    // a slightly better compression. But currently we have very few strings, and the dictionary
-    // compression is disabled by default - so right now this is not worth the effort.
-   
-    if (dictionary.size() >= 255) return false; // up to 255 entries in the dictionary are possible
-   
-    // First select words, which can potentially be extracted to new substrings
-   
-    std::vector<std::string> candidateList;
-    extractWords(candidateList);
+    // Split every literal segment on all the non-overlapping occurences of the phrase
 
-    // XXX possible future improvement: find a couple of largest common substrings and add them as candidates too
-   
-    // Now find the best word to be extracted
-   
-    auto bestCandidate         = candidateList.end();
-    int32_t bestCandidateScore = 0;
-   
-    for (auto iter = candidateList.begin(); iter < candidateList.end(); iter++)
+    Parsing result;
+    for (const auto &segments : parsing)
     {
-        int32_t candidateScore = evaluateCandidate(*iter);
+        result.emplace_back();
+        auto &newSegments = result.back();
 
-        if (candidateScore > bestCandidateScore)
+        for (const auto &segment : segments)
         {
-            bestCandidate      = iter;
-            bestCandidateScore = candidateScore;
-        }
-    }
-   
-    // Only allow for replacements that brings some size benefit
-   
-    if (bestCandidateScore < 1) return false;
-   
-    // Extract the best candidate to a separate string
-   
-    // First add our selected candidate to the dictionary and replace all strings which are equal to it
-   
-    auto    &selectedStr   = *bestCandidate;
-    uint8_t selectedStrIdx = dictionary.size();
-   
-    dictionary.push_back(selectedStr);
+            if (segment.isPhrase)
+            {
+                newSegments.push_back(segment);
+                continue;
+            }
 
-    for (auto iter = dictionary.begin(); iter < dictionary.end(); iter++)
-    {
-        uint8_t currentStrIdx = iter - dictionary.begin();
-       
-        if (*iter != selectedStr || selectedStrIdx == currentStrIdx) continue;
-       
-        // Replace the current string with the new one
-       
-        for (auto &encoding : encodings) for (auto &byte : *encoding)
-        {
-            if (byte == currentStrIdx) byte = selectedStrIdx;
+            size_t start = 0;
+            for (size_t pos = segment.text.find(phrase); pos != std::string::npos; pos = segment.text.find(phrase, start))
+            {
+                if (pos > start) newSegments.push_back({ segment.text.substr(start, pos - start), false });
+                newSegments.push_back({ phrase, true });
+                start = pos + phrase.size();
+            }
+
+            if (start < segment.text.size()) newSegments.push_back({ segment.text.substr(start), false });
         }
-       
-        // Mark obsolete dictionary entry as free for removal
-       
-        iter->clear();
     }
 
-    cleanupDictionary();
+    return result;
+}
 
-    // Now handle normal cases, when the string needs to be split
-    // XXX - this is not time-effective, optimize this in the future
+void DictEncoder::buildDictionary(const Parsing &parsing)
+{
+    dictionary.clear();
 
-    bool optimizeAgain = true;
-    bool nexIteration  = true;
-    while (nexIteration)
+    std::vector<StringParsed> inputParsed;
+    for (const auto &segments : parsing)
     {
-        nexIteration = false;
-
-        for (auto iter = dictionary.begin(); iter < dictionary.end(); iter++)
+        inputParsed.emplace_back();
+        for (const auto &segment : segments)
         {
-            auto    &currentStr     = *iter;
-            uint8_t currentStrIdx   = iter - dictionary.begin();   
-            auto    selectedStrIter = std::find(dictionary.begin(), dictionary.end(), selectedStr);
-            selectedStrIdx          = selectedStrIter - dictionary.begin();
-
-            if (currentStrIdx == selectedStrIdx) continue;
-   
-            // Check if the current string contains the selected string
-           
-            auto pos = currentStr.find(selectedStr);
-            if (pos == std::string::npos) continue;
-               
-            nexIteration  = true;
-            optimizeAgain = true;
-   
-            // Prepare replacement sequence for 'selectedStrIdx'
-               
-            std::vector<uint8_t> replacement;
-           
-            if (pos == 0)
-            {
-                // The current dictionary string starts with our selected substring
-               
-                replacement.push_back(selectedStrIdx);
-                currentStr = currentStr.substr(selectedStr.size(), currentStr.size() - selectedStr.size());
-               
-                if (!currentStr.empty())
-                {
-                    // Check if the remaining string is present somewhere else in the dictionary; if so, reuse it
-               
-                    uint8_t pos2 = currentStrIdx;
-                    for (auto iter2 = dictionary.begin(); iter2 < dictionary.end(); iter2++)
-                    {
-                        if (iter2 == iter) continue;
-                        if (currentStr == *iter2)
-                        {
-                            dictionary[pos2].clear();
-                            pos2 = iter2 - dictionary.begin();
-                            break;
-                        }
-                    }
-                   
-                    replacement.push_back(pos2);
-                }
-            }
-            else
+            if (!segment.isPhrase)
             {
-                // The current dictionary string does not start with our selected substring
-               
-                std::string newStr = currentStr.substr(0, pos);
-                currentStr         = currentStr.substr(pos, currentStr.size() - pos);
-               
-                // Check if the newStr is present somewhere else in the dictionary; if so, reuse it
-               
-                bool    found = false;
-                uint8_t pos2  = 0;
-                for (auto iter2 = dictionary.begin(); iter2 < dictionary.end(); iter2++)
-                {
-                    if (*iter2 == newStr)
-                    {
-                        found = true;
-                        pos2  = iter2 - dictionary.begin();
-
-                        break;
-                    }
-                }
-           
-                if (found)
-                {
-                    replacement.push_back(pos2);                   
-                }
-                else
-                {
-                    dictionary.push_back(newStr);
-                    replacement.push_back(dictionary.size() - 1);                   
-                }
-
-                replacement.push_back(currentStrIdx);
+                for (const auto &character : segment.text) inputParsed.back().push_back((unsigned char) character);
+                continue;
             }
 
-            // Now replace all the occurences of 'selectedStrIdx' with a 'replacement' vector
-
-            for (auto &encoding : encodings)
+            auto pos = std::find(dictionary.begin(), dictionary.end(), segment.text);
+            if (pos == dictionary.end())
             {
-                for (uint8_t idx = 0; idx < encoding->size(); idx++)
-                {
-                    if ((*encoding)[idx] != currentStrIdx) continue;
-                   
-                    // Perform replacement
-                   
-                    encoding->erase(encoding->begin() + idx);
-                   
-                    for (const auto replacementIdx : replacement)
-                    {
-                        encoding->insert(encoding->begin() + idx, replacementIdx);
-                        idx++;
-                    }
-                   
-                    idx--;
-                }
+                dictionary.push_back(segment.text);
+                pos = dictionary.end() - 1;
             }
-           
-            cleanupDictionary();
+
+            inputParsed.back().push_back(DICT_REF + (pos - dictionary.begin()));
         }
     }
 
-    return optimizeAgain;
-}
-
-bool DictEncoder::optimizeJoin()
-{
-    // Try to optimize by joining two substrings
-   
-    // XXX - possible future improvement
-   
-    return false;
+    for (size_t idx = 0; idx < encodings.size(); idx++) *encodings[idx] = inputParsed[inputIndexes[idx]];
 }
 
 void DictEncoder::optimizeOrder()
 {
-    // XXX - it would be better to do this after the dictionary is compressed
-
     // Try to optimize order of strings in the dictionary for fastest display
     // - put the shorter substrings first
     // - for strings with roughly the same length put more frequently used first
@@ -1008,9 +907,9 @@ void DictEncoder::optimizeOrder()
        
         for (auto &encoding : encodings)
         {
-            for (auto &byte : *encoding)
+            for (auto &value : *encoding)
             {
-                if (byte == (iter - dictionary.begin())) freqPenalty--;
+                if (value == DICT_REF + (iter - dictionary.begin())) freqPenalty--;
             }
         }
 
@@ -1026,8 +925,8 @@ void DictEncoder::optimizeOrder()
 
     // Determine ordering - sort from smallest penalty to largest
    
-    std::sort(optimizedOrder.begin(), optimizedOrder.end(),
-              [](const Entry &e1, const Entry &e2) { return e1.penalty < e2.penalty; });
+    std::stable_sort(optimizedOrder.begin(), optimizedOrder.end(),
+                     [](const Entry &e1, const Entry &e2) { return e1.penalty < e2.penalty; });
 
     // Create helper table for reordering
    
@@ -1043,9 +942,9 @@ void DictEncoder::optimizeOrder()
 
     // Perform the reordering
    
-    for (auto &encoding : encodings) for (auto &byte : *encoding)
+    for (auto &encoding : encodings) for (auto &value : *encoding)
     {
-        byte = reorderTable[byte];
+        if (value >= DICT_REF) value = DICT_REF + reorderTable[value - DICT_REF];
     }
    
     for (uint8_t idx = 0; idx < dictionary.size(); idx++) dictionary[idx] = optimizedOrder[idx].word;
@@ -1053,30 +952,68 @@ void DictEncoder::optimizeOrder()
 
 void DictEncoder::process(StringEntryList &outDictionary)
 {
-    if (dictionary.empty()) return;
-    // Optimize as long as it brings any improvement
+    if (inputStrings.empty()) return;
+
+    // Start with every string being a single literal segment
+
+    Parsing parsing;
+    for (const auto &inputString : inputStrings) parsing.push_back({ { inputString, false } });
+
+    size_t numEntries;
+    size_t cost = calcCost(parsing, numEntries);
+
+    const size_t sizeInitial = cost;
+
+    // Extract repeated substrings as long as it brings any improvement; the estimates
+    // from the suffix automaton are only used to select a few candidates to check exactly
+
+    const size_t MAX_CHECKED = 16;
+
+    std::vector<Candidate> candidates;
+    while (true)
+    {
+        findCandidates(parsing, candidates);
+
+        Parsing bestParsing;
+        size_t  bestCost = cost;
+
+        for (size_t idx = 0; idx < std::min(candidates.size(), MAX_CHECKED); idx++)
+        {
+            Parsing newParsing = applyPhrase(parsing, candidates[idx].phrase);
+
+            size_t newEntries;
+            const size_t newCost = calcCost(newParsing, newEntries);
+
+            if (newCost < bestCost && newEntries <= maxEntries)
+            {
+                bestParsing = std::move(newParsing);
+                bestCost    = newCost;
+            }
+        }
+
+        if (bestCost >= cost) break;
+
+        parsing = std::move(bestParsing);
+        cost    = bestCost;
+    }
+
+    calcCost(parsing, numEntries);
+    std::cout << "dictionary compression: " << inputStrings.size() << " strings, " << numEntries << " dictionary entries, " <<
+                 "estimated size " << sizeInitial << " -> " << cost << " bytes" << std::endl;
 
-    while (optimizeSplit() || optimizeJoin()) ;
+    buildDictionary(parsing);
     optimizeOrder();
 
     // Export the dictionary to external format
 
     outDictionary.type = ListType::DICTIONARY;
-    outDictionary.name = "DICTIONARY";
+    outDictionary.name = "dictionary";
 
     for (const auto &dictionaryStr : dictionary)
     {
-        StringEntry newEntry = { true, true, true, true, "", dictionaryStr };
+        StringEntry newEntry = { true, true, true, true, true, "", dictionaryStr };
         outDictionary.list.push_back(newEntry);
     }
-
-    // Adapt the encoding to external format (0 = end of string)
-
-    for (auto &encoding : encodings)
-    {
-        for (auto &byte : *encoding) byte++;
-        encoding->push_back(0);
-    }
 }
 
 bool DataSet::isCompressionLvl2(const StringEntryList &list) const
@@ -1084,12 +1021,26 @@ bool DataSet::isCompressionLvl2(const StringEntryList &list) const
     return (GLOBAL_ConfigOptions["COMPRESSION_LVL_2"] && list.type == ListType::STRINGS_BASIC);
 }
 
+bool DataSet::isTailMerged(const StringEntryList &list) const
+{
+    return (GLOBAL_ConfigOptions["COMPRESSION_TAIL_MERGE"] && list.type == ListType::STRINGS_BASIC);
+}
+
+bool DataSet::hasOffsets(const StringEntryList &list) const
+{
+    // Tail merged strings can only be accessed through the offset table
+
+    return ((GLOBAL_ConfigOptions["PACKED_OFFSETS"] || GLOBAL_ConfigOptions["COMPRESSION_TAIL_MERGE"]) &&
+            list.type == ListType::STRINGS_BASIC);
+}
+
 void DataSet::addStrings(const StringEntryList &stringList)
 {
     // Import the new list of strings
 
     stringEntryLists.push_back(stringList);
     stringEncodedLists.emplace_back();
+    stringParsedLists.emplace_back();
 
     // Clear strings not relevant for the current configuration
    
@@ -1117,6 +1068,7 @@ void DataSet::process()
     validateLists();
     encodeStringsDict();
     calculateFrequencies();
+    optimizeEncoding();
     encodeStringsFreq();   
     prepareOutput();
 }
@@ -1299,21 +1251,48 @@ void DataSet::encodeStringsDict()
 {
     DictEncoder dictEncoder;
 
+    // Dictionary size depends on the frequency encoding applied later - assume the characters
+    // most frequent in the plain strings will be encoded as 1 nibble
+
+    std::map<char, uint16_t> freqMap;
+    for (const auto &stringEntryList : stringEntryLists)
+    {
+        for (const auto &stringEntry : stringEntryList.list)
+        {
+            if (isRelevant(stringEntry)) for (const auto &character : stringEntry.string) freqMap[character]++;
+        }
+    }
+
+    std::vector<std::pair<uint16_t, char>> freqVector;
+    for (const auto &freqEntry : freqMap) freqVector.emplace_back(freqEntry.second, freqEntry.first);
+    std::sort(freqVector.begin(), freqVector.end(), std::greater<std::pair<uint16_t, char>>());
+
+    std::vector<char> commonChars;
+    for (size_t idx = 0; idx < std::min(freqVector.size(), (size_t) 14); idx++) commonChars.push_back(freqVector[idx].second);
+    dictEncoder.setCommonChars(commonChars);
+
+    // Dictionary references share the 3-nibble codes with the characters
+
+    dictEncoder.setMaxEntries(255 - (freqVector.size() - commonChars.size()));
+
     // Add strings for dictionary compresssion
 
     for (uint8_t idx = 0; idx < stringEntryLists.size(); idx++)
     {
         const auto &stringEntryList = stringEntryLists[idx];
-        auto &stringEncodedList     = stringEncodedLists[idx];
+        auto &stringParsedList      = stringParsedLists[idx];
 
         // Skip lists not to be encoded using the dictionary
         if (!isCompressionLvl2(stringEntryList)) continue;
 
-        stringEncodedList.resize(stringEntryList.list.size());
+        stringParsedList.resize(stringEntryList.list.size());
         for (uint8_t idxEntry = 0; idxEntry < stringEntryList.list.size(); idxEntry++)
         {
+            // Strings not relevant for the current configuration stay empty
+            if (!isRelevant(stringEntryList.list[idxEntry])) continue;
+
             dictEncoder.addString(stringEntryList.list[idxEntry].string,
-                                  &stringEncodedList[idxEntry]);
+                                  &stringParsedList[idxEntry]);
         }
     }
 
@@ -1324,24 +1303,35 @@ void DataSet::encodeStringsDict()
 
     // Add new lists
 
+    if (dictionary.list.empty()) return;
+
     stringEntryLists.push_back(dictionary);
     stringEncodedLists.emplace_back();
+    stringParsedLists.emplace_back();
 }
 
 void DataSet::calculateFrequencies()
 {
-    as1n.clear();
-    as3n.clear();
+    charsByFreq.clear();
+    freqMapKeywords.clear();
    
     std::map<char, uint16_t> freqMapGeneral;  // general character frequency map
-    std::map<char, uint16_t> freqMapKeywords; // frequency map for keywords
 
     // Calculate frequencies of characters in the strings
 
-    for (const auto &stringEntryList : stringEntryLists)
+    for (uint8_t idx = 0; idx < stringEntryLists.size(); idx++)
     {
-        // Skip lists encoded by the dictionary
-        if (isCompressionLvl2(stringEntryList)) continue;
+        const auto &stringEntryList = stringEntryLists[idx];
+
+        // For lists encoded by the dictionary only the characters outside of the dictionary references count
+        if (isCompressionLvl2(stringEntryList))
+        {
+            for (const auto &stringParsed : stringParsedLists[idx]) for (const auto &value : stringParsed)
+            {
+                if (value < DICT_REF) freqMapGeneral[value]++;
+            }
+            continue;
+        }
 
         for (const auto &stringEntry : stringEntryList.list)
         {
@@ -1357,39 +1347,42 @@ void DataSet::calculateFrequencies()
    
     // Sort characters by frequency
    
-    std::vector<char> freqVector1;
-   
     for (auto iter = freqMapGeneral.begin(); iter != freqMapGeneral.end(); ++iter)
     {
-        freqVector1.push_back(iter->first);
+        charsByFreq.push_back(iter->first);
     }
    
-    std::sort(freqVector1.begin(), freqVector1.end(), [&freqMapGeneral](char e1, char e2)
+    std::sort(charsByFreq.begin(), charsByFreq.end(), [&freqMapGeneral](char e1, char e2)
               { return freqMapGeneral[e2] < freqMapGeneral[e1]; });
 
     // Check if minimal amount of characters needed, below 15 is not supported by the 6502 side code
 
-    if (freqVector1.size() < 15) ERROR(std::string("not enough distinct characters in layout '") + layoutName() + "', at least 15 needed");
+    if (charsByFreq.size() < 15) ERROR(std::string("not enough distinct characters in layout '") + layoutName() + "', at least 15 needed");
 
-    // Extract 14 most frequent characters to be encoded as 1 nibble
+    // Encode 14 most frequent characters as 1 nibble
    
-    for (uint8_t idx = 0; idx < 14; idx++)
-    {
-        as1n.push_back(freqVector1[idx]);
-    }
+    assignEncoding(std::vector<char>(charsByFreq.begin(), charsByFreq.begin() + 14));
+}
+
+void DataSet::assignEncoding(const std::vector<char> &chars1n)
+{
+    // Extract 14 characters to be encoded as 1 nibble
+
+    as1n = chars1n;
+    as3n.clear();
    
     // Now sort them by frequency in keywords, in descending order - this will speed up the tokenizer a little
    
-    std::sort(as1n.begin(), as1n.end(), [&freqMapKeywords](char e1, char e2) { return freqMapKeywords[e2] > freqMapKeywords[e1]; });
+    std::sort(as1n.begin(), as1n.end(), [this](char e1, char e2) { return freqMapKeywords[e2] > freqMapKeywords[e1]; });
 
     // Extract characters to be encoded as 3 nibbles, which actually exist in keywords
 
     std::vector<char> freqVector2;
 
     tk__packed_as_3n = 0;
-    for (uint8_t idx = 14; idx < freqVector1.size(); idx++)
+    for (const auto &character : charsByFreq)
     {
-        const auto &character = freqVector1[idx];
+        if (std::find(chars1n.begin(), chars1n.end(), character) != chars1n.end()) continue;
        
         if (freqMapKeywords[character] > 0)
         {
@@ -1405,7 +1398,7 @@ void DataSet::calculateFrequencies()
 
     // Again, sort them by frequency in keywords, in descending order - this will speed up the tokenizer a little
    
-    std::sort(as3n.begin(), as3n.end(), [&freqMapKeywords](char e1, char e2) { return freqMapKeywords[e2] > freqMapKeywords[e1]; });
+    std::sort(as3n.begin(), as3n.end(), [this](char e1, char e2) { return freqMapKeywords[e2] > freqMapKeywords[e1]; });
 
     // Finally extract the remaining characters to be encoded as 3 nibbles
 
@@ -1415,7 +1408,78 @@ void DataSet::calculateFrequencies()
     }
 }
 
+void DataSet::optimizeEncoding()
+{
+    // Most frequent characters do not always give the fastest code - try to exchange 1-nibble
+    // encoded characters with the other ones, as long as the strings do not grow above the budget
+
+    const EncodingCost costHeuristic = calcEncodingCost();
+    const size_t       sizeLimit     = costHeuristic.size + CMD_sizeBudget;
+
+    std::vector<char> best1n(charsByFreq.begin(), charsByFreq.begin() + 14);
+    EncodingCost      bestCost = costHeuristic;
+
+    bool improved = true;
+    while (improved)
+    {
+        improved = false;
+
+        const auto current1n = best1n;
+        for (uint8_t idx = 0; idx < current1n.size(); idx++)
+        {
+            for (const auto &character : charsByFreq)
+            {
+                if (std::find(current1n.begin(), current1n.end(), character) != current1n.end()) continue;
+
+                // Keep the characters in frequency order, so that the result is deterministic
+
+                std::vector<char> candidate1n;
+                for (const auto &candidate : charsByFreq)
+                {
+                    if (candidate == character ||
+                        (candidate != current1n[idx] && std::find(current1n.begin(), current1n.end(), candidate) != current1n.end()))
+                    {
+                        candidate1n.push_back(candidate);
+                    }
+                }
+
+                assignEncoding(candidate1n);
+                const EncodingCost cost = calcEncodingCost();
+
+                if (cost.size <= sizeLimit && cost.total() < bestCost.total())
+                {
+                    best1n   = candidate1n;
+                    bestCost = cost;
+                    improved = true;
+                }
+            }
+        }
+    }
+
+    assignEncoding(best1n);
+
+    // Report the gain
+
+    auto printCost = [](const std::string &name, const EncodingCost &cost)
+    {
+        std::cout << "    " << std::left << std::setw(22) << name << std::right <<
+                     std::setw(8) << cost.size << std::setw(12) << cost.cyclesDecode <<
+                     std::setw(12) << cost.cyclesPack << std::setw(12) << cost.total() << std::endl;
+    };
+
+    std::cout << "encoding cost model, in bytes and 6502 cycles:" << std::endl;
+    std::cout << "    " << std::left << std::setw(22) << "" << std::right << std::setw(8) << "size" <<
+                 std::setw(12) << "decode" << std::setw(12) << "pack" << std::setw(12) << "total" << std::endl;
+    printCost("frequency heuristic", costHeuristic);
+    printCost("optimised", bestCost);
+}
+
 void DataSet::encodeByFreq(const std::string &plain, StringEncoded &encoded) const
+{
+    encodeByFreq(StringParsed(plain.begin(), plain.end()), encoded);
+}
+
+void DataSet::encodeByFreq(const StringParsed &parsed, StringEncoded &encoded) const
 {
     bool fullByte = true;
 
@@ -1447,10 +1511,23 @@ void DataSet::encodeByFreq(const std::string &plain, StringEncoded &encoded) con
         }
     };
 
-    // Encode every single character by frequency, put them in the output vector
+    // Encode every single character by frequency, put them in the output vector; dictionary
+    // references use the 3-nibble codes following the characters
 
-    for (const char &character : plain)
+    for (const auto &value : parsed)
     {
+        if (value >= DICT_REF)
+        {
+            const size_t code = as3n.size() + 1 + value - DICT_REF;
+            if (code > 0xFF) ERROR("too many dictionary entries");
+
+            push1n(0x0F);
+            push2n(code);
+            continue;
+        }
+
+        const char character = value;
+
         auto iterEncoding1 = std::find(as1n.begin(), as1n.end(), character);
         if (iterEncoding1 != as1n.end())
         {
@@ -1474,6 +1551,125 @@ void DataSet::encodeByFreq(const std::string &plain, StringEncoded &encoded) con
     if (encoded.size() == 0 || encoded.back() != 0) encoded.push_back(0);
 }
 
+size_t DataSet::calcDecodeCycles(const StringEncoded &encoded) const
+{
+    // Follows 'print_freq_packed_string', excluding the time needed to print the characters
+
+    const size_t CYCLES_LO_1N = 25; // low nibble, character encoded as 1 nibble
+    const size_t CYCLES_HI_1N = 41; // high nibble, character encoded as 1 nibble
+    const size_t CYCLES_LO_3N = 59; // low nibble, character encoded as 3 nibbles, split between 2 bytes
+    const size_t CYCLES_HI_3N = 38; // high nibble, character encoded as 3 nibbles
+    const size_t CYCLES_END   = 16; // end of string mark
+
+    auto getByte = [&encoded](size_t idx) -> uint8_t { return (idx < encoded.size()) ? encoded[idx] : 0; };
+
+    size_t cycles = 0;
+    size_t offset = 0;
+
+    while (true)
+    {
+        const uint8_t nibbleLo = getByte(offset) & 0x0F;
+        if (nibbleLo == 0x00) return cycles + CYCLES_END;
+
+        if (nibbleLo == 0x0F)
+        {
+            cycles += CYCLES_LO_3N;
+            offset++;
+        }
+        else
+        {
+            cycles += CYCLES_LO_1N;
+        }
+
+        const uint8_t nibbleHi = getByte(offset) >> 4;
+        if (nibbleHi == 0x00) return cycles + CYCLES_END;
+
+        if (nibbleHi == 0x0F)
+        {
+            cycles += CYCLES_HI_3N;
+            offset += 2;
+        }
+        else
+        {
+            cycles += CYCLES_HI_1N;
+            offset++;
+        }
+    }
+}
+
+size_t DataSet::calcPackCycles(const std::string &plain) const
+{
+    // Follows 'tk_pack', only the parts which depend on the encoding are counted
+
+    const size_t CYCLES_MISS     = 11; // single unsuccessful iteration of the character search loop
+    const size_t CYCLES_HIT      = 7;  // successful iteration
+    const size_t CYCLES_STORE_1N = 30; // storing a character encoded as 1 nibble, on average
+    const size_t CYCLES_STORE_3N = 52; // storing a character encoded as 3 nibbles, on average
+
+    size_t cycles = 0;
+
+    for (const auto &character : plain)
+    {
+        // Both lists are searched starting from the end
+
+        auto iterEncoding1 = std::find(as1n.begin(), as1n.end(), character);
+        if (iterEncoding1 != as1n.end())
+        {
+            cycles += std::distance(iterEncoding1, as1n.end() - 1) * CYCLES_MISS + CYCLES_HIT + CYCLES_STORE_1N;
+            continue;
+        }
+
+        auto iterEncoding3 = std::find(as3n.begin(), as3n.begin() + tk__packed_as_3n, character);
+        cycles += as1n.size() * CYCLES_MISS - 1 +
+                  std::distance(iterEncoding3, as3n.begin() + tk__packed_as_3n - 1) * CYCLES_MISS + CYCLES_HIT + CYCLES_STORE_3N;
+    }
+
+    return cycles;
+}
+
+size_t DataSet::calcSkipCycles(const StringEncoded &encoded)
+{
+    // Follows 'print_packed_search', time needed to skip the string; skipped strings are just a single byte
+
+    const size_t CYCLES_SKIP_STRING = 31;
+    const size_t CYCLES_SKIP_BYTE   = 12;
+
+    return CYCLES_SKIP_STRING + std::max(encoded.size(), (size_t) 1) * CYCLES_SKIP_BYTE;
+}
+
+EncodingCost DataSet::calcEncodingCost() const
+{
+    // Each string has to be found first - 'print_packed_search' skips all the preceding ones
+
+    EncodingCost cost;
+
+    for (uint8_t idx = 0; idx < stringEntryLists.size(); idx++)
+    {
+        const auto &stringEntryList = stringEntryLists[idx];
+
+        size_t cyclesSkip = 0;
+        for (uint8_t idxEntry = 0; idxEntry < stringEntryList.list.size(); idxEntry++)
+        {
+            const auto &stringEntry = stringEntryList.list[idxEntry];
+
+            StringEncoded stringEncoded;
+            encodeEntry(idx, idxEntry, stringEncoded);
+
+            cost.size += std::max(stringEncoded.size(), (size_t) 1); // skipped strings are just a single byte
+
+            if (!stringEncoded.empty())
+            {
+                cost.cyclesDecode += cyclesSkip + calcDecodeCycles(stringEncoded);
+                if (stringEntryList.type == ListType::KEYWORDS) cost.cyclesPack += calcPackCycles(stringEntry.string);
+            }
+
+            cyclesSkip += calcSkipCycles(stringEncoded);
+        }
+    }
+
+    return cost;
+}
+
 void DataSet::encodeStringsFreq()
 {
     // Encode every relevant string from every list - by character frequency
@@ -1483,24 +1679,33 @@ void DataSet::encodeStringsFreq()
         const auto &stringEntryList = stringEntryLists[idx];
         auto &stringEncodedList = stringEncodedLists[idx];
 
-        // Skip lists encoded by the dictionary
-        if (isCompressionLvl2(stringEntryList)) continue;
-
         // Perform frequency encoding of the list
 
-        for (const auto &stringEntry : stringEntryList.list)
+        for (uint8_t idxEntry = 0; idxEntry < stringEntryList.list.size(); idxEntry++)
         {
             stringEncodedList.emplace_back();
-            auto &stringEncoded = stringEncodedList.back();
-
-            if (isRelevant(stringEntry))
-            {
-                encodeByFreq(stringEntry.string, stringEncoded);
-            }
+            encodeEntry(idx, idxEntry, stringEncodedList.back());
         }
     }
 }
 
+void DataSet::encodeEntry(size_t idxList, size_t idxEntry, StringEncoded &encoded) const
+{
+    // Strings not relevant for the current configuration are left empty
+
+    const auto &stringEntry = stringEntryLists[idxList].list[idxEntry];
+    if (!isRelevant(stringEntry)) return;
+
+    if (isCompressionLvl2(stringEntryLists[idxList]))
+    {
+        encodeByFreq(stringParsedLists[idxList][idxEntry], encoded);
+    }
+    else
+    {
+        encodeByFreq(stringEntry.string, encoded);
+    }
+}
+
 void DataSet::putCharEncoding(std::ostringstream &stream, uint8_t idx, char character, bool is3n)
 {
     stream << "\t!byte $" << std::uppercase << std::hex <<
@@ -1585,16 +1790,10 @@ void DataSet::prepareOutput_labels(std::ostringstream &stream,
 
 void DataSet::prepareOutput_packed(std::ostringstream &stream,
                                    const StringEntryList &stringEntryList,
-                                   const StringEncodedList &stringEncodedList)
+                                   const StringEncodedList &stringEncodedList,
+                                   const PackedLayout *layout)
 {
-    if (isCompressionLvl2(stringEntryList))
-    {
-        stream << std::endl << "!macro PUT_PACKED_DICT_";
-    }
-    else
-    {
-        stream << std::endl << "!macro PUT_PACKED_FREQ_";           
-    }
+    stream << std::endl << "!macro PUT_PACKED_FREQ_";
 
     stream << stringEntryList.name << " {" << std::endl << std::endl;
 
@@ -1603,6 +1802,10 @@ void DataSet::prepareOutput_packed(std::ostringstream &stream,
     {
         const auto &stringEncoded = stringEncodedList[idxString];
 
+        // With tail merging, only the strings which are not a tail of another one are stored
+
+        if (layout != nullptr && layout->owners[idxString] != idxString) continue;
+
         if (stringEncoded.empty())
         {
             if (stringEntryList.type == ListType::DICTIONARY) ERROR("internal error"); // should never happen
@@ -1642,6 +1845,14 @@ void DataSet::prepareOutput_packed(std::ostringstream &stream,
             }
             stream << "'" << std::endl;
 
+            // Output the strings sharing the tail - as a comment
+
+            for (size_t idxTail = 0; layout != nullptr && idxTail < layout->owners.size(); idxTail++)
+            {
+                if (idxTail == idxString || layout->owners[idxTail] != idxString) continue;
+                stream << "\t; tail shared by IDX__" << stringEntryList.list[idxTail].alias << std::endl;
+            }
+
             // Output the encoding
 
             stream << "\t!byte ";
@@ -1677,6 +1888,341 @@ void DataSet::prepareOutput_packed(std::ostringstream &stream,
     stream << "}" << std::endl;
 }
 
+void DataSet::calcLayout(const StringEncodedList &stringEncodedList, bool tailMerge, PackedLayout &layout)
+{
+    // Strings are accessed through the offset table, so with tail merging a string which is identical
+    // to the end of another one (like 'FILE NOT FOUND' and 'LOOP NOT FOUND', if the common part starts
+    // at the byte boundary) does not need to be stored at all; skipped strings share any end of string mark
+
+    const StringEncoded skipped = { 0x00 };
+    auto getEncoded = [&](size_t idx) -> const StringEncoded & {
+        return stringEncodedList[idx].empty() ? skipped : stringEncodedList[idx];
+    };
+
+    // Place the longest strings first, remember all their tails
+
+    std::vector<size_t> order(stringEncodedList.size());
+    for (size_t idx = 0; idx < order.size(); idx++) order[idx] = idx;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return getEncoded(a).size() > getEncoded(b).size(); });
+
+    std::map<StringEncoded, std::pair<size_t, size_t>> tails; // owner and offset within the owner, for each tail
+    std::vector<size_t> offsetsInOwner(order.size());
+
+    layout.owners.resize(order.size());
+    for (const auto &idx : order)
+    {
+        const auto &encoded = getEncoded(idx);
+
+        const auto iter = tailMerge ? tails.find(encoded) : tails.end();
+        if (iter != tails.end())
+        {
+            layout.owners[idx]  = iter->second.first;
+            offsetsInOwner[idx] = iter->second.second;
+            continue;
+        }
+
+        layout.owners[idx]  = idx;
+        offsetsInOwner[idx] = 0;
+
+        for (size_t start = 0; tailMerge && start < encoded.size(); start++)
+        {
+            tails.emplace(StringEncoded(encoded.begin() + start, encoded.end()), std::make_pair(idx, start));
+        }
+    }
+
+    // Stored strings keep their original order
+
+    std::vector<size_t> ownerOffsets(order.size());
+    layout.size = 0;
+    for (size_t idx = 0; idx < order.size(); idx++)
+    {
+        if (layout.owners[idx] != idx) continue;
+
+        ownerOffsets[idx] = layout.size;
+        layout.size      += getEncoded(idx).size();
+    }
+
+    layout.offsets.resize(order.size());
+    for (size_t idx = 0; idx < order.size(); idx++)
+    {
+        layout.offsets[idx] = ownerOffsets[layout.owners[idx]] + offsetsInOwner[idx];
+    }
+
+    // If possible, use single byte offsets - relative to the list start
+
+    const bool fitsByte = std::all_of(layout.offsets.begin(), layout.offsets.end(), [](size_t offset) { return offset <= 0xFF; });
+    layout.width = fitsByte ? 1 : 2;
+}
+
+void DataSet::prepareOutput_offsets(std::ostringstream &stream,
+                                    const StringEntryList &stringEntryList,
+                                    const PackedLayout *layout)
+{
+    // Export the offset table width, 0 means the strings have to be searched
+
+    const uint8_t width = (layout != nullptr) ? layout->width : 0;
+
+    stream << std::endl << "!set PACKED_OFFSETS_WIDTH_" << stringEntryList.name << " = " << +width << std::endl;
+
+    if (layout == nullptr) return;
+
+    const size_t BYTES_PER_LINE = 8;
+
+    if (width == 1)
+    {
+        // Single byte offsets, relative to the start of the list
+
+        stream << std::endl << "!macro PUT_PACKED_OFFSETS_" << stringEntryList.name << " {" << std::endl;
+
+        for (size_t idx = 0; idx < layout->offsets.size(); idx++)
+        {
+            stream << ((idx % BYTES_PER_LINE == 0) ? "\n\t!byte " : ", ") << "$" <<
+                      std::uppercase << std::hex << std::setfill('0') << std::setw(2) << layout->offsets[idx];
+        }
+
+        stream << std::endl << "}" << std::endl;
+        return;
+    }
+
+    // Absolute addresses, split into low and high bytes, so that they can be indexed directly by .X
+
+    for (const auto &part : { std::make_pair("LO", "<"), std::make_pair("HI", ">") })
+    {
+        stream << std::endl << "!macro PUT_PACKED_OFFSETS_" << part.first << "_" << stringEntryList.name <<
+                  " @base {" << std::endl;
+
+        for (size_t idx = 0; idx < layout->offsets.size(); idx++)
+        {
+            stream << ((idx % BYTES_PER_LINE == 0) ? "\n\t!byte " : ", ") << part.second << "(@base + $" <<
+                      std::uppercase << std::hex << std::setfill('0') << std::setw(4) << layout->offsets[idx] << ")";
+        }
+
+        stream << std::endl << "}" << std::endl;
+    }
+}
+
+void DataSet::prepareOutput_offsetsReport(std::ostringstream &stream,
+                                          const StringEntryList &stringEntryList,
+                                          const StringEncodedList &stringEncodedList)
+{
+    // Compare the ways to locate a string - code sizes and cycles follow 'print_packed_error',
+    // the part common for all of them ('print_packed_search' with nothing to skip) is not included
+
+    const size_t CODE_SEARCH   = 6;
+    const size_t CODE_BYTE     = 15;
+    const size_t CODE_WORD     = 10;
+    const size_t CYCLES_SEARCH = 7;
+    const size_t CYCLES_BYTE   = 18;
+    const size_t CYCLES_WORD   = 13;
+
+    if (stringEncodedList.empty()) return;
+
+    PackedLayout layoutPlain, layoutMerged;
+    calcLayout(stringEncodedList, false, layoutPlain);
+    calcLayout(stringEncodedList, true, layoutMerged);
+
+    size_t cyclesSkip  = 0;
+    size_t cyclesTotal = 0;
+    for (const auto &stringEncoded : stringEncodedList)
+    {
+        cyclesTotal += cyclesSkip;
+        cyclesSkip  += calcSkipCycles(stringEncoded);
+    }
+
+    typedef struct Variant {
+        std::string name;
+        size_t      data;
+        size_t      table;
+        size_t      code;
+        size_t      cycles; // average, to locate a string
+    } Variant;
+
+    auto makeVariant = [&](const std::string &name, const PackedLayout &layout) -> Variant {
+        const bool isByte = (layout.width == 1);
+        return { name, layout.size, layout.width * layout.offsets.size(),
+                 isByte ? CODE_BYTE : CODE_WORD, isByte ? CYCLES_BYTE : CYCLES_WORD };
+    };
+
+    const std::vector<Variant> variants = {
+        { "linear search", layoutPlain.size, 0, CODE_SEARCH, CYCLES_SEARCH + cyclesTotal / stringEncodedList.size() },
+        makeVariant("offset table", layoutPlain),
+        makeVariant("tail merging", layoutMerged)
+    };
+
+    std::ostringstream report;
+    report << "access to the '" << stringEntryList.name << "' strings, size in bytes and 6502 cycles:" << std::endl <<
+              std::left << std::setw(22) << "" << std::right << std::setw(8) << "data" << std::setw(8) << "table" <<
+              std::setw(8) << "code" << std::setw(8) << "total" << std::setw(10) << "locate" << std::endl;
+
+    for (const auto &variant : variants)
+    {
+        report << "    " << std::left << std::setw(18) << variant.name << std::right <<
+                  std::setw(8) << variant.data << std::setw(8) << variant.table << std::setw(8) << variant.code <<
+                  std::setw(8) << variant.data + variant.table + variant.code << std::setw(10) << variant.cycles << std::endl;
+    }
+
+    // Print the report, and put it into the output file too - to help choosing the configuration
+
+    std::cout << report.str();
+
+    stream << std::endl;
+    std::istringstream lines(report.str());
+    for (std::string line; std::getline(lines, line);) stream << "; " << line << std::endl;
+}
+
+uint8_t DataSet::calcKeywordHash(const StringEncoded &encoded, uint8_t seed)
+{
+    // Has to match the calculation in 'tk_hash_search' - only the first 3 bytes are hashed,
+    // candidate packed by the tokeniser is padded with zeros
+
+    auto getByte = [&encoded](size_t idx) -> uint8_t { return (idx < encoded.size()) ? encoded[idx] : 0; };
+
+    return ((getByte(0) ^ seed) + getByte(1)) ^ getByte(2);
+}
+
+void DataSet::prepareOutput_hashIndex(std::ostringstream &stream)
+{
+    // Collect all the keywords, from all the lists - in the order the tokeniser
+    // used to search them, so that the first match stays the same
+
+    typedef struct HashEntry {
+        const StringEncoded *encoded;
+        std::string          address;
+        uint8_t              listId;
+        uint8_t              token;
+        std::string          comment;
+    } HashEntry;
+
+    std::vector<HashEntry> entries;
+
+    for (uint8_t idxList = 0; idxList < stringEntryLists.size(); idxList++)
+    {
+        const auto &stringEntryList   = stringEntryLists[idxList];
+        const auto &stringEncodedList = stringEncodedLists[idxList];
+
+        if (stringEntryList.type != ListType::KEYWORDS) continue;
+
+        // List identifiers are the same as the extended token prefixes, 0 for BASIC V2
+
+        const std::string listSuffix = stringEntryList.name.substr(stringEntryList.name.find('_') + 1);
+        const uint8_t     listId     = (listSuffix == "V2") ? 0 : strtoul(listSuffix.c_str(), nullptr, 16);
+
+        size_t offset = 0;
+        for (uint8_t idxString = 0; idxString < stringEncodedList.size(); idxString++)
+        {
+            const auto &stringEncoded = stringEncodedList[idxString];
+
+            // Skipped keywords occupy 1 byte and can never match
+
+            if (stringEncoded.empty())
+            {
+                offset++;
+                continue;
+            }
+
+            std::ostringstream address;
+            address << "packed_freq_" << stringEntryList.name << " + $" <<
+                       std::uppercase << std::hex << std::setfill('0') << std::setw(2) << offset;
+
+            entries.push_back({ &stringEncoded, address.str(), listId, idxString,
+                                "IDX__" + stringEntryList.list[idxString].alias + " '" + stringEntryList.list[idxString].string + "'" });
+            offset += stringEncoded.size();
+        }
+    }
+
+    if (entries.empty() || entries.size() > 0xFF) ERROR("unable to create keyword hash index");
+
+    // Size the index for about 2 keywords per bucket, to keep it small enough for the ROM;
+    // select the seed which gives the shortest buckets
+
+    size_t numBuckets = 1;
+    while (numBuckets * 2 < entries.size()) numBuckets *= 2;
+
+    const uint8_t mask = numBuckets - 1;
+
+    uint8_t bestSeed  = 0;
+    size_t  bestMax   = SIZE_MAX;
+    size_t  bestProbe = SIZE_MAX;
+
+    for (uint16_t seed = 0; seed <= 0xFF; seed++)
+    {
+        std::vector<size_t> bucketSizes(numBuckets, 0);
+        for (const auto &entry : entries) bucketSizes[calcKeywordHash(*entry.encoded, seed) & mask]++;
+
+        size_t maxSize  = 0;
+        size_t sumProbe = 0; // total number of comparisons needed to find all the keywords
+        for (const auto &bucketSize : bucketSizes)
+        {
+            maxSize   = std::max(maxSize, bucketSize);
+            sumProbe += bucketSize * (bucketSize + 1) / 2;
+        }
+
+        if (maxSize < bestMax || (maxSize == bestMax && sumProbe < bestProbe))
+        {
+            bestSeed  = seed;
+            bestMax   = maxSize;
+            bestProbe = sumProbe;
+        }
+    }
+
+    // Sort the keywords by bucket, stable - to keep the search order within a bucket
+
+    std::stable_sort(entries.begin(), entries.end(), [&](const HashEntry &a, const HashEntry &b) -> bool
+    {
+        return (calcKeywordHash(*a.encoded, bestSeed) & mask) < (calcKeywordHash(*b.encoded, bestSeed) & mask);
+    });
+
+    std::cout << "keyword hash index: " << entries.size() << " keywords, " << numBuckets <<
+                 " buckets, longest one has " << bestMax << " keywords" << std::endl;
+
+    // Export the hash parameters
+
+    stream << std::endl << "!set TK__HASH_SEED = $" << std::uppercase << std::hex << std::setfill('0') << std::setw(2) << +bestSeed <<
+              std::endl << "!set TK__HASH_MASK = $" << std::uppercase << std::hex << std::setfill('0') << std::setw(2) << +mask << std::endl;
+
+    // Export the bucket boundaries
+
+    stream << std::endl << "!macro PUT_TK_HASH_BUCKETS { ; start of each bucket, and the end of the last one" << std::endl << std::endl;
+
+    size_t idxEntry = 0;
+    for (size_t idxBucket = 0; idxBucket <= numBuckets; idxBucket++)
+    {
+        while (idxEntry < entries.size() && (calcKeywordHash(*entries[idxEntry].encoded, bestSeed) & mask) < idxBucket) idxEntry++;
+
+        stream << ((idxBucket % 8 == 0) ? "\t!byte " : ", ") << "$" <<
+                  std::uppercase << std::hex << std::setfill('0') << std::setw(2) << idxEntry;
+        if (idxBucket % 8 == 7 || idxBucket == numBuckets) stream << std::endl;
+    }
+
+    stream << "}" << std::endl;
+
+    // Export the keyword tables - addresses within the packed lists, list identifiers, and tokens
+
+    auto putTable = [&](const std::string &name, const std::string &description, auto getValue)
+    {
+        stream << std::endl << "!macro PUT_TK_HASH_" << name << " { ; " << description << std::endl << std::endl;
+
+        for (const auto &entry : entries)
+        {
+            stream << "\t!byte " << getValue(entry) << "    ; " << entry.comment << std::endl;
+        }
+
+        stream << "}" << std::endl;
+    };
+
+    auto toHex = [](uint8_t value) -> std::string
+    {
+        std::ostringstream hexStream;
+        hexStream << "$" << std::uppercase << std::hex << std::setfill('0') << std::setw(2) << +value;
+        return hexStream.str();
+    };
+
+    putTable("ADDR_LO", "keyword address, low byte",  [](const HashEntry &entry) { return "<(" + entry.address + ")"; });
+    putTable("ADDR_HI", "keyword address, high byte", [](const HashEntry &entry) { return ">(" + entry.address + ")"; });
+    putTable("LIST",    "keyword list, 0 = BASIC V2", [&](const HashEntry &entry) { return toHex(entry.listId); });
+    putTable("TOKEN",   "token index within the list", [&](const HashEntry &entry) { return toHex(entry.token); });
+}
+
 void DataSet::prepareOutput()
 {
     // Convert our encoded strings to a KickAssembler source
@@ -1692,6 +2238,13 @@ void DataSet::prepareOutput()
     stream << std::endl << "!set TK__PACKED_AS_3N    = $" << std::hex << +tk__packed_as_3n <<
               std::endl << "!set TK__MAX_KEYWORD_LEN = "  << std::dec << +tk__max_keyword_len << std::endl;
 
+    // Export the first 3-nibble code used for dictionary references
+
+    if (GLOBAL_ConfigOptions["COMPRESSION_LVL_2"])
+    {
+        stream << std::endl << "!set PACKED_DICT_BASE = $" << std::hex << as3n.size() + 1 << std::dec << std::endl;
+    }
+
     // Export encoded strings
 
     for (uint8_t idx = 0; idx < stringEntryLists.size(); idx++)
@@ -1713,11 +2266,32 @@ void DataSet::prepareOutput()
                       std::dec << stringEncodedList.size() << std::endl;
         }
 
-        // Export the packed data
+        // Export the packed data, and the offset tables if requested
 
-        prepareOutput_packed(stream, stringEntryList, stringEncodedList);
+        if (stringEntryList.type == ListType::STRINGS_BASIC)
+        {
+            prepareOutput_offsetsReport(stream, stringEntryList, stringEncodedList);
+        }
+
+        if (hasOffsets(stringEntryList))
+        {
+            PackedLayout layout;
+            calcLayout(stringEncodedList, isTailMerged(stringEntryList), layout);
+
+            prepareOutput_packed(stream, stringEntryList, stringEncodedList, &layout);
+            prepareOutput_offsets(stream, stringEntryList, &layout);
+        }
+        else
+        {
+            prepareOutput_packed(stream, stringEntryList, stringEncodedList);
+            if (stringEntryList.type == ListType::STRINGS_BASIC) prepareOutput_offsets(stream, stringEntryList, nullptr);
+        }
     }
 
+    // Export the keyword hash index for the tokeniser
+
+    prepareOutput_hashIndex(stream);
+
     // Finalize the file stream
 
     stream << std::endl;
@@ -1789,7 +2363,8 @@ void parseConfigFile()
 void printUsage()
 {
     std::cout << "\n" <<
-        "usage: generate_strings [-o <out file>] [-c <configuration file>]" << "\n\n";
+        "usage: generate_strings [-o <out file>] [-c <configuration file>]" << "\n" <<
+        "                        [-b <bytes the strings may grow by to decode faster>]" << "\n\n";
 }
 
 void printBanner()
@@ -1805,12 +2380,13 @@ void parseCommandLine(int argc, char **argv)
 
     // Retrieve command line options
 
-    while ((opt = getopt(argc, argv, "o:c:")) != -1)
+    while ((opt = getopt(argc, argv, "o:c:b:")) != -1)
     {
         switch(opt)
         {
             case 'o': CMD_outFile   = optarg; break;
             case 'c': CMD_cnfFile   = optarg; break;
+            case 'b': CMD_sizeBudget = strtoul(optarg, nullptr, 10); break;
             default: printUsage(); ERROR();
         }
     }